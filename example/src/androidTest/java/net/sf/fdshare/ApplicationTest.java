@@ -18,6 +18,10 @@ import java.io.File;
 import java.io.FileNotFoundException;
 import java.io.FileOutputStream;
 import java.io.IOException;
+import java.util.ArrayList;
+import java.util.Arrays;
+import java.util.List;
+import java.util.concurrent.atomic.AtomicReferenceArray;
 
 @RunWith(AndroidJUnit4.class)
 public class ApplicationTest {
@@ -70,4 +74,42 @@ public class ApplicationTest {
             }
         }
     }
-}
\ No newline at end of file
+
+    @Test
+    public void testBatchTypeGuessing() throws IOException, InterruptedException {
+        final File dir = new File(provider.getContext().getFilesDir(), "batch");
+        Assert.assertTrue(dir.isDirectory() || dir.mkdir());
+
+        final List<String> paths = new ArrayList<>();
+
+        try {
+            for (int i = 0; i < BaseProvider.BATCH_SIZE + 3; i++) {
+                final File file = new File(dir, "file" + i);
+
+                try (FileOutputStream fos = new FileOutputStream(file)) {
+                    fos.write("%PDF-1.4\n".getBytes());
+                }
+
+                paths.add(file.getAbsolutePath());
+            }
+
+            paths.add(new File(dir, "missing").getAbsolutePath());
+
+            final AtomicReferenceArray<String[]> results = new AtomicReferenceArray<>(paths.size());
+
+            // callbacks run on worker threads, so only collect results there
+            provider.guessTypes(paths, (index, filePath, types, size) ->
+                    results.set(index, paths.get(index).equals(filePath) ? types : null));
+
+            for (int i = 0; i < paths.size() - 1; i++)
+                Assert.assertTrue(Arrays.asList(results.get(i)).contains("application/pdf"));
+
+            Assert.assertEquals("application/octet-stream", results.get(paths.size() - 1)[0]);
+        } finally {
+            for (String path : paths)
+                new File(path).delete();
+
+            dir.delete();
+        }
+    }
+}
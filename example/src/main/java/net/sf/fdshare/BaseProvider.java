@@ -16,6 +16,7 @@
 package net.sf.fdshare;
 
 import android.annotation.SuppressLint;
+import android.annotation.TargetApi;
 import android.content.ContentProvider;
 import android.content.ContentValues;
 import android.content.res.AssetFileDescriptor;
@@ -24,11 +25,15 @@ import android.database.MatrixCursor;
 import android.net.Uri;
 import android.os.AsyncTask;
 import android.os.Binder;
+import android.os.Build;
 import android.os.Bundle;
 import android.os.ParcelFileDescriptor;
 import android.provider.MediaStore;
+import android.system.ErrnoException;
+import android.system.Os;
 import android.provider.OpenableColumns;
 import android.support.annotation.NonNull;
+import android.support.annotation.Nullable;
 import android.support.v4.util.LruCache;
 import android.text.TextUtils;
 import android.util.Log;
@@ -36,25 +41,36 @@ import android.webkit.MimeTypeMap;
 import com.j256.simplemagic.ContentInfo;
 import com.j256.simplemagic.ContentInfoUtil;
 import com.j256.simplemagic.ContentType;
+import net.sf.fdshare.internal.FdCompat;
+import net.sf.fdshare.internal.FdInfo;
 import net.sf.mymodule.example.*;
 import net.sf.mymodule.example.BuildConfig;
 import org.w3c.dom.Text;
 
 import java.io.File;
+import java.io.FileDescriptor;
 import java.io.FileInputStream;
 import java.io.FileNotFoundException;
 import java.io.IOException;
 import java.util.ArrayList;
+import java.util.Arrays;
+import java.util.Collections;
 import java.util.LinkedHashSet;
+import java.util.List;
 import java.util.Set;
 import java.util.Timer;
+import java.util.concurrent.CountDownLatch;
+import java.util.concurrent.ExecutorService;
+import java.util.concurrent.Executors;
 import java.util.concurrent.Future;
+import java.util.concurrent.Semaphore;
 import java.util.concurrent.atomic.AtomicReference;
 
 /**
  * A base ContentProvider class, using libmagic mime database to detect real type of files.
  *
- * Uses time-based caching of file metadata.
+ * Uses time-based caching of file metadata, backed by persistent cache of detected types, keyed by inode,
+ * size and modification time of the file (see {@link MimeCache}).
  *
  * SimpleFileProvider and RootFileProvider are separated from this and each other, because security nature of
  * their permissions is completely different, and they don't have to always be used together that way.
@@ -62,9 +78,21 @@ import java.util.concurrent.atomic.AtomicReference;
 public abstract class BaseProvider extends ContentProvider {
     private static final MimeTypeMap map = MimeTypeMap.getSingleton();
 
+    static final int BATCH_SIZE = 64;
+
+    // magic rules rarely look further than that
+    static final int HEADER_SIZE = 4096;
+
+    private static final ThreadLocal<byte[]> headerBuffer = new ThreadLocal<byte[]>() {
+        @Override
+        protected byte[] initialValue() {
+            return new byte[HEADER_SIZE];
+        }
+    };
+
     private final ContentInfoUtil mimeLib = new ContentInfoUtil();
 
-    private final LruCache<String, TimestampedMime> fileTypeCache = new LruCache<>(7);
+    private final LruCache<String, TimestampedMime> fileTypeCache = new LruCache<>(64);
 
     private static class TimestampedMime {
         long size = -1;
@@ -72,6 +100,43 @@ public abstract class BaseProvider extends ContentProvider {
         String[] mime;
     }
 
+    // state of a single file between opening it and publishing it's type
+    private static final class Detection {
+        final int index;
+        final String filePath;
+        final ParcelFileDescriptor fd;
+
+        byte[] header;
+
+        long size = -1;
+        long dev;
+        long inode;
+        long modified;
+
+        MimeCache cache;
+        String detected;
+
+        Detection(int index, String filePath, ParcelFileDescriptor fd) {
+            this.index = index;
+            this.filePath = filePath;
+            this.fd = fd;
+        }
+
+        boolean needsSniffing() {
+            return detected == null && (fd != null || header != null);
+        }
+    }
+
+    // shared by all providers in the process, libmagic matching is CPU-bound
+    private static final class DetectionPool {
+        static final ExecutorService executor = Executors.newFixedThreadPool(
+                Math.max(2, Math.min(4, Runtime.getRuntime().availableProcessors())), r -> {
+                    final Thread thread = new Thread(r, "mime detection");
+                    thread.setDaemon(true);
+                    return thread;
+                });
+    }
+
     @Override
     public boolean onCreate() {
         return true;
@@ -110,20 +175,334 @@ public abstract class BaseProvider extends ContentProvider {
         return acceptedTypes.isEmpty() ? null : acceptedTypes.toArray(new String[acceptedTypes.size()]);
     }
 
+    @Override
+    public Uri canonicalize(@NonNull Uri url) {
+        final String canonicalPath = canonicalizePath(url.getPath());
+
+        return canonicalPath == null ? null : url.buildUpon().path(canonicalPath).build();
+    }
+
+    private MimeCache getMimeCache() {
+        return MimeCache.get(getContext());
+    }
+
     abstract ParcelFileDescriptor openDescriptor(String filePath, String mode, boolean secure) throws FileNotFoundException;
 
+    /**
+     * Open several files for reading at once. The default implementation calls {@link #openDescriptor} for
+     * each of them, subclasses may override it to do the same in fewer round-trips.
+     *
+     * @return descriptors in the same order as paths, with null in place of each file, that could not be opened
+     */
+    ParcelFileDescriptor[] openDescriptors(List<String> filePaths) {
+        final ParcelFileDescriptor[] result = new ParcelFileDescriptor[filePaths.size()];
+
+        for (int i = 0; i < result.length; i++) {
+            try {
+                result[i] = openDescriptor(filePaths.get(i), "r", false);
+            } catch (FileNotFoundException ignored) {
+                // leave it null
+            }
+        }
+
+        return result;
+    }
+
+    /**
+     * Read first {@value #HEADER_SIZE} bytes of several files without opening them in this process, if the
+     * subclass is able to. The default implementation is not.
+     *
+     * @return headers in the same order as paths, with null in place of each file, that could not be read,
+     * or null if files have to be opened via {@link #openDescriptors} instead
+     */
+    @Nullable FileHeader[] readHeaders(List<String> filePaths) {
+        return null;
+    }
+
+    /**
+     * @return canonical form of the path, or null if it can not be determined (e.g. the file does not exist)
+     */
+    abstract String canonicalizePath(String filePath);
+
+    /**
+     * Receives results of {@link #guessTypes}, in order of completion rather than order of files. May be
+     * called on several threads at once.
+     */
+    public interface TypeCallback {
+        /**
+         * @param index position of the file in the list, passed to {@link #guessTypes}
+         * @param types guessed types, never empty
+         * @param size size of the file, or -1 if it could not be opened
+         */
+        void onTypeGuessed(int index, @NonNull String filePath, @NonNull String[] types, long size);
+    }
+
+    /**
+     * Guess types of several files, as {@link #getStreamTypes} would do for each of them. Headers of files are
+     * read {@value #BATCH_SIZE} at once via {@link #readHeaders} or {@link #openDescriptors}, and those, not found
+     * in cache, are matched against libmagic database on a shared pool of worker threads.
+     *
+     * <p>
+     *
+     * The method returns after the callback has been called for each file. If the calling thread is
+     * interrupted, the results for files, that have already been opened, may arrive after it returns.
+     *
+     * <b>Do not call this method from the main thread!</b>
+     */
     @SuppressLint("NewApi")
+    public void guessTypes(@NonNull List<String> filePaths, @NonNull TypeCallback callback) throws InterruptedException {
+        final CountDownLatch remaining = new CountDownLatch(filePaths.size());
+
+        // limits number of open descriptors (or headers in memory), waiting for a worker
+        final Semaphore opened = new Semaphore(BATCH_SIZE * 2);
+
+        final ArrayList<String> batch = new ArrayList<>(BATCH_SIZE);
+        final int[] indices = new int[BATCH_SIZE];
+
+        for (int start = 0; start < filePaths.size(); start += BATCH_SIZE) {
+            final int end = Math.min(filePaths.size(), start + BATCH_SIZE);
+
+            batch.clear();
+
+            for (int i = start; i < end; i++) {
+                final String filePath = filePaths.get(i);
+                final TimestampedMime fresh = getFresh(filePath);
+
+                if (fresh == null) {
+                    indices[batch.size()] = i;
+                    batch.add(filePath);
+                } else {
+                    callback.onTypeGuessed(i, filePath, fresh.mime, fresh.size);
+                    remaining.countDown();
+                }
+            }
+
+            if (batch.isEmpty())
+                continue;
+
+            opened.acquire(batch.size());
+
+            final FileHeader[] headers = readHeaders(batch);
+
+            final ParcelFileDescriptor[] fds = headers == null ? openDescriptors(batch) : null;
+            final int[] positions = new int[batch.size()];
+            final FdInfo info = fds == null ? null : describe(fds, positions);
+
+            for (int j = 0; j < batch.size(); j++) {
+                final Detection detection = fds == null
+                        ? prepare(indices[j], batch.get(j), headers[j])
+                        : prepare(indices[j], batch.get(j), fds[j], info, positions[j]);
+
+                final Runnable task = () -> {
+                    try {
+                        sniff(detection);
+
+                        final TimestampedMime mime = finish(detection);
+
+                        callback.onTypeGuessed(detection.index, detection.filePath, mime.mime, mime.size);
+                    } finally {
+                        opened.release();
+                        remaining.countDown();
+                    }
+                };
+
+                if (!detection.needsSniffing())
+                    task.run();
+                else
+                    DetectionPool.executor.execute(task);
+            }
+        }
+
+        remaining.await();
+    }
+
     @NonNull TimestampedMime guessTypeInternal(String filePath) {
-        final TimestampedMime cachedResult = fileTypeCache.get(filePath);
+        final TimestampedMime cachedResult = getFresh(filePath);
 
-        if (cachedResult != null && System.nanoTime() - cachedResult.when > 2_000_000_000)
+        if (cachedResult != null)
             return cachedResult;
 
+        final FileHeader[] headers = readHeaders(Collections.singletonList(filePath));
+
+        final Detection detection;
+
+        if (headers != null) {
+            detection = prepare(0, filePath, headers[0]);
+        } else {
+            ParcelFileDescriptor fd = null;
+            try {
+                fd = openDescriptor(filePath, "r", false);
+            } catch (IOException e) {
+                e.printStackTrace();
+            }
+
+            final ParcelFileDescriptor[] fds = { fd };
+            final int[] positions = new int[1];
+            final FdInfo info = describe(fds, positions);
+
+            detection = prepare(0, filePath, fd, info, positions[0]);
+        }
+
+        sniff(detection);
+
+        return finish(detection);
+    }
+
+    private @Nullable TimestampedMime getFresh(String filePath) {
+        final TimestampedMime cachedResult = fileTypeCache.get(filePath);
+
+        return cachedResult != null && System.nanoTime() - cachedResult.when < 2_000_000_000 ? cachedResult : null;
+    }
+
+    /**
+     * Describe non-null descriptors in a single call, storing position of each one in returned FdInfo
+     * (or -1 for nulls) to positions.
+     */
+    private static @Nullable FdInfo describe(ParcelFileDescriptor[] fds, int[] positions) {
+        int count = 0;
+        for (int i = 0; i < fds.length; i++)
+            positions[i] = fds[i] == null ? -1 : count++;
+
+        final ParcelFileDescriptor[] present = new ParcelFileDescriptor[count];
+        for (int i = 0; i < fds.length; i++)
+            if (positions[i] != -1)
+                present[positions[i]] = fds[i];
+
+        try {
+            return FdCompat.describeAll(present);
+        } catch (IOException e) {
+            return null;
+        }
+    }
+
+    // looks up persistent cache, so that only files, missing from it, have to be sniffed
+    private Detection prepare(int index, String filePath, ParcelFileDescriptor fd, FdInfo info, int position) {
+        final Detection detection = new Detection(index, filePath, fd);
+
+        if (fd == null)
+            return detection;
+
+        detection.size = fd.getStatSize();
+
+        if (info == null || position == -1)
+            return detection;
+
+        detection.dev = info.getDevice(position);
+        detection.inode = info.getInode(position);
+        detection.modified = info.getModified(position);
+
+        // without modification time there is no telling, whether the entry is stale
+        if (info.getType(position) == FdInfo.S_IFREG && detection.modified != -1)
+            lookup(detection);
+
+        return detection;
+    }
+
+    private Detection prepare(int index, String filePath, FileHeader header) {
+        final Detection detection = new Detection(index, filePath, null);
+
+        if (header == null)
+            return detection;
+
+        detection.header = header.getBytes();
+        detection.size = header.getSize();
+        detection.dev = header.getDevice();
+        detection.inode = header.getInode();
+        detection.modified = header.getModified();
+
+        // headers are only read from regular files
+        lookup(detection);
+
+        return detection;
+    }
+
+    private void lookup(Detection detection) {
+        detection.cache = getMimeCache();
+
+        if (detection.cache != null)
+            detection.detected = detection.cache.get(detection.dev, detection.inode, detection.size, detection.modified);
+    }
+
+    // matches header of the file against libmagic database, unless the type is already known, and closes it
+    private void sniff(Detection detection) {
+        final ParcelFileDescriptor fd = detection.fd;
+
+        try {
+            if (!detection.needsSniffing())
+                return;
+
+            byte[] header = detection.header;
+
+            if (header == null) {
+                final byte[] buffer = headerBuffer.get();
+                final int length = readHeader(fd, buffer);
+
+                // the matcher looks at the whole array, so it can only be reused when filled completely
+                header = length == buffer.length ? buffer : Arrays.copyOf(buffer, length);
+            }
+
+            String detectedMime = MimeCache.UNDETECTED;
+
+            final ContentInfo result;
+            if (header.length != 0 && (result = mimeLib.findMatch(header)) != null && result.getMimeType() != null)
+                detectedMime = result.getMimeType();
+
+            if (detection.cache != null)
+                detection.cache.put(detection.dev, detection.inode, detection.size, detection.modified, detectedMime);
+
+            detection.detected = detectedMime;
+        } catch (IOException e) {
+            e.printStackTrace();
+        } finally {
+            if (fd != null) {
+                try {
+                    fd.close();
+                } catch (IOException ignored) {
+                }
+            }
+        }
+    }
+
+    // a positional read from the start of file, regardless of descriptor offset
+    @SuppressLint("NewApi")
+    private static int readHeader(ParcelFileDescriptor fd, byte[] buffer) throws IOException {
+        if (Build.VERSION.SDK_INT >= Build.VERSION_CODES.LOLLIPOP)
+            return Pread21.read(fd.getFileDescriptor(), buffer);
+
+        // freshly opened descriptors are positioned at the start anyway
+        try (FileInputStream fs = new FileInputStream(fd.getFileDescriptor())) {
+            int total = 0, got;
+
+            while (total < buffer.length && (got = fs.read(buffer, total, buffer.length - total)) > 0)
+                total += got;
+
+            return total;
+        }
+    }
+
+    // referencing ErrnoException from the outer class would fail it's verification on older releases
+    @TargetApi(Build.VERSION_CODES.LOLLIPOP)
+    private static final class Pread21 {
+        static int read(FileDescriptor fd, byte[] buffer) throws IOException {
+            try {
+                int total = 0, got;
+
+                while (total < buffer.length && (got = Os.pread(fd, buffer, total, buffer.length - total, total)) > 0)
+                    total += got;
+
+                return total;
+            } catch (ErrnoException e) {
+                throw new IOException(e.getMessage());
+            }
+        }
+    }
+
+    private TimestampedMime finish(Detection detection) {
         final Set<String> types = new LinkedHashSet<>();
 
         final TimestampedMime mime = new TimestampedMime();
 
-        final String actualExtension = MimeTypeMap.getFileExtensionFromUrl(filePath);
+        final String actualExtension = MimeTypeMap.getFileExtensionFromUrl(detection.filePath);
         if (!TextUtils.isEmpty(actualExtension)) {
             final String extType = map.getMimeTypeFromExtension(actualExtension);
             if (!TextUtils.isEmpty(extType) && !"application/octet-stream".equals(extType))
@@ -134,29 +513,19 @@ public abstract class BaseProvider extends ContentProvider {
                 types.add(extType2.getMimeType());
         }
 
-        try (ParcelFileDescriptor newFd = openDescriptor(filePath, "r", false);
-             FileInputStream fs = new FileInputStream(newFd.getFileDescriptor()))
-        {
-            mime.size = newFd.getStatSize();
-
-            final ContentInfo result;
-            if (mime.size != 0 && (result = mimeLib.findMatch(fs)) != null) {
-                final String detectedMime = result.getMimeType();
+        final String detectedMime = detection.detected;
 
-                if (!TextUtils.isEmpty(detectedMime) && !"application/octet-stream".equals(detectedMime))
-                    types.add(detectedMime);
-            }
-        } catch (IOException e) {
-            e.printStackTrace();
-        }
+        if (!TextUtils.isEmpty(detectedMime) && !"application/octet-stream".equals(detectedMime))
+            types.add(detectedMime);
 
         if (types.isEmpty())
             types.add("application/octet-stream");
 
+        mime.size = detection.size;
         mime.mime = types.toArray(new String[types.size()]);
         mime.when = System.nanoTime();
 
-        fileTypeCache.put(filePath, mime);
+        fileTypeCache.put(detection.filePath, mime);
 
         return mime;
     }
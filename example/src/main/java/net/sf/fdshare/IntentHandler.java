@@ -115,7 +115,9 @@ public class IntentHandler extends ContextWrapper {
 
         // 2) Try to canonicalize the Uri / file path, using chosen provider. If failed, bail out. Real app should show
         // this canonical path to user somewhere to ensure, that he knows, what he opens.
-        final Uri canonicalUri = providerUri; // TODO
+        final Uri canonicalUri = Build.VERSION.SDK_INT >= 19 ? cr.canonicalize(providerUri) : providerUri;
+        if (canonicalUri == null)
+            return null;
 
         // 3) Get MIME type (for clients, that handle only file://)
         final String[] mimeCandidates = providerUri == null
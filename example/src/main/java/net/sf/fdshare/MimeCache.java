@@ -0,0 +1,203 @@
+/*
+ * Copyright © 2015 Alexander Rvachev
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+package net.sf.fdshare;
+
+import android.content.Context;
+import android.support.annotation.NonNull;
+import android.support.annotation.Nullable;
+import android.util.Log;
+
+import java.io.File;
+import java.io.IOException;
+import java.io.RandomAccessFile;
+import java.nio.MappedByteBuffer;
+import java.nio.channels.FileChannel;
+
+/**
+ * Results of magic-based type detection, keyed by (device, inode, size, modification time) of the file.
+ * Modification time is in nanoseconds, so that a file, rewritten within the same second, is not mistaken for
+ * the old one (unless the file system only keeps whole seconds).
+ *
+ * The index is a fixed-size open-addressing table in a memory-mapped file, so it survives restarts of the
+ * provider process without any explicit loading or saving. Changes are visible to the kernel as soon as
+ * they are made, and are written to disk whenever it sees fit.
+ *
+ * Slots are looked up by device and inode only, so a modified file replaces it's own stale entry instead
+ * of occupying another one. When all slots of the probe window are taken, one of them is overwritten.
+ * <p>
+ * There is a single instance per process, see {@link #get}: mapping the index separately for each provider
+ * would leave writes to it unserialized.
+ */
+final class MimeCache {
+    /**
+     * Stored in place of type for files, that did not match any magic.
+     */
+    static final String UNDETECTED = "";
+
+    private static final int MAGIC = 0x46444d43; // "FDMC"
+    private static final int VERSION = 2; // 1 keyed by whole seconds
+
+    private static final int CAPACITY = 4096; // must be power of two
+    private static final int PROBES = 8;
+
+    private static final int HEADER_SIZE = 16;
+    private static final int SLOT_SIZE = 128;
+
+    // slot layout
+    private static final int SLOT_DEV = 0;
+    private static final int SLOT_INODE = 8;
+    private static final int SLOT_SIZE_FIELD = 16;
+    private static final int SLOT_MTIME = 24;
+    private static final int SLOT_USED = 32;
+    private static final int SLOT_LENGTH = 33;
+    private static final int SLOT_MIME = 34;
+
+    private static final int MAX_MIME = SLOT_SIZE - SLOT_MIME;
+
+    private static MimeCache instance;
+    private static boolean failed;
+
+    private final MappedByteBuffer index;
+
+    /**
+     * @return the index, shared by all providers in the process, or null if it could not be mapped
+     */
+    static synchronized @Nullable MimeCache get(@NonNull Context context) {
+        if (instance == null && !failed) {
+            try {
+                instance = new MimeCache(new File(context.getCacheDir(), "mime.idx"));
+            } catch (IOException e) {
+                Log.e("MimeCache", "Failed to map mime cache, falling back to detection on each request", e);
+
+                failed = true;
+            }
+        }
+
+        return instance;
+    }
+
+    private MimeCache(@NonNull File file) throws IOException {
+        final int length = HEADER_SIZE + CAPACITY * SLOT_SIZE;
+
+        try (RandomAccessFile raf = new RandomAccessFile(file, "rw")) {
+            final boolean reset = raf.length() != length;
+
+            if (reset)
+                raf.setLength(length);
+
+            // the mapping remains valid after the file is closed
+            index = raf.getChannel().map(FileChannel.MapMode.READ_WRITE, 0, length);
+
+            if (reset || index.getInt(0) != MAGIC || index.getInt(4) != VERSION || index.getInt(8) != CAPACITY)
+                clear();
+        }
+    }
+
+    /**
+     * @return detected type, {@link #UNDETECTED} if the file did not match anything, or null if it is unknown
+     */
+    synchronized @Nullable String get(long dev, long inode, long size, long modified) {
+        final int start = start(dev, inode);
+
+        for (int i = 0; i < PROBES; i++) {
+            final int slot = slot(start + i);
+
+            if (index.get(slot + SLOT_USED) == 0)
+                return null;
+
+            if (index.getLong(slot + SLOT_DEV) == dev && index.getLong(slot + SLOT_INODE) == inode) {
+                if (index.getLong(slot + SLOT_SIZE_FIELD) != size || index.getLong(slot + SLOT_MTIME) != modified)
+                    return null;
+
+                final int mimeLength = index.get(slot + SLOT_LENGTH) & 0xff;
+
+                final char[] chars = new char[mimeLength];
+                for (int j = 0; j < mimeLength; j++)
+                    chars[j] = (char) index.get(slot + SLOT_MIME + j);
+
+                return new String(chars);
+            }
+        }
+
+        return null;
+    }
+
+    synchronized void put(long dev, long inode, long size, long modified, @NonNull String mime) {
+        if (mime.length() > MAX_MIME)
+            return;
+
+        for (int i = 0; i < mime.length(); i++) {
+            if (mime.charAt(i) > 0x7f)
+                return;
+        }
+
+        final int start = start(dev, inode);
+
+        int target = -1;
+
+        for (int i = 0; i < PROBES; i++) {
+            final int slot = slot(start + i);
+
+            if (index.get(slot + SLOT_USED) == 0
+                    || index.getLong(slot + SLOT_DEV) == dev && index.getLong(slot + SLOT_INODE) == inode) {
+                target = slot;
+                break;
+            }
+        }
+
+        if (target == -1)
+            target = slot(start + (int) ((System.nanoTime() >>> 10) % PROBES));
+
+        // mark the slot empty while it is being rewritten, so that a process death in the middle
+        // does not leave a key paired with someone else's type
+        index.put(target + SLOT_USED, (byte) 0);
+
+        index.putLong(target + SLOT_DEV, dev);
+        index.putLong(target + SLOT_INODE, inode);
+        index.putLong(target + SLOT_SIZE_FIELD, size);
+        index.putLong(target + SLOT_MTIME, modified);
+        index.put(target + SLOT_LENGTH, (byte) mime.length());
+
+        for (int i = 0; i < mime.length(); i++)
+            index.put(target + SLOT_MIME + i, (byte) mime.charAt(i));
+
+        index.put(target + SLOT_USED, (byte) 1);
+    }
+
+    private void clear() {
+        index.putInt(0, 0);
+
+        for (int i = HEADER_SIZE; i < index.capacity(); i += SLOT_SIZE)
+            index.put(i + SLOT_USED, (byte) 0);
+
+        index.putInt(4, VERSION);
+        index.putInt(8, CAPACITY);
+        index.putInt(0, MAGIC);
+    }
+
+    private static int start(long dev, long inode) {
+        long hash = dev * 0x9E3779B97F4A7C15L ^ inode;
+        hash ^= hash >>> 33;
+        hash *= 0xFF51AFD7ED558CCDL;
+        hash ^= hash >>> 33;
+
+        return (int) hash;
+    }
+
+    private static int slot(int position) {
+        return HEADER_SIZE + (position & (CAPACITY - 1)) * SLOT_SIZE;
+    }
+}
@@ -30,6 +30,8 @@ import java.io.Closeable;
 import java.io.File;
 import java.io.FileNotFoundException;
 import java.io.IOException;
+import java.util.ArrayList;
+import java.util.List;
 import java.util.concurrent.locks.Lock;
 import java.util.concurrent.locks.ReentrantLock;
 
@@ -116,33 +118,111 @@ public class RootFileProvider extends BaseProvider {
             throw new IllegalArgumentException("Provide a fully qualified path!");
 
         try {
-            if (fdfactory == null) {
-                synchronized (this) {
-                    if (fdfactory == null) {
-                        fdfactory = FileDescriptorFactory.create(getContext());
-                    }
-                }
+            final int fdMode = parseMode(mode);
+
+            if (secure) {
+                // the kernel refuses to follow symlinks in any component of the path, so only canonical
+                // paths can be opened, and there is no window between checking and opening
+                final int resolve = FileDescriptorFactory.RESOLVE_NO_SYMLINKS | FileDescriptorFactory.RESOLVE_NO_MAGICLINKS;
+
+                return getFactory().open(null, filePath, fdMode, resolve).getDescriptor();
             }
 
-            // TODO: check entire path for being canonical here
-            int fdMode = parseMode(mode);
+            return getFactory().open(aFile, fdMode);
+        } catch (FactoryBrokenException cbe) {
+            onFactoryBroken();
+        } catch (Exception anything) {
+            Log.e(TAG, "Failed to open a file or acquire root access due to " + anything);
+        }
+
+        throw new FileNotFoundException("Failed to open a file");
+    }
+
+    /**
+     * Opens all files in a single round-trip to the helper per {@link FileDescriptorFactory#openAll} batch.
+     */
+    @Override
+    ParcelFileDescriptor[] openDescriptors(List<String> filePaths) {
+        final List<File> files = toFiles(filePaths);
+
+        try {
+            return getFactory().openAll(files, FileDescriptorFactory.O_RDONLY);
+        } catch (FactoryBrokenException cbe) {
+            onFactoryBroken();
+        } catch (Exception anything) {
+            Log.e(TAG, "Failed to open files or acquire root access due to " + anything);
+        }
+
+        return new ParcelFileDescriptor[filePaths.size()];
+    }
+
+    /**
+     * Receives headers inline with helper responses, so that no descriptors have to be passed around.
+     */
+    @Override
+    FileHeader[] readHeaders(List<String> filePaths) {
+        final List<File> files = toFiles(filePaths);
+
+        try {
+            return getFactory().readHeaders(files, HEADER_SIZE);
+        } catch (FactoryBrokenException cbe) {
+            onFactoryBroken();
+        } catch (Exception anything) {
+            Log.e(TAG, "Failed to read files or acquire root access due to " + anything);
+        }
+
+        return new FileHeader[filePaths.size()];
+    }
+
+    private static List<File> toFiles(List<String> filePaths) {
+        final ArrayList<File> files = new ArrayList<>(filePaths.size());
 
-            if (secure) fdMode |= FileDescriptorFactory.O_NOFOLLOW;
+        for (String filePath : filePaths) {
+            if (TextUtils.isEmpty(filePath) || !new File(filePath).isAbsolute())
+                throw new IllegalArgumentException("Provide a fully qualified path!");
+
+            files.add(new File(filePath));
+        }
+
+        return files;
+    }
+
+    @Override
+    String canonicalizePath(String filePath) {
+        if (TextUtils.isEmpty(filePath) || !new File(filePath).isAbsolute())
+            return null;
 
-            return fdfactory.open(aFile,  fdMode);
+        try (ResolvedDescriptor resolved = getFactory().open(null, filePath, FileDescriptorFactory.O_PATH, 0)) {
+            return resolved.getCanonicalPath();
         } catch (FactoryBrokenException cbe) {
+            onFactoryBroken();
+        } catch (Exception anything) {
+            Log.e(TAG, "Failed to resolve a file or acquire root access due to " + anything);
+        }
+
+        return null;
+    }
+
+    private FileDescriptorFactory getFactory() throws IOException {
+        if (fdfactory == null) {
             synchronized (this) {
-                if (fdfactory != null && fdfactory.isClosed()) {
-                    fdfactory = null;
+                if (fdfactory == null) {
+                    fdfactory = FileDescriptorFactory.create(getContext());
                 }
             }
+        }
 
-            Log.e(TAG, "Failed to open a file, is the device even rooted?");
-        } catch (Exception anything) {
-            Log.e(TAG, "Failed to open a file or acquire root access due to " + anything);
+        return fdfactory;
+    }
+
+    private void onFactoryBroken() {
+        synchronized (this) {
+            if (fdfactory != null && fdfactory.isClosed()) {
+                fdfactory = null;
+            }
         }
 
-        throw new FileNotFoundException("Failed to open a file");
+        Log.e(TAG, "Failed to open a file, is the device even rooted?");
     }
 
     private static @FileDescriptorFactory.OpenFlag int parseMode(String mode) {
@@ -59,6 +59,18 @@ public class SimpleFilePorvider extends BaseProvider {
         throw new FileNotFoundException("Failed to open a file");
     }
 
+    @Override
+    String canonicalizePath(String filePath) {
+        if (TextUtils.isEmpty(filePath) || !new File(filePath).isAbsolute())
+            return null;
+
+        try {
+            return new File(filePath).getCanonicalPath();
+        } catch (IOException e) {
+            return null;
+        }
+    }
+
     private static int modeToMode(String mode) throws FileNotFoundException {
         int modeBits;
         if ("r".equals(mode)) {
@@ -2,18 +2,25 @@ package net.sf.fdshare;
 
 import android.annotation.TargetApi;
 import android.content.Context;
+import android.os.FileObserver;
 import android.os.ParcelFileDescriptor;
+import android.system.Os;
 import android.support.test.InstrumentationRegistry;
 import android.support.test.runner.AndroidJUnit4;
 import android.test.FlakyTest;
 import junit.framework.Assert;
 import net.sf.fdshare.internal.FdCompat;
+import net.sf.fdshare.internal.FdInfo;
+import net.sf.fdshare.internal.FdNative;
 import org.junit.Test;
 import org.junit.runner.RunWith;
 
+import java.io.DataInputStream;
 import java.io.File;
+import java.io.FileInputStream;
 import java.io.FileNotFoundException;
 import java.io.IOException;
+import java.io.InputStream;
 import java.io.PrintWriter;
 import java.io.RandomAccessFile;
 import java.nio.MappedByteBuffer;
@@ -21,6 +28,14 @@ import java.nio.channels.ByteChannel;
 import java.nio.channels.Channel;
 import java.nio.channels.FileChannel;
 import java.nio.charset.CharsetEncoder;
+import java.security.DigestInputStream;
+import java.security.MessageDigest;
+import java.util.ArrayList;
+import java.util.Arrays;
+import java.util.Collections;
+import java.util.List;
+import java.util.concurrent.CountDownLatch;
+import java.util.concurrent.TimeUnit;
 
 @RunWith(AndroidJUnit4.class)
 @TargetApi(22)
@@ -100,4 +115,625 @@ public class LibraryTest {
             Assert.assertEquals(exec.getAbsolutePath(), FdCompat.getFdPath(fd));
         }
     }
-}
\ No newline at end of file
+
+    @Test
+    public void testAbleToHashFiles() throws Exception {
+        final MessageDigest expected = MessageDigest.getInstance("SHA-256");
+        try (DigestInputStream dis = new DigestInputStream(new FileInputStream(exec), expected)) {
+            final byte[] buffer = new byte[8192];
+            //noinspection StatementWithEmptyBody
+            while (dis.read(buffer) != -1);
+        }
+
+        try (FileDescriptorFactory fdf = FileDescriptorFactory.create(InstrumentationRegistry.getContext()))
+        {
+            final byte[][] digests = fdf.hash(Arrays.asList(exec, new File(exec.getPath() + ".missing")),
+                    FileDescriptorFactory.HASH_SHA256);
+
+            Assert.assertTrue(Arrays.equals(expected.digest(), digests[0]));
+            Assert.assertNull(digests[1]);
+        }
+    }
+
+    @Test
+    public void testAbleToHashMoreFilesThanHelperAcceptsAtOnce() throws Exception {
+        final List<File> files = new ArrayList<>(Collections.nCopies(FileDescriptorFactory.MAX_HASH_FILES,
+                new File(exec.getPath() + ".missing")));
+        files.add(exec);
+
+        try (FileDescriptorFactory fdf = FileDescriptorFactory.create(InstrumentationRegistry.getContext()))
+        {
+            final byte[][] digests = fdf.hash(files, FileDescriptorFactory.HASH_SHA256);
+
+            Assert.assertEquals(files.size(), digests.length);
+            Assert.assertNull(digests[0]);
+            Assert.assertNotNull(digests[files.size() - 1]);
+
+            // the factory remains usable
+            Assert.assertNotNull(fdf.hash(Collections.singletonList(exec), FileDescriptorFactory.HASH_SHA256)[0]);
+        }
+    }
+
+    @Test
+    public void testAbleToReadHeaders() throws Exception {
+        final byte[] expected = new byte[16];
+        try (FileInputStream fis = new FileInputStream(exec)) {
+            Assert.assertEquals(expected.length, fis.read(expected));
+        }
+
+        try (FileDescriptorFactory fdf = FileDescriptorFactory.create(InstrumentationRegistry.getContext()))
+        {
+            final FileHeader[] headers = fdf.readHeaders(Arrays.asList(exec, new File(exec.getPath() + ".missing"),
+                    exec.getParentFile()), expected.length);
+
+            Assert.assertTrue(Arrays.equals(expected, headers[0].getBytes()));
+            Assert.assertEquals(exec.length(), headers[0].getSize());
+            Assert.assertNull(headers[1]);
+            Assert.assertNull(headers[2]);
+        }
+    }
+
+    @Test
+    public void testArchiveRoundTrip() throws Exception {
+        final Context context = InstrumentationRegistry.getContext();
+
+        final File source = new File(context.getCacheDir(), "archive-source");
+        final File target = new File(context.getCacheDir(), "archive-target");
+        Assert.assertTrue((source.isDirectory() || source.mkdirs()) && (target.isDirectory() || target.mkdirs()));
+
+        try (PrintWriter out = new PrintWriter(new File(source, "file"))) {
+            out.write("TEST");
+        }
+
+        try (FileDescriptorFactory fdf = FileDescriptorFactory.create(context);
+             ParcelFileDescriptor archive = fdf.archive(source, new ArchiveOptions()))
+        {
+            fdf.extract(archive, target, new ArchiveOptions());
+        }
+
+        Assert.assertEquals(4, new File(target, "file").length());
+    }
+
+    @Test
+    public void testAbleToWatchDirectory() throws Exception {
+        final Context context = InstrumentationRegistry.getContext();
+
+        final File dir = new File(context.getCacheDir(), "watched");
+        final File created = new File(dir, "created");
+        Assert.assertTrue((dir.isDirectory() || dir.mkdirs()) && (!created.exists() || created.delete()));
+
+        try (FileDescriptorFactory fdf = FileDescriptorFactory.create(context);
+             FsWatch watch = fdf.watch(Arrays.asList(dir, new File(dir, "missing")), FileObserver.CREATE))
+        {
+            Assert.assertEquals(0, watch.getError(0));
+            Assert.assertTrue(watch.getError(1) < 0);
+
+            Assert.assertTrue(created.createNewFile());
+
+            final List<FsWatch.Event> events = watch.read();
+
+            Assert.assertEquals(1, events.size());
+            Assert.assertEquals(created, events.get(0).getFile());
+        }
+    }
+
+    @Test
+    public void testWatchingTooManyPathsThrows() throws Exception {
+        final File[] paths = new File[FileDescriptorFactory.MAX_WATCHES + 1];
+        Arrays.fill(paths, exec);
+
+        try (FileDescriptorFactory fdf = FileDescriptorFactory.create(InstrumentationRegistry.getContext()))
+        {
+            try {
+                fdf.watch(Arrays.asList(paths), FileObserver.MODIFY).close();
+
+                Assert.fail("Watching " + paths.length + " paths should have failed");
+            } catch (IllegalArgumentException expected) {
+                // the request was not sent, the factory remains usable
+                fdf.watch(Collections.singletonList(exec), FileObserver.MODIFY).close();
+            }
+        }
+    }
+
+    @Test
+    public void testCoalescedOpensReturnDistinctDescriptors() throws Exception {
+        final FactoryOptions options = new FactoryOptions().coalesceOpens(true);
+
+        try (FileDescriptorFactory fdf = FileDescriptorFactory.create(InstrumentationRegistry.getContext(), options))
+        {
+            final ParcelFileDescriptor[] results = new ParcelFileDescriptor[4];
+            final Thread[] threads = new Thread[results.length];
+
+            for (int i = 0; i < threads.length; i++) {
+                final int idx = i;
+                threads[i] = new Thread(() -> {
+                    try {
+                        results[idx] = fdf.open(exec, FileDescriptorFactory.O_RDONLY);
+                    } catch (Exception e) {
+                        e.printStackTrace();
+                    }
+                });
+                threads[i].start();
+            }
+
+            for (Thread thread : threads)
+                thread.join();
+
+            for (int i = 0; i < results.length; i++) {
+                Assert.assertNotNull(results[i]);
+                Assert.assertEquals(exec.length(), results[i].getStatSize());
+
+                for (int j = 0; j < i; j++)
+                    Assert.assertTrue(FdCompat.getIntFd(results[i]) != FdCompat.getIntFd(results[j]));
+            }
+
+            for (ParcelFileDescriptor result : results)
+                result.close();
+        }
+    }
+
+    @Test
+    public void testCoalescedOpenFailureReachesLeader() throws Exception {
+        final OpenCoalescer coalescer = new OpenCoalescer(false);
+        final CountDownLatch leaderStarted = new CountDownLatch(1);
+        final CountDownLatch waiterJoined = new CountDownLatch(1);
+
+        final OpenCoalescer.Opener failing = (file, mode) -> {
+            leaderStarted.countDown();
+
+            try {
+                waiterJoined.await(2, TimeUnit.SECONDS);
+            } catch (InterruptedException e) {
+                throw new IOException(e);
+            }
+
+            throw new FileNotFoundException("test failure");
+        };
+
+        final Exception[] waiterError = new Exception[1];
+
+        final Thread waiter = new Thread(() -> {
+            try {
+                leaderStarted.await();
+
+                waiterJoined.countDown();
+
+                coalescer.open(exec, FileDescriptorFactory.O_RDONLY, failing).close();
+            } catch (Exception e) {
+                waiterError[0] = e;
+            }
+        });
+        waiter.start();
+
+        try {
+            coalescer.open(exec, FileDescriptorFactory.O_RDONLY, failing);
+
+            Assert.fail("The leader must see the failure");
+        } catch (FileNotFoundException expected) {
+            Assert.assertEquals("test failure", expected.getMessage());
+        }
+
+        waiter.join();
+
+        Assert.assertTrue(waiterError[0] instanceof IOException);
+    }
+
+    @Test
+    public void testAbleToOpenManyFiles() throws Exception {
+        final File missing = new File(exec.getParentFile(), "missing");
+
+        try (FileDescriptorFactory fdf = FileDescriptorFactory.create(InstrumentationRegistry.getContext()))
+        {
+            final ParcelFileDescriptor[] results = fdf.openAll(Arrays.asList(exec, missing, exec), FileDescriptorFactory.O_RDONLY);
+
+            Assert.assertEquals(3, results.length);
+            Assert.assertNull(results[1]);
+            Assert.assertEquals(exec.length(), results[0].getStatSize());
+            Assert.assertEquals(exec.length(), results[2].getStatSize());
+
+            results[0].close();
+            results[2].close();
+        }
+    }
+
+    @Test
+    public void testNativeReceiverIsPackaged() {
+        Assert.assertTrue(FdNative.isAvailable());
+    }
+
+    @Test
+    public void testAbleToOpenLongPath() throws Exception {
+        final Context context = InstrumentationRegistry.getContext();
+
+        // well beyond MAX_CANON, which used to limit requests, sent over tty
+        final char[] component = new char[200];
+        Arrays.fill(component, 'd');
+
+        File dir = context.getCacheDir();
+        for (int i = 0; i < 5; i++)
+            dir = new File(dir, new String(component));
+
+        Assert.assertTrue(dir.isDirectory() || dir.mkdirs());
+
+        final File file = new File(dir, "file");
+        try (PrintWriter out = new PrintWriter(file)) {
+            out.write("TEST");
+        }
+
+        try (FileDescriptorFactory fdf = FileDescriptorFactory.create(context);
+             ParcelFileDescriptor fd = fdf.open(file, FileDescriptorFactory.O_RDONLY))
+        {
+            Assert.assertEquals(4, fd.getStatSize());
+        }
+    }
+
+    @Test
+    public void testAbleToReopenRenamedFileByHandle() throws Exception {
+        final Context context = InstrumentationRegistry.getContext();
+
+        final File file = new File(context.getCacheDir(), "handle");
+        try (PrintWriter out = new PrintWriter(file)) {
+            out.write("TEST");
+        }
+
+        final File renamed = new File(context.getCacheDir(), "handle-renamed");
+
+        try (FileDescriptorFactory fdf = FileDescriptorFactory.create(context)) {
+            final FileHandle handle = fdf.getHandle(file);
+
+            Assert.assertEquals(handle, FileHandle.fromByteArray(handle.toByteArray()));
+            Assert.assertTrue(file.renameTo(renamed));
+
+            try (ParcelFileDescriptor fd = fdf.openByHandle(handle, FileDescriptorFactory.O_RDONLY)) {
+                Assert.assertEquals(4, fd.getStatSize());
+            }
+        } finally {
+            renamed.delete();
+        }
+    }
+
+    @Test(expected = IOException.class)
+    public void testUnableToGetHandleOfMissingFile() throws Exception {
+        final Context context = InstrumentationRegistry.getContext();
+
+        try (FileDescriptorFactory fdf = FileDescriptorFactory.create(context)) {
+            fdf.getHandle(new File(context.getCacheDir(), "no-such-file"));
+        }
+    }
+
+    @Test
+    public void testAbleToOpenBeneathBaseDirectory() throws Exception {
+        final Context context = InstrumentationRegistry.getContext();
+
+        final File dir = new File(context.getCacheDir(), "resolved");
+        final File file = new File(dir, "sub/file");
+
+        Assert.assertTrue(file.getParentFile().isDirectory() || file.getParentFile().mkdirs());
+
+        try (PrintWriter out = new PrintWriter(file)) {
+            out.write("TEST");
+        }
+
+        try (FileDescriptorFactory fdf = FileDescriptorFactory.create(context);
+             ResolvedDescriptor fd = fdf.open(dir, "sub/file", FileDescriptorFactory.O_RDONLY,
+                     FileDescriptorFactory.RESOLVE_BENEATH | FileDescriptorFactory.RESOLVE_NO_SYMLINKS))
+        {
+            Assert.assertEquals(4, fd.getDescriptor().getStatSize());
+            Assert.assertEquals(file.getCanonicalPath(), fd.getCanonicalPath());
+        }
+    }
+
+    @Test
+    public void testRestrictedOpenRejectsEscapingPaths() throws Exception {
+        final Context context = InstrumentationRegistry.getContext();
+
+        final File dir = new File(context.getCacheDir(), "restricted");
+        final File link = new File(dir, "link");
+
+        Assert.assertTrue(dir.isDirectory() || dir.mkdirs());
+
+        if (!link.exists())
+            Os.symlink(exec.getPath(), link.getPath());
+
+        try (FileDescriptorFactory fdf = FileDescriptorFactory.create(context)) {
+            try {
+                fdf.open(dir, "link", FileDescriptorFactory.O_RDONLY, FileDescriptorFactory.RESOLVE_NO_SYMLINKS);
+
+                Assert.fail("Symlink must not be followed");
+            } catch (IOException expected) {
+                // ok
+            }
+
+            try {
+                fdf.open(dir, "../restricted/link", FileDescriptorFactory.O_RDONLY, FileDescriptorFactory.RESOLVE_BENEATH);
+
+                Assert.fail("Path must not escape base directory");
+            } catch (IOException expected) {
+                // ok
+            }
+
+            // without restrictions the same path is fine
+            try (ResolvedDescriptor fd = fdf.open(dir, "link", FileDescriptorFactory.O_RDONLY, 0)) {
+                Assert.assertEquals(exec.length(), fd.getDescriptor().getStatSize());
+            }
+        }
+    }
+
+    @Test
+    public void testPathPolicyIsEnforced() throws Exception {
+        final PathPolicy policy = new PathPolicy()
+                .allow(exec.getParentFile().getCanonicalPath() + "/**", PathPolicy.READ);
+
+        try (FileDescriptorFactory fdf = FileDescriptorFactory.create(InstrumentationRegistry.getContext(),
+                new FactoryOptions().pathPolicy(policy)))
+        {
+            try (ParcelFileDescriptor fd = fdf.open(exec, FileDescriptorFactory.O_RDONLY)) {
+                Assert.assertEquals(exec.length(), fd.getStatSize());
+            }
+
+            try {
+                fdf.open(exec, FileDescriptorFactory.O_RDWR).close();
+
+                Assert.fail("Opened file for writing in spite of policy");
+            } catch (PolicyDeniedException expected) {
+                // ok
+            }
+
+            try {
+                fdf.open(new File("/proc/self/status"), FileDescriptorFactory.O_RDONLY).close();
+
+                Assert.fail("Opened file outside of allowed directory");
+            } catch (PolicyDeniedException expected) {
+                // ok
+            }
+
+            Assert.assertFalse(fdf.isClosed());
+        }
+    }
+
+    @Test
+    public void testDeniedFileIsNotTruncatedByHandle() throws Exception {
+        final Context context = InstrumentationRegistry.getContext();
+
+        final File file = new File(context.getCacheDir(), "handle-denied");
+        try (PrintWriter out = new PrintWriter(file)) {
+            out.write("TEST");
+        }
+
+        final FileHandle handle;
+        try (FileDescriptorFactory fdf = FileDescriptorFactory.create(context)) {
+            handle = fdf.getHandle(file);
+        }
+
+        final PathPolicy policy = new PathPolicy()
+                .allow(context.getCacheDir().getCanonicalPath() + "/allowed/**", PathPolicy.READ | PathPolicy.WRITE);
+
+        try (FileDescriptorFactory fdf = FileDescriptorFactory.create(context, new FactoryOptions().pathPolicy(policy))) {
+            try {
+                fdf.openByHandle(handle, FileDescriptorFactory.O_RDWR | FileDescriptorFactory.O_TRUNC).close();
+
+                Assert.fail("Opened file by handle in spite of policy");
+            } catch (PolicyDeniedException expected) {
+                // truncation must not happen before the check
+                Assert.assertEquals(4, file.length());
+            }
+        } finally {
+            file.delete();
+        }
+    }
+
+    @Test
+    public void testAbleToOpenRelativeToBaseUnderPolicy() throws Exception {
+        final Context context = InstrumentationRegistry.getContext();
+
+        final File dir = new File(context.getCacheDir(), "allowed");
+        final File file = new File(dir, "file");
+
+        Assert.assertTrue(dir.isDirectory() || dir.mkdirs());
+
+        try (PrintWriter out = new PrintWriter(file)) {
+            out.write("TEST");
+        }
+
+        final PathPolicy policy = new PathPolicy()
+                .allow(dir.getCanonicalPath() + "/**", PathPolicy.READ);
+
+        try (FileDescriptorFactory fdf = FileDescriptorFactory.create(context, new FactoryOptions().pathPolicy(policy));
+             ResolvedDescriptor fd = fdf.open(dir, "file", FileDescriptorFactory.O_RDONLY,
+                     FileDescriptorFactory.RESOLVE_BENEATH))
+        {
+            Assert.assertEquals(4, fd.getDescriptor().getStatSize());
+        }
+    }
+
+    @Test
+    public void testOutstandingDescriptorsAreTracked() throws Exception {
+        try (FileDescriptorFactory fdf = FileDescriptorFactory.create(InstrumentationRegistry.getContext(),
+                new FactoryOptions().trackLeaks(1)))
+        {
+            final ParcelFileDescriptor fd = fdf.open(exec, FileDescriptorFactory.O_RDONLY);
+
+            FactoryStats stats = fdf.getStats(5);
+
+            Assert.assertEquals(1, stats.getOutstanding());
+            Assert.assertEquals(1, stats.getBiggestLeakers().size());
+            Assert.assertEquals("testOutstandingDescriptorsAreTracked",
+                    stats.getBiggestLeakers().get(0).getStack()[0].getMethodName());
+
+            fd.close();
+
+            stats = fdf.getStats(5);
+
+            Assert.assertEquals(0, stats.getOutstanding());
+            Assert.assertTrue(stats.getOldest().isEmpty());
+        }
+    }
+
+    @Test
+    public void testDroppedDescriptorsAreReportedAsLeaked() throws Exception {
+        try (FileDescriptorFactory fdf = FileDescriptorFactory.create(InstrumentationRegistry.getContext(),
+                new FactoryOptions().trackLeaks(1)))
+        {
+            openAndDrop(fdf, false);
+            openAndDrop(fdf, true);
+
+            // finalizers close dropped descriptors, which must not hide the leak
+            FactoryStats stats = fdf.getStats(5);
+            for (int i = 0; i < 50 && stats.getOutstanding() != 0; i++) {
+                Runtime.getRuntime().gc();
+                System.runFinalization();
+                Thread.sleep(20);
+
+                stats = fdf.getStats(5);
+            }
+
+            Assert.assertEquals(0, stats.getOutstanding());
+            Assert.assertEquals(1, stats.getLeaked());
+            Assert.assertEquals("openAndDrop", stats.getBiggestLeakers().get(0).getStack()[0].getMethodName());
+        }
+    }
+
+    private void openAndDrop(FileDescriptorFactory fdf, boolean close) throws IOException, FactoryBrokenException {
+        final ParcelFileDescriptor fd = fdf.open(exec, FileDescriptorFactory.O_RDONLY);
+
+        if (close)
+            fd.close();
+    }
+
+    @Test
+    public void testDescriptorUsageIsReported() throws Exception {
+        try (FileDescriptorFactory fdf = FileDescriptorFactory.create(InstrumentationRegistry.getContext(),
+                new FactoryOptions().descriptorBudget(0.8f));
+             ParcelFileDescriptor fd = fdf.open(exec, FileDescriptorFactory.O_RDONLY))
+        {
+            final FactoryStats stats = fdf.getStats(0);
+
+            Assert.assertTrue(stats.getDescriptors() > 0);
+            Assert.assertTrue(stats.getDescriptorLimit() > stats.getDescriptors());
+            Assert.assertEquals(0, stats.getRejected());
+        }
+    }
+
+    @Test
+    public void testAbleToCloseDescriptorRanges() throws Exception {
+        final ParcelFileDescriptor[] pipe = ParcelFileDescriptor.createPipe();
+
+        final int[] fds = { FdCompat.detach(pipe[1]), FdCompat.detach(pipe[0]) };
+
+        FdNative.closeAll(fds, fds.length);
+
+        for (int fd : fds)
+            Assert.assertFalse(new File("/proc/self/fd/" + fd).exists());
+    }
+
+    @Test
+    public void testAbleToAdoptDescriptorsInBulk() throws Exception {
+        final ParcelFileDescriptor[] pipe = ParcelFileDescriptor.createPipe();
+
+        final int[] fds = { FdCompat.detach(pipe[0]), -1, FdCompat.detach(pipe[1]) };
+
+        final ParcelFileDescriptor[] adopted = FdCompat.adoptAll(fds);
+
+        Assert.assertNull(adopted[1]);
+        Assert.assertEquals(fds[0], adopted[0].getFd());
+        Assert.assertEquals(fds[2], adopted[2].getFd());
+
+        adopted[0].close();
+        adopted[2].close();
+    }
+
+    @Test
+    public void testAbleToDescribeDescriptors() throws Exception {
+        final ParcelFileDescriptor[] pipe = ParcelFileDescriptor.createPipe();
+
+        try (ParcelFileDescriptor file = ParcelFileDescriptor.open(exec, ParcelFileDescriptor.MODE_READ_ONLY)) {
+            final FdInfo info = FdCompat.describeAll(true, file, pipe[0]);
+
+            Assert.assertEquals(2, info.size());
+            Assert.assertEquals(FdInfo.S_IFREG, info.getType(0));
+            Assert.assertEquals(exec.length(), info.getSize(0));
+            Assert.assertEquals(0, info.getPosition(0));
+            Assert.assertEquals(exec.getCanonicalPath(), info.getPath(0));
+            Assert.assertEquals(FdInfo.S_IFIFO, info.getType(1));
+        } finally {
+            pipe[0].close();
+            pipe[1].close();
+        }
+    }
+
+    @Test
+    public void testFactoriesShareReactor() throws Exception {
+        final Context context = InstrumentationRegistry.getContext();
+
+        try (FileDescriptorFactory first = FileDescriptorFactory.create(context, new FactoryOptions().shareReactor(true));
+             FileDescriptorFactory second = FileDescriptorFactory.create(context, new FactoryOptions().shareReactor(true));
+             ParcelFileDescriptor fd1 = first.open(exec, FileDescriptorFactory.O_RDONLY);
+             ParcelFileDescriptor fd2 = second.open(exec, FileDescriptorFactory.O_RDONLY))
+        {
+            Assert.assertEquals(exec.length(), fd1.getStatSize());
+            Assert.assertEquals(exec.length(), fd2.getStatSize());
+        }
+    }
+
+    @Test
+    public void testLeasesShareFactory() throws Exception {
+        final Context context = InstrumentationRegistry.getContext();
+
+        try (FactoryLease first = FileDescriptorFactory.lease(context, new FactoryOptions().coalesceOpens(true));
+             FactoryLease second = FileDescriptorFactory.lease(context, new FactoryOptions().coalesceOpens(true));
+             FactoryLease other = FileDescriptorFactory.lease(context, new FactoryOptions()))
+        {
+            Assert.assertSame(first.getFactory(), second.getFactory());
+            Assert.assertNotSame(first.getFactory(), other.getFactory());
+
+            first.close();
+
+            try (ParcelFileDescriptor fd = second.getFactory().open(exec, FileDescriptorFactory.O_RDONLY)) {
+                Assert.assertEquals(exec.length(), fd.getStatSize());
+            }
+        }
+    }
+
+    @Test
+    public void testRecordedTraceReplays() throws Exception {
+        final Context context = InstrumentationRegistry.getContext();
+
+        final File trace = new File(context.getCacheDir(), "trace.bin");
+
+        try (FileDescriptorFactory fdf = FileDescriptorFactory.create(context, new FactoryOptions().recordTrace(trace, true))) {
+            fdf.open(exec, FileDescriptorFactory.O_RDONLY).close();
+
+            try {
+                fdf.open(new File(exec.getParentFile(), "missing"), FileDescriptorFactory.O_RDONLY).close();
+            } catch (IOException expected) {
+            }
+        }
+
+        try (FileDescriptorFactory fdf = FileDescriptorFactory.create(context);
+             InputStream in = new FileInputStream(trace))
+        {
+            final TraceReplay.Result result = TraceReplay.replay(fdf, in, new File("/"), TraceReplay.MAX_SPEED);
+
+            Assert.assertEquals(2, result.getRequests());
+            Assert.assertEquals(0, result.getMismatched());
+        } finally {
+            trace.delete();
+        }
+    }
+
+    @Test
+    public void testAbleToSpawnProcess() throws Exception {
+        try (FileDescriptorFactory fdf = FileDescriptorFactory.create(InstrumentationRegistry.getContext());
+             SpawnedProcess process = fdf.spawn(Arrays.asList("sh", "-c", "cat; exit 3"), null, null))
+        {
+            process.getOutputStream().write("hello".getBytes("UTF-8"));
+            process.getOutputStream().close();
+
+            final byte[] output = new byte[5];
+            new DataInputStream(process.getInputStream()).readFully(output);
+
+            Assert.assertEquals("hello", new String(output, "UTF-8"));
+            Assert.assertEquals(3, process.waitFor());
+        }
+    }
+}
@@ -0,0 +1,51 @@
+/*
+ * Copyright © 2015 Alexander Rvachev
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+package net.sf.fdshare;
+
+/**
+ * Options for {@link FileDescriptorFactory#archive} and {@link FileDescriptorFactory#extract}.
+ * <p>
+ * Instances are mutable, but not retained by the factory, so they can be reused between calls.
+ */
+public final class ArchiveOptions {
+    // must match TAR_* flags in tar.h
+    static final int ONE_FILE_SYSTEM = 1;
+    static final int RESTORE_OWNERSHIP = 2;
+
+    int flags;
+
+    /**
+     * Do not descend into directories, residing on other file systems, than the archived directory
+     * (same as {@code --one-file-system} option of GNU tar). Mount points themselves are still archived.
+     */
+    public ArchiveOptions oneFileSystem(boolean value) {
+        return set(ONE_FILE_SYSTEM, value);
+    }
+
+    /**
+     * When extracting, set owner and group of created files to numeric ids, stored in the archive
+     * (same as {@code --same-owner} option of GNU tar). Otherwise extracted files are owned by root.
+     */
+    public ArchiveOptions restoreOwnership(boolean value) {
+        return set(RESTORE_OWNERSHIP, value);
+    }
+
+    private ArchiveOptions set(int flag, boolean value) {
+        flags = value ? flags | flag : flags & ~flag;
+
+        return this;
+    }
+}
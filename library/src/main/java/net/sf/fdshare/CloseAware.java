@@ -0,0 +1,103 @@
+/*
+ * Copyright © 2015 Alexander Rvachev
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+package net.sf.fdshare;
+
+import android.annotation.TargetApi;
+import android.os.ParcelFileDescriptor;
+
+import java.io.IOException;
+import java.io.RandomAccessFile;
+import java.util.concurrent.atomic.AtomicBoolean;
+
+/**
+ * Owners of descriptors, handed out by the factory, that run a callback after being closed. Descriptors
+ * themselves do not tell, when or by whom they were closed, so this is the only way to learn it.
+ * <p>
+ * The callback may also run from the finalizer of the owner (depending on platform version), after all weak
+ * references to it are cleared; {@link LeakTracker} relies on that to tell such closes apart.
+ */
+final class CloseAware {
+    private CloseAware() {
+    }
+
+    static final class Descriptor extends ParcelFileDescriptor {
+        volatile Runnable onClose;
+
+        private final AtomicBoolean closed = new AtomicBoolean();
+
+        Descriptor(ParcelFileDescriptor wrapped) {
+            super(wrapped);
+        }
+
+        @Override
+        public void close() throws IOException {
+            try {
+                super.close();
+            } finally {
+                closed(closed, onClose);
+            }
+        }
+
+        @Override
+        @TargetApi(19)
+        public void closeWithError(String msg) throws IOException {
+            try {
+                super.closeWithError(msg);
+            } finally {
+                closed(closed, onClose);
+            }
+        }
+
+        @Override
+        @TargetApi(12)
+        public int detachFd() {
+            try {
+                return super.detachFd();
+            } finally {
+                closed(closed, onClose);
+            }
+        }
+    }
+
+    /**
+     * A RandomAccessFile, that the descriptor is moved into by {@link net.sf.fdshare.internal.FdCompat#convert}.
+     */
+    static final class RandomAccess extends RandomAccessFile {
+        volatile Runnable onClose;
+
+        private final AtomicBoolean closed = new AtomicBoolean();
+
+        RandomAccess() throws IOException {
+            super("/dev/null", "rw");
+        }
+
+        @Override
+        public void close() throws IOException {
+            try {
+                super.close();
+            } finally {
+                closed(closed, onClose);
+            }
+        }
+    }
+
+    // runs at most once, regardless of repeated closes and closes after detaching; the callback is not set, if
+    // the owner is finalized without ever being handed out
+    private static void closed(AtomicBoolean closed, Runnable onClose) {
+        if (closed.compareAndSet(false, true) && onClose != null)
+            onClose.run();
+    }
+}
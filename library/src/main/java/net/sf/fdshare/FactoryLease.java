@@ -0,0 +1,52 @@
+/*
+ * Copyright © 2015 Alexander Rvachev
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+package net.sf.fdshare;
+
+import android.support.annotation.NonNull;
+
+import java.io.Closeable;
+import java.util.concurrent.atomic.AtomicBoolean;
+
+/**
+ * A reference to {@link FileDescriptorFactory}, shared with other components of the process, obtained from
+ * {@link FileDescriptorFactory#lease}. The factory is closed some time after the last lease is released.
+ * <p>
+ * Do not close the factory itself, release the lease instead.
+ */
+public final class FactoryLease implements Closeable {
+    private final FactoryRegistry.Entry entry;
+    private final AtomicBoolean released = new AtomicBoolean();
+
+    FactoryLease(FactoryRegistry.Entry entry) {
+        this.entry = entry;
+    }
+
+    public @NonNull FileDescriptorFactory getFactory() {
+        if (released.get())
+            throw new IllegalStateException("The lease is already released");
+
+        return entry.factory;
+    }
+
+    /**
+     * Release the lease. This method can be used any number of times, only the first call has effect.
+     */
+    @Override
+    public void close() {
+        if (released.compareAndSet(false, true))
+            FactoryRegistry.release(entry);
+    }
+}
@@ -0,0 +1,187 @@
+/*
+ * Copyright © 2015 Alexander Rvachev
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+package net.sf.fdshare;
+
+import java.io.File;
+import java.util.Arrays;
+import java.util.List;
+
+/**
+ * Optional features of {@link FileDescriptorFactory}, passed to {@link FileDescriptorFactory#create(android.content.Context, FactoryOptions)}.
+ * <p>
+ * All features are disabled by default. Instances are not retained by the factory, so they can be reused.
+ */
+public final class FactoryOptions {
+    boolean coalesceOpens;
+    boolean coalesceWrites;
+    int prefetchSiblings;
+    int prefetchLimit = 16;
+    Object[] policy;
+    boolean trackLeaks;
+    float leakSampleRate;
+    float descriptorBudget;
+    boolean deferCloses;
+    boolean sharedReactor;
+    File traceFile;
+    boolean tracePaths;
+
+    /**
+     * Merge concurrent {@link FileDescriptorFactory#open(java.io.File, int)} calls with the same path and mode
+     * into single request to helper. Each caller receives it's own duplicate of resulting descriptor.
+     * <p>
+     * Beware, that duplicates share file offset (as well as file status flags), so concurrent users must rely on
+     * positional reads (such as {@link java.nio.channels.FileChannel#read(java.nio.ByteBuffer, long)}) instead of
+     * sequential ones. Only read-only opens are merged unless {@link #coalesceWrites} is also enabled.
+     */
+    public FactoryOptions coalesceOpens(boolean value) {
+        coalesceOpens = value;
+
+        return this;
+    }
+
+    /**
+     * Also merge opens for writing, when {@link #coalesceOpens} is enabled. Requests, that create or truncate files,
+     * are merged as well, so make sure, that this is what you want.
+     */
+    public FactoryOptions coalesceWrites(boolean value) {
+        coalesceWrites = value;
+
+        return this;
+    }
+
+    /**
+     * Detect sequential opens of numbered files in the same directory (such as {@code IMG_0001.jpg},
+     * {@code IMG_0002.jpg}) and open up to specified number of following files in background. Prefetched
+     * descriptors are handed out by {@link FileDescriptorFactory#open(java.io.File, int)} when requested
+     * within few seconds, and closed otherwise. Only read-only opens are considered.
+     *
+     * @param count number of files to open ahead, up to 16, or 0 to disable prefetching
+     */
+    public FactoryOptions prefetchSiblings(int count) {
+        if (count < 0)
+            throw new IllegalArgumentException("Negative prefetch count: " + count);
+
+        prefetchSiblings = count;
+
+        return this;
+    }
+
+    /**
+     * Maximum number of prefetched descriptors, kept open at once. When the limit is reached, the oldest
+     * ones are closed. Defaults to 16.
+     */
+    public FactoryOptions prefetchLimit(int descriptors) {
+        if (descriptors <= 0)
+            throw new IllegalArgumentException("Prefetch limit must be positive: " + descriptors);
+
+        prefetchLimit = descriptors;
+
+        return this;
+    }
+
+    /**
+     * Restrict files, accessible via the factory, to ones, allowed by the policy. The policy is installed into
+     * helper before any requests are served, and can not be changed afterwards. Later changes to the passed
+     * policy object have no effect.
+     *
+     * @param policy the policy, or null to allow access to any files (the default)
+     */
+    public FactoryOptions pathPolicy(PathPolicy policy) {
+        this.policy = policy == null || policy.isEmpty() ? null : policy.toArgs();
+
+        return this;
+    }
+
+    /**
+     * Keep track of descriptors, handed out by the factory, until they are closed, and report the ones,
+     * that stay open for long or are garbage-collected without being closed, via
+     * {@link FileDescriptorFactory#getStats(int)}. Capturing call stack is relatively expensive, so it is done
+     * only for specified fraction of descriptors.
+     *
+     * @param sampleRate fraction of descriptors, whose call sites are captured, from 0 (none) to 1 (all)
+     */
+    public FactoryOptions trackLeaks(float sampleRate) {
+        if (!(sampleRate >= 0 && sampleRate <= 1))
+            throw new IllegalArgumentException("Invalid sample rate: " + sampleRate);
+
+        trackLeaks = true;
+        leakSampleRate = sampleRate;
+
+        return this;
+    }
+
+    /**
+     * Watch the number of open descriptors in the process and keep it below RLIMIT_NOFILE. Once the number
+     * crosses the high watermark, prefetched descriptors are closed and prefetching is suspended. Beyond that
+     * new opens wait for other descriptors to be closed and eventually fail with IOException instead
+     * of exhausting the descriptor table. The counts are reported by {@link FileDescriptorFactory#getStats(int)}.
+     *
+     * @param highWatermark fraction of the limit, such as 0.8, or 0 to disable (the default)
+     */
+    public FactoryOptions descriptorBudget(float highWatermark) {
+        if (!(highWatermark >= 0 && highWatermark < 1))
+            throw new IllegalArgumentException("Invalid watermark: " + highWatermark);
+
+        descriptorBudget = highWatermark;
+
+        return this;
+    }
+
+    /**
+     * Close descriptors, discarded by the factory itself (such as responses to cancelled requests and expired
+     * prefetched descriptors), on a background thread. Closing the last descriptor of a file on FUSE or network
+     * filesystem may block for a long time, which would otherwise stall other requests.
+     */
+    public FactoryOptions deferCloses(boolean value) {
+        deferCloses = value;
+
+        return this;
+    }
+
+    /**
+     * Wait for helper responses on a single thread, shared by all factories with this option, instead of
+     * a dedicated thread per factory. Useful, when the application keeps many factories (for example,
+     * with different path policies). Requires Lollipop, ignored on older versions.
+     */
+    public FactoryOptions shareReactor(boolean value) {
+        sharedReactor = value;
+
+        return this;
+    }
+
+    /**
+     * Record requests, sent to the helper, with their timing and results into the file, overwriting it.
+     * The trace can be replayed by {@link TraceReplay} or the {@code fdreplay} tool to compare changes in
+     * the helper on realistic workloads. Requests, served without involving the helper (such as coalesced
+     * or prefetched opens), are not recorded.
+     *
+     * @param file the trace file, or null to disable recording (the default)
+     * @param withPaths whether to record paths themselves instead of their hashes
+     */
+    public FactoryOptions recordTrace(File file, boolean withPaths) {
+        traceFile = file;
+        tracePaths = withPaths;
+
+        return this;
+    }
+
+    // options, that are equal by this key, produce identically configured factories
+    List<Object> key() {
+        return Arrays.asList(coalesceOpens, coalesceWrites, prefetchSiblings, prefetchLimit,
+                policy == null ? null : Arrays.asList(policy), trackLeaks, leakSampleRate, descriptorBudget,
+                deferCloses, sharedReactor, traceFile, tracePaths);
+    }
+}
@@ -0,0 +1,131 @@
+/*
+ * Copyright © 2015 Alexander Rvachev
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+package net.sf.fdshare;
+
+import android.content.Context;
+
+import java.io.IOException;
+import java.util.HashMap;
+import java.util.List;
+import java.util.concurrent.ScheduledFuture;
+import java.util.concurrent.ScheduledThreadPoolExecutor;
+import java.util.concurrent.TimeUnit;
+
+/**
+ * Process-wide registry of factories, shared via {@link FactoryLease}. There is at most one factory (and one
+ * helper process) per configuration. Unused factories are kept for a while, so that components, that
+ * repeatedly acquire and release leases, don't cause the helper (and "su" prompt) to be restarted each time.
+ */
+final class FactoryRegistry {
+    static final class Entry {
+        final List<Object> key;
+        final FileDescriptorFactory factory;
+        final long idleTimeout;
+
+        // guarded by registry lock
+        int leases;
+        ScheduledFuture<?> expiration;
+
+        Entry(List<Object> key, FileDescriptorFactory factory, long idleTimeout) {
+            this.key = key;
+            this.factory = factory;
+            this.idleTimeout = idleTimeout;
+        }
+    }
+
+    private static final Object lock = new Object();
+
+    // guarded by lock
+    private static final HashMap<List<Object>, Entry> entries = new HashMap<>();
+
+    private static ScheduledThreadPoolExecutor timer;
+
+    private FactoryRegistry() {
+        throw new AssertionError("No instances");
+    }
+
+    static FactoryLease lease(Context context, FactoryOptions options, long idleTimeout) throws IOException {
+        final List<Object> key = options.key();
+
+        synchronized (lock) {
+            Entry entry = entries.get(key);
+
+            // the helper may have died since
+            if (entry != null && entry.factory.isClosed()) {
+                cancelExpiration(entry);
+                entries.remove(key);
+                entry = null;
+            }
+
+            if (entry == null) {
+                entry = new Entry(key, FileDescriptorFactory.create(context.getApplicationContext(), options),
+                        idleTimeout);
+                entries.put(key, entry);
+            }
+
+            cancelExpiration(entry);
+
+            entry.leases++;
+
+            return new FactoryLease(entry);
+        }
+    }
+
+    static void release(Entry entry) {
+        synchronized (lock) {
+            if (--entry.leases != 0)
+                return;
+
+            if (entry.idleTimeout <= 0 || entry.factory.isClosed()) {
+                expire(entry);
+                return;
+            }
+
+            if (timer == null) {
+                timer = new ScheduledThreadPoolExecutor(1, r -> {
+                    final Thread thread = new Thread(r, "fd factory expiration");
+                    thread.setDaemon(true);
+                    return thread;
+                });
+            }
+
+            entry.expiration = timer.schedule(() -> {
+                synchronized (lock) {
+                    if (entry.leases == 0)
+                        expire(entry);
+                }
+            }, entry.idleTimeout, TimeUnit.MILLISECONDS);
+        }
+    }
+
+    // must be called with lock held
+    private static void expire(Entry entry) {
+        entry.expiration = null;
+
+        if (entries.get(entry.key) == entry)
+            entries.remove(entry.key);
+
+        entry.factory.close();
+    }
+
+    // must be called with lock held
+    private static void cancelExpiration(Entry entry) {
+        if (entry.expiration != null) {
+            entry.expiration.cancel(false);
+            entry.expiration = null;
+        }
+    }
+}
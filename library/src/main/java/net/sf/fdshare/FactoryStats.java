@@ -0,0 +1,188 @@
+/*
+ * Copyright © 2015 Alexander Rvachev
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+package net.sf.fdshare;
+
+import android.support.annotation.NonNull;
+
+import java.util.Collections;
+import java.util.List;
+
+/**
+ * A snapshot of descriptor usage, returned by {@link FileDescriptorFactory#getStats(int)}.
+ * <p>
+ * Descriptors, handed out by {@link FileDescriptorFactory} and not closed yet, are reported, when tracking is
+ * enabled by {@link FactoryOptions#trackLeaks}. A descriptor is considered leaked, when it's owner (such as
+ * {@link android.os.ParcelFileDescriptor}) is garbage-collected without being closed.
+ * <p>
+ * Usage of process descriptor table is reported, when enabled by {@link FactoryOptions#descriptorBudget}.
+ */
+public final class FactoryStats {
+    /**
+     * A descriptor, that is still open.
+     */
+    public static final class Descriptor {
+        private final long age;
+        private final StackTraceElement[] site;
+
+        Descriptor(long age, StackTraceElement[] site) {
+            this.age = age;
+            this.site = site;
+        }
+
+        /**
+         * @return milliseconds since the descriptor was handed out
+         */
+        public long getAge() {
+            return age;
+        }
+
+        /**
+         * @return the call stack, that requested the descriptor, or empty array if it was not sampled
+         */
+        public @NonNull StackTraceElement[] getSite() {
+            return site;
+        }
+    }
+
+    /**
+     * A call site, that requested sampled descriptors.
+     */
+    public static final class Site {
+        private final StackTraceElement[] stack;
+
+        int outstanding;
+        int leaked;
+
+        Site(StackTraceElement[] stack) {
+            this.stack = stack;
+        }
+
+        /**
+         * @return the call stack, starting with the caller of factory method
+         */
+        public @NonNull StackTraceElement[] getStack() {
+            return stack;
+        }
+
+        /**
+         * @return number of sampled descriptors from this site, that are still open
+         */
+        public int getOutstanding() {
+            return outstanding;
+        }
+
+        /**
+         * @return number of sampled descriptors from this site, that were leaked (among the recent leaks only)
+         */
+        public int getLeaked() {
+            return leaked;
+        }
+    }
+
+    private final int outstanding;
+    private final int leaked;
+    private final List<Descriptor> oldest;
+    private final List<Site> sites;
+
+    // filled by FdBudget
+    int descriptors;
+    int descriptorLimit;
+    int peakDescriptors;
+    int throttled;
+    int rejected;
+    int evicted;
+
+    FactoryStats() {
+        this(0, 0, Collections.<Descriptor>emptyList(), Collections.<Site>emptyList());
+    }
+
+    FactoryStats(int outstanding, int leaked, List<Descriptor> oldest, List<Site> sites) {
+        this.outstanding = outstanding;
+        this.leaked = leaked;
+        this.oldest = Collections.unmodifiableList(oldest);
+        this.sites = Collections.unmodifiableList(sites);
+    }
+
+    /**
+     * @return number of handed out descriptors, that are not closed yet
+     */
+    public int getOutstanding() {
+        return outstanding;
+    }
+
+    /**
+     * @return total number of descriptors, that were leaked so far
+     */
+    public int getLeaked() {
+        return leaked;
+    }
+
+    /**
+     * @return the oldest outstanding descriptors, oldest first
+     */
+    public @NonNull List<Descriptor> getOldest() {
+        return oldest;
+    }
+
+    /**
+     * @return call sites, responsible for most outstanding and leaked descriptors, biggest first
+     */
+    public @NonNull List<Site> getBiggestLeakers() {
+        return sites;
+    }
+
+    /**
+     * @return number of descriptors, open in the process (not just by the factory)
+     */
+    public int getDescriptors() {
+        return descriptors;
+    }
+
+    /**
+     * @return soft RLIMIT_NOFILE of the process, or 0 if it is unknown or unlimited
+     */
+    public int getDescriptorLimit() {
+        return descriptorLimit;
+    }
+
+    /**
+     * @return the highest number of open descriptors, observed so far
+     */
+    public int getPeakDescriptors() {
+        return peakDescriptors;
+    }
+
+    /**
+     * @return number of requests, that had to wait for other descriptors to be closed
+     */
+    public int getThrottled() {
+        return throttled;
+    }
+
+    /**
+     * @return number of requests, that failed, because too many descriptors remained open
+     */
+    public int getRejected() {
+        return rejected;
+    }
+
+    /**
+     * @return number of cached descriptors, closed to make room for new ones
+     */
+    public int getEvicted() {
+        return evicted;
+    }
+}
@@ -0,0 +1,217 @@
+/*
+ * Copyright © 2015 Alexander Rvachev
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+package net.sf.fdshare;
+
+import android.os.SystemClock;
+import android.util.Log;
+
+import java.io.BufferedReader;
+import java.io.File;
+import java.io.FileReader;
+import java.io.IOException;
+
+/**
+ * Keeps the number of open descriptors in the process below RLIMIT_NOFILE. The number is measured by listing
+ * {@code /proc/self/fd}, but not more often than once per {@value #MEASURE_INTERVAL_MS} ms: in between
+ * descriptors, issued by the factory, are simply added to the last measurement.
+ * <p>
+ * Crossing the high watermark causes cached descriptors to be evicted. Crossing the critical watermark
+ * (midway between the high watermark and the limit) blocks new opens until other descriptors are closed, and
+ * eventually fails them with ordinary IOException, which is much easier to deal with than EMFILE, thrown at
+ * random places. Blocked opens are woken up by {@link #release}, when descriptors, handed out by the factory,
+ * are closed; the rest of the process is only recounted once the wait is over.
+ */
+final class FdBudget {
+    interface Evictor {
+        /**
+         * @return number of closed descriptors
+         */
+        int evict();
+    }
+
+    private static final String TAG = "FdBudget";
+
+    private static final long MEASURE_INTERVAL_MS = 100;
+
+    // the limit may change at runtime (setrlimit by another library), but not often
+    private static final long LIMIT_INTERVAL_MS = 10000;
+
+    private final float highWatermark;
+    private final long maxWait;
+    private final Evictor evictor;
+
+    // guarded by this
+    private int limit;
+    private long limitRead;
+    private int count;
+    private long measured;
+    private int issued;
+    private int releases;
+
+    private int peak;
+    private int throttled;
+    private int rejected;
+    private int evicted;
+
+    /**
+     * @param highWatermark fraction of the limit, above which cached descriptors are evicted
+     * @param maxWait maximum time to wait for descriptors to be closed, in milliseconds
+     */
+    FdBudget(float highWatermark, long maxWait, Evictor evictor) {
+        this.highWatermark = highWatermark;
+        this.maxWait = maxWait;
+        this.evictor = evictor;
+    }
+
+    /**
+     * @return true if opening supplied number of descriptors would cross the high watermark, so that optional
+     * opens (such as prefetching) should be skipped
+     */
+    synchronized boolean isUnderPressure(int descriptors) {
+        return estimate(false) + descriptors > high();
+    }
+
+    /**
+     * Wait until supplied number of descriptors can be opened.
+     *
+     * @throws IOException if the process keeps running too close to the limit
+     */
+    void acquire(int descriptors) throws IOException {
+        synchronized (this) {
+            if (estimate(false) + descriptors <= high()) {
+                issued += descriptors;
+                return;
+            }
+        }
+
+        // must not be called with lock held, the evictor has it's own
+        final int closed = evictor.evict();
+
+        final long deadline = SystemClock.uptimeMillis() + maxWait;
+
+        boolean waited = false;
+
+        synchronized (this) {
+            evicted += closed;
+
+            boolean recount = true;
+
+            while (estimate(recount) + descriptors > critical()) {
+                final long remaining = deadline - SystemClock.uptimeMillis();
+
+                if (remaining <= 0) {
+                    rejected++;
+
+                    throw new IOException("Too many open descriptors: " + count + " of " + limit);
+                }
+
+                if (!waited) {
+                    waited = true;
+                    throttled++;
+                }
+
+                final int seen = releases;
+
+                try {
+                    wait(remaining);
+                } catch (InterruptedException e) {
+                    Thread.currentThread().interrupt();
+
+                    throw new IOException("Interrupted while waiting for descriptors to be closed");
+                }
+
+                recount = releases != seen || SystemClock.uptimeMillis() >= deadline;
+            }
+
+            issued += descriptors;
+        }
+    }
+
+    /**
+     * Called after a descriptor, handed out by the factory, is closed.
+     */
+    synchronized void release() {
+        releases++;
+
+        notifyAll();
+    }
+
+    synchronized void report(FactoryStats stats) {
+        estimate(true);
+
+        stats.descriptors = count;
+        stats.descriptorLimit = limit;
+        stats.peakDescriptors = peak;
+        stats.throttled = throttled;
+        stats.rejected = rejected;
+        stats.evicted = evicted;
+    }
+
+    private int high() {
+        return limit == 0 ? Integer.MAX_VALUE : (int) (limit * highWatermark);
+    }
+
+    private int critical() {
+        return limit == 0 ? Integer.MAX_VALUE : high() + (limit - high()) / 2;
+    }
+
+    // must be called with lock held
+    private int estimate(boolean force) {
+        final long now = SystemClock.uptimeMillis();
+
+        if (limitRead == 0 || now - limitRead > LIMIT_INTERVAL_MS) {
+            limit = readLimit();
+            limitRead = now;
+        }
+
+        if (force || measured == 0 || now - measured > MEASURE_INTERVAL_MS) {
+            final String[] fds = new File("/proc/self/fd").list();
+
+            if (fds != null) {
+                // the listing itself uses a descriptor
+                count = Math.max(0, fds.length - 1);
+                issued = 0;
+                measured = now;
+            }
+        }
+
+        final int estimate = count + issued;
+
+        if (estimate > peak)
+            peak = estimate;
+
+        return estimate;
+    }
+
+    // the soft limit, or 0 if it can not be determined
+    private static int readLimit() {
+        try (BufferedReader reader = new BufferedReader(new FileReader("/proc/self/limits"))) {
+            String line;
+            while ((line = reader.readLine()) != null) {
+                if (!line.startsWith("Max open files"))
+                    continue;
+
+                final String[] columns = line.substring("Max open files".length()).trim().split("\\s+");
+
+                return "unlimited".equals(columns[0]) ? 0 : Integer.parseInt(columns[0]);
+            }
+        } catch (IOException | RuntimeException e) {
+            Log.w(TAG, "Failed to read descriptor limit", e);
+        }
+
+        return 0;
+    }
+}
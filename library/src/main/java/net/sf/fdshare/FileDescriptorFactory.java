@@ -18,18 +18,27 @@ package net.sf.fdshare;
 import android.content.Context;
 import android.net.LocalServerSocket;
 import android.net.LocalSocket;
+import android.net.LocalSocketAddress;
 import android.os.*;
 import android.support.annotation.IntDef;
 import android.support.annotation.NonNull;
+import android.support.annotation.Nullable;
 import android.support.annotation.VisibleForTesting;
 import android.util.Log;
+import net.sf.fdshare.internal.DeferredCloser;
 import net.sf.fdshare.internal.FdCompat;
+import net.sf.fdshare.internal.FdNative;
 
+import java.io.BufferedInputStream;
+import java.io.ByteArrayOutputStream;
 import java.io.Closeable;
+import java.io.DataInputStream;
+import java.io.EOFException;
 import java.io.File;
 import java.io.FileDescriptor;
 import java.io.FileOutputStream;
 import java.io.IOException;
+import java.io.InputStream;
 import java.io.OutputStreamWriter;
 import java.io.RandomAccessFile;
 import java.io.Writer;
@@ -41,8 +50,13 @@ import java.nio.ByteBuffer;
 import java.nio.ByteOrder;
 import java.nio.channels.Channels;
 import java.nio.channels.ReadableByteChannel;
+import java.util.ArrayList;
+import java.util.Arrays;
+import java.util.List;
+import java.util.Map;
 import java.util.UUID;
 import java.util.concurrent.ArrayBlockingQueue;
+import java.util.concurrent.CountDownLatch;
 import java.util.concurrent.SynchronousQueue;
 import java.util.concurrent.TimeUnit;
 import java.util.concurrent.atomic.AtomicBoolean;
@@ -87,6 +101,7 @@ public final class FileDescriptorFactory implements Closeable {
     public static final String DEBUG_MODE = "net.sf.fdshare.DEBUG";
     public static final String PRIMARY_TIMEOUT = "net.sf.fdshare.TIMEOUT_1";
     public static final String SECONDARY_TIMEOUT = "net.sf.fdshare.TIMEOUT_2";
+    public static final String IDLE_TIMEOUT = "net.sf.fdshare.IDLE_TIMEOUT";
 
     /**
      * This type covers most {@code open} flags, properly supported by Bionic and this library.
@@ -147,6 +162,86 @@ public final class FileDescriptorFactory implements Closeable {
     public static final int O_PATH = 2097152;    // 0b1000000000000000000000;
     public static final int O_TRUNC = 512;       // 0b0000000000001000000000;
 
+    /**
+     * Path resolution restrictions, supported by {@link #open(File, String, int, int)}. Same as {@code RESOLVE_*}
+     * flags of Linux {@code openat2} function.
+     */
+    @IntDef(value = {
+            RESOLVE_NO_XDEV,
+            RESOLVE_NO_MAGICLINKS,
+            RESOLVE_NO_SYMLINKS,
+            RESOLVE_BENEATH,
+            RESOLVE_IN_ROOT
+    }, flag = true)
+    @Documented
+    @Retention(RetentionPolicy.SOURCE)
+    public @interface ResolveFlag {}
+
+    public static final int RESOLVE_NO_XDEV = 0x01;
+    public static final int RESOLVE_NO_MAGICLINKS = 0x02;
+    public static final int RESOLVE_NO_SYMLINKS = 0x04;
+    public static final int RESOLVE_BENEATH = 0x08;
+    public static final int RESOLVE_IN_ROOT = 0x10;
+
+    /**
+     * Digest algorithms, supported by {@link #hash}.
+     */
+    @IntDef(value = {
+            HASH_CRC32C,
+            HASH_SHA256
+    })
+    @Documented
+    @Retention(RetentionPolicy.SOURCE)
+    public @interface HashAlgorithm {}
+
+    /**
+     * CRC-32C (Castagnoli) checksum, returned as 4 bytes in big-endian order.
+     */
+    public static final int HASH_CRC32C = 1;
+
+    /**
+     * SHA-256 digest, 32 bytes long.
+     */
+    public static final int HASH_SHA256 = 2;
+
+    // request opcodes, must match ones in fdhelper.c
+    static final char OP_OPEN = 'o';
+    static final char OP_HASH = 'h';
+    static final char OP_ARCHIVE = 'a';
+    static final char OP_EXTRACT = 'x';
+    static final char OP_WATCH = 'w';
+    static final char OP_GET_HANDLE = 'g';
+    static final char OP_OPEN_HANDLE = 'b';
+    static final char OP_OPEN_RESOLVED = 'r';
+    static final char OP_OPEN_MANY = 'm';
+    static final char OP_SET_POLICY = 'p';
+    static final char OP_SPAWN = 's';
+    static final char OP_KILL = 'k';
+    static final char OP_READ_HEADERS = 'f';
+
+    // the helper reports policy violations with this text in place of errno description, see ErrorString in fdhelper.c
+    private static final String POLICY_DENIAL = " - denied by policy";
+
+    // must match MAX_BATCH_OPEN in fdhelper.c
+    static final int MAX_BATCH_OPEN = 16;
+
+    // must match MAX_HASH_FILES in fdhelper.c
+    static final int MAX_HASH_FILES = 4096;
+
+    /**
+     * Largest number of bytes per file, that can be requested from {@link #readHeaders}.
+     */
+    public static final int MAX_HEADER_SIZE = 8192; // must match MAX_HEADER_SIZE in fdhelper.c
+
+    /**
+     * Largest number of paths, that can be passed to {@link #watch}.
+     */
+    public static final int MAX_WATCHES = 256; // must match MAX_WATCHES in fdhelper.c
+
+    // must match MAX_RESPONSE_SIZE and HEADER_RECORD_SIZE in fdhelper.c
+    static final int MAX_RESPONSE_SIZE = 64 * 1024;
+    private static final int HEADER_RECORD_OVERHEAD = 96;
+
     private static final String FD_HELPER_TAG = "fdhelper";
 
     static final String EXEC_PIC = "fdshare_PIC_exec";
@@ -156,6 +251,7 @@ public final class FileDescriptorFactory implements Closeable {
     static final boolean DEBUG;
     static final long HELPER_TIMEOUT;
     static final long IO_TIMEOUT;
+    static final long LEASE_TIMEOUT;
 
     static {
         EXEC_NAME = Build.VERSION.SDK_INT >= Build.VERSION_CODES.JELLY_BEAN ? EXEC_PIC : EXEC_NONPIC;
@@ -164,6 +260,7 @@ public final class FileDescriptorFactory implements Closeable {
 
         HELPER_TIMEOUT = Long.parseLong(System.getProperty(PRIMARY_TIMEOUT, "20000"));
         IO_TIMEOUT = Long.parseLong(System.getProperty(SECONDARY_TIMEOUT, "2500"));
+        LEASE_TIMEOUT = Long.parseLong(System.getProperty(IDLE_TIMEOUT, "30000"));
     }
 
     /**
@@ -179,23 +276,110 @@ public final class FileDescriptorFactory implements Closeable {
      * @throws IOException if creation of instance fails, such as due to absence of "su" command in {@code PATH} etc.
      */
     public static FileDescriptorFactory create(Context context) throws IOException {
+        return create(context, new FactoryOptions());
+    }
+
+    /**
+     * Same as {@link #create(Context)}, but with optional features, enabled by supplied options.
+     *
+     * @throws IOException if creation of instance fails, such as due to absence of "su" command in {@code PATH} etc.
+     */
+    public static FileDescriptorFactory create(Context context, FactoryOptions options) throws IOException {
         final String command = new File(FdCompat.libDir(context), System.mapLibraryName(EXEC_NAME)).getAbsolutePath();
 
         final String address = UUID.randomUUID().toString();
 
-        return BuildConfig.DEBUG ? create(address, command, address) : create(address, "su", "-c", command + ' ' + address);
+        return BuildConfig.DEBUG
+                ? create(options, address, command, address)
+                : create(options, address, "su", "-c", command + ' ' + address);
+    }
+
+    /**
+     * Obtain a factory, shared with other users within the process, that request the same options. Unlike
+     * {@link #create(Context, FactoryOptions)} this does not start a new helper process (and does not cause
+     * another "su" prompt), if a suitable one is already running.
+     * <p>
+     * The factory is closed after the last lease is released and {@link #IDLE_TIMEOUT} milliseconds (30 seconds by
+     * default) have passed without new leases. If the helper dies, the next lease starts a new one.
+     *
+     * @throws IOException if creation of instance fails, such as due to absence of "su" command in {@code PATH} etc.
+     */
+    public static FactoryLease lease(Context context, FactoryOptions options) throws IOException {
+        return FactoryRegistry.lease(context, options, LEASE_TIMEOUT);
     }
 
     @VisibleForTesting
     static FileDescriptorFactory create(String address, String... cmd) throws IOException {
+        return create(new FactoryOptions(), address, cmd);
+    }
+
+    @VisibleForTesting
+    static FileDescriptorFactory create(FactoryOptions options, String address, String... cmd) throws IOException {
         // must be created before the process
         final LocalServerSocket socket = new LocalServerSocket(address);
+
+        Process shell = null;
         try {
-            final Process shell = new ProcessBuilder(cmd)
+            shell = new ProcessBuilder(cmd)
                     .redirectErrorStream(true)
                     .start();
 
-            final FileDescriptorFactory result = new FileDescriptorFactory(shell, socket);
+            final FileDescriptorFactory result = new FileDescriptorFactory(options, shell, socket, null);
+
+            result.startServer();
+
+            return result;
+        } catch (Throwable t) {
+            if (shell != null)
+                shell.destroy();
+
+            shut(socket);
+
+            throw t;
+        }
+    }
+
+    /**
+     * Create a FileDescriptorFactory, connected to a shared helper daemon instead of spawning own helper.
+     * The daemon must be started beforehand (e.g. by init script) with superuser privileges:
+     * <p>
+     * {@code libfdshare_exec.so --daemon <name> <policy file>}
+     * <p>
+     * The policy file lists UIDs of applications, allowed to connect, one per line, each followed by maximum
+     * number of concurrent connections from that UID and optionally by a file with path policy rules for it.
+     * The daemon serves each connection in a separate process and reloads the policy on SIGHUP. This saves
+     * memory and "su" prompts when many applications (or many processes of one application) need the helper.
+     * <p>
+     * When the daemon restricts this application, {@link FactoryOptions#pathPolicy} can not be used: the
+     * daemon's rules are installed first and can not be replaced.
+     *
+     * @param daemonName name of abstract socket, the daemon listens on
+     *
+     * @throws IOException if connection fails, the daemon does not run as root or rejects this application
+     */
+    public static FileDescriptorFactory connect(String daemonName, FactoryOptions options) throws IOException {
+        final LocalSocket socket = new LocalSocket();
+        try {
+            socket.connect(new LocalSocketAddress(daemonName));
+
+            // anyone can listen on abstract socket, make sure, that we are talking to root
+            if (socket.getPeerCredentials().getUid() != 0)
+                throw new IOException("The daemon at " + daemonName + " does not run as root");
+
+            // the daemon authenticates us by UID and responds with either "OK" or error, framed as usual
+            final DataInputStream greeting = new DataInputStream(socket.getInputStream());
+            final int length = greeting.readInt();
+            if (length < 0 || length > 8192)
+                throw new IOException("Invalid greeting from daemon");
+
+            final byte[] message = new byte[length];
+            greeting.readFully(message);
+
+            final String response = new String(message, "UTF-8");
+            if (!response.startsWith("OK"))
+                throw new IOException("Rejected by daemon: " + response);
+
+            final FileDescriptorFactory result = new FileDescriptorFactory(options, null, null, socket);
 
             result.startServer();
 
@@ -214,80 +398,736 @@ public final class FileDescriptorFactory implements Closeable {
     final LocalServerSocket serverSocket;
     final Process clientProcess;
 
+    // set instead of the former two, when connected to daemon
+    final LocalSocket daemonSocket;
+
+    private final OpenCoalescer coalescer;
+    private final SiblingPrefetcher prefetcher;
+    private final FdReq policyRequest;
+    private final LeakTracker leakTracker;
+    private final FdBudget budget;
+    private final DeferredCloser closer;
+    private final TraceRecorder recorder;
+
     private volatile Server serverThread;
 
-    private FileDescriptorFactory(final Process clientProcess, final LocalServerSocket serverSocket) {
+    // set, when served by shared reactor instead of own thread
+    private final SharedReactor reactor;
+    private final CountDownLatch connected = new CountDownLatch(1);
+    private volatile Connection connection;
+
+    private FileDescriptorFactory(FactoryOptions options, Process clientProcess, LocalServerSocket serverSocket,
+                                  LocalSocket daemonSocket) throws IOException {
+        // the only part, that can fail, goes first, so that nothing else is left behind
+        this.recorder = options.traceFile == null ? null : new TraceRecorder(options.traceFile, options.tracePaths);
+
         this.clientProcess = clientProcess;
         this.serverSocket = serverSocket;
+        this.daemonSocket = daemonSocket;
+        this.reactor = options.sharedReactor ? SharedReactor.get() : null;
+        this.closer = options.deferCloses ? new DeferredCloser() : null;
+        this.coalescer = options.coalesceOpens ? new OpenCoalescer(options.coalesceWrites) : null;
+        this.prefetcher = options.prefetchSiblings == 0 ? null
+                : new SiblingPrefetcher(this::prefetch, options.prefetchSiblings, options.prefetchLimit, closer);
+        this.policyRequest = options.policy == null ? null : new FdReq(OP_SET_POLICY, options.policy);
+        this.leakTracker = options.trackLeaks ? new LeakTracker(options.leakSampleRate) : null;
+        this.budget = options.descriptorBudget == 0 ? null : new FdBudget(options.descriptorBudget, IO_TIMEOUT,
+                () -> prefetcher == null ? 0 : prefetcher.evictAll());
+
+        intake.offer(FdReq.PLACEHOLDER);
+    }
+
+    private void startServer() throws IOException {
+        serverThread = new Server();
+        serverThread.start();
+    }
+
+    /**
+     * Return file descriptor for supplied file, open for read-write access with default flags
+     * (which are {@link #O_RDWR} and {@link #O_CREAT}) and the same creation mode as used by
+     * {@link ParcelFileDescriptor#open(File, int)}.
+     *
+     * <p>
+     *
+     * <b>Do not call this method from the main thread!</b>
+     *
+     * @throws IOException recoverable error, such as when file was not found
+     * @throws FactoryBrokenException irrecoverable error, that renders this factory instance unusable
+     */
+    public @NonNull ParcelFileDescriptor open(File file) throws IOException, FactoryBrokenException {
+        return open(file, O_RDWR | O_CREAT);
+    }
+
+    /**
+     * Return file descriptor for supplied file, open for specified access with supplied flags
+     * and the same creation mode as used by {@link ParcelFileDescriptor#open(File, int)}.
+     *
+     * <p>
+     *
+     * <b>Do not call this method from the main thread!</b>
+     *
+     * @param file the {@link File} object, with path to the target file, not necessarily accessible to your UID
+     * @param mode either {@link #O_RDONLY}, {@link #O_WRONLY} or {@link #O_RDWR}, or-ed with other {@link OpenFlag} constants
+     *
+     * @throws IOException recoverable error, such as when file was not found
+     * @throws FactoryBrokenException irrecoverable error, that renders this factory instance unusable
+     *
+     * @see FactoryOptions#coalesceOpens
+     * @see FactoryOptions#prefetchSiblings
+     */
+    public @NonNull ParcelFileDescriptor open(File file, @OpenFlag int mode) throws IOException, FactoryBrokenException {
+        ParcelFileDescriptor result = prefetcher == null ? null : prefetcher.take(file, mode);
+
+        if (result == null)
+            result = coalescer == null ? openDirectly(file, mode) : coalescer.open(file, mode, this::openDirectly);
+
+        if (prefetcher != null)
+            prefetcher.onOpened(file, mode);
+
+        return tracked(result);
+    }
+
+    private ParcelFileDescriptor openDirectly(File file, int mode) throws IOException, FactoryBrokenException {
+        return FdCompat.adopt(openFileDescriptor(file, mode));
+    }
+
+    /**
+     * Return file descriptor for supplied path, resolved relative to base directory with given restrictions,
+     * along with canonical path of the opened file. The restrictions are enforced by kernel during lookup
+     * itself, so they are not subject to races with concurrent renames and symlink creation.
+     * <p>
+     * On kernels without {@code openat2} (before Linux 5.6) the path is resolved one component at a time, and
+     * any symlink or {@code ..} component is rejected as soon as any restriction is requested.
+     * <p>
+     * Under a {@link PathPolicy} the opened file is checked after opening, unless the path is absolute (and
+     * {@link #RESOLVE_IN_ROOT} is not set), so such paths can not be used with {@link #O_CREAT}.
+     *
+     * <p>
+     *
+     * <b>Do not call this method from the main thread!</b>
+     *
+     * @param base the directory to resolve path against, or null to resolve relative paths against root
+     * @param path the path to resolve
+     * @param mode either {@link #O_RDONLY}, {@link #O_WRONLY} or {@link #O_RDWR}, or-ed with other {@link OpenFlag} constants
+     * @param resolve combination of {@link ResolveFlag} constants
+     *
+     * @throws IOException recoverable error, such as when file was not found or the path violates restrictions
+     * @throws FactoryBrokenException irrecoverable error, that renders this factory instance unusable
+     */
+    public @NonNull ResolvedDescriptor open(File base, String path, @OpenFlag int mode, @ResolveFlag int resolve)
+            throws IOException, FactoryBrokenException {
+        final FdReq request = new FdReq(OP_OPEN_RESOLVED, base == null ? "/" : base.getPath(), path, mode, resolve);
+
+        acquire(1);
+
+        final FdResp response = sendRequest(request, "Failed to open file: ");
+
+        // "READY <canonical path>"
+        final String canonicalPath = response.message.length() > 6 ? response.message.substring(6) : null;
+
+        return new ResolvedDescriptor(tracked(FdCompat.adopt(response.fd)), canonicalPath);
+    }
+
+    /**
+     * Shorthand for creating a {@link RandomAccessFile} from {@link FileDescriptor}, when all you need is
+     * a simple read/write functionality.
+     */
+    public @NonNull RandomAccessFile openRandomAccessFile(File file) throws IOException, FactoryBrokenException {
+        final FileDescriptor fd = openFileDescriptor(file, O_RDWR | O_CREAT);
+
+        if (leakTracker == null && budget == null)
+            return FdCompat.convert(fd);
+
+        final CloseAware.RandomAccess owner = new CloseAware.RandomAccess();
+
+        FdCompat.convert(fd, owner);
+
+        owner.onClose = onClose(owner, owner.getFD());
+
+        return owner;
+    }
+
+    /**
+     * Compute digests of supplied files with superuser privileges. The files are read by helper process
+     * with large sequential reads, several files at once, and only resulting digests are transferred back,
+     * so this is considerably cheaper than opening each file and reading it in your process. Long lists are sent
+     * to helper in several requests.
+     *
+     * <p>
+     *
+     * <b>Do not call this method from the main thread!</b>
+     *
+     * @param files the files to hash, not necessarily accessible to your UID
+     * @param algorithm one of {@link HashAlgorithm} constants
+     *
+     * @return digests in the same order as {@code files}; elements, corresponding to files, that could not be read,
+     * are null
+     *
+     * @throws IOException recoverable error, such as when the algorithm is not supported
+     * @throws FactoryBrokenException irrecoverable error, that renders this factory instance unusable
+     */
+    public @NonNull byte[][] hash(List<File> files, @HashAlgorithm int algorithm) throws IOException, FactoryBrokenException {
+        final byte[][] digests = new byte[files.size()][];
+
+        for (int start = 0; start < files.size(); start += MAX_HASH_FILES)
+            hash(files, start, Math.min(files.size() - start, MAX_HASH_FILES), algorithm, digests);
+
+        return digests;
+    }
+
+    private void hash(List<File> files, int start, int count, int algorithm, byte[][] digests) throws IOException, FactoryBrokenException {
+        final Object[] args = new Object[count + 2];
+        args[0] = algorithm;
+        args[1] = count;
+        for (int i = 0; i < count; i++)
+            args[i + 2] = files.get(start + i).getPath();
+
+        final FileDescriptor results = sendRequest(new FdReq(OP_HASH, args), "Failed to start hashing: ").fd;
+
+        try (DataInputStream in = new DataInputStream(new BufferedInputStream(
+                new ParcelFileDescriptor.AutoCloseInputStream(FdCompat.adopt(results)))))
+        {
+            for (int i = 0; i < count; i++) {
+                final int status = in.readInt();
+                final byte[] digest = new byte[in.readInt()];
+
+                in.readFully(digest);
+
+                if (status == 0)
+                    digests[start + i] = digest;
+            }
+        } catch (EOFException eof) {
+            throw new IOException("Helper failed to complete hashing");
+        }
+    }
+
+    /**
+     * Stream contents of directory as tar archive (ustar with GNU extensions for long names) with superuser
+     * privileges. The archive is written by helper process directly from page cache into a pipe, so memory use of
+     * your process does not depend on amount of archived data.
+     * <p>
+     * Files, that can not be read, disappear during archiving or are denied by {@link PathPolicy}, are skipped.
+     * Should the archiving fail midway, the stream ends without end-of-archive marker, so the failure can be
+     * detected by reader.
+     *
+     * <p>
+     *
+     * <b>Do not call this method from the main thread!</b>
+     *
+     * @param dir the directory to archive, not necessarily accessible to your UID
+     *
+     * @return read end of pipe, the archive is streamed into
+     *
+     * @throws IOException recoverable error, such as when the pipe could not be created
+     * @throws FactoryBrokenException irrecoverable error, that renders this factory instance unusable
+     */
+    public @NonNull ParcelFileDescriptor archive(File dir, ArchiveOptions options) throws IOException, FactoryBrokenException {
+        acquire(1);
+
+        return tracked(FdCompat.adopt(sendRequest(new FdReq(OP_ARCHIVE, dir.getPath(), options.flags), "Failed to start archiving: ").fd));
+    }
+
+    /**
+     * Extract tar archive, read from supplied descriptor (such as read end of pipe or socket), to the directory
+     * with superuser privileges. Blocks until the archive is fully read or extraction fails. Symlinks are never
+     * followed, while extracting, and entries, that would end up outside of the directory, are rejected.
+     * <p>
+     * While a {@link PathPolicy} is set, entries at denied locations, device nodes and FIFOs are not extracted,
+     * and {@link ArchiveOptions#restoreOwnership} is refused altogether.
+     *
+     * <p>
+     *
+     * <b>Do not call this method from the main thread!</b>
+     *
+     * @param source descriptor to read the archive from, remains owned by caller
+     * @param dir the directory to extract into, must exist
+     *
+     * @throws IOException recoverable error, such as when the archive is damaged or some entries could not be created
+     * @throws FactoryBrokenException irrecoverable error, that renders this factory instance unusable
+     */
+    public void extract(ParcelFileDescriptor source, File dir, ArchiveOptions options) throws IOException, FactoryBrokenException {
+        final FdReq request = new FdReq(OP_EXTRACT, dir.getPath(), options.flags)
+                .attach(source.getFileDescriptor());
+
+        final FileDescriptor status = sendRequest(request, "Failed to start extraction: ").fd;
+
+        try (DataInputStream in = new DataInputStream(
+                new ParcelFileDescriptor.AutoCloseInputStream(FdCompat.adopt(status))))
+        {
+            final int errno = in.readInt();
+
+            if (errno != 0) {
+                final ByteArrayOutputStream description = new ByteArrayOutputStream();
+
+                final byte[] buffer = new byte[256];
+
+                int read;
+                while ((read = in.read(buffer)) != -1)
+                    description.write(buffer, 0, read);
+
+                final String reason = "Failed to extract archive: " + description.toString() + " (errno " + errno + ')';
+
+                throw errno == PathPolicy.DENIED ? new PolicyDeniedException(reason) : new IOException(reason);
+            }
+        } catch (EOFException eof) {
+            throw new IOException("Helper failed to complete extraction");
+        }
+    }
+
+    /**
+     * Create an inotify descriptor with watches on supplied paths, added with superuser privileges. Unlike
+     * {@link android.os.FileObserver}, this works for files and directories, inaccessible to your UID.
+     * Watches, that could not be added, are reported via {@link FsWatch#getError}.
+     *
+     * <p>
+     *
+     * <b>Do not call this method from the main thread!</b>
+     *
+     * @param paths files and directories to watch, at most {@link #MAX_WATCHES}
+     * @param mask combination of {@link android.os.FileObserver} event constants
+     *
+     * @throws IOException recoverable error, such as when the inotify instance could not be created
+     * @throws FactoryBrokenException irrecoverable error, that renders this factory instance unusable
+     */
+    public @NonNull FsWatch watch(List<File> paths, int mask) throws IOException, FactoryBrokenException {
+        if (paths.size() > MAX_WATCHES)
+            throw new IllegalArgumentException("Too many paths to watch: " + paths.size());
+
+        final File[] files = paths.toArray(new File[paths.size()]);
+
+        return createWatch(FsWatch.INOTIFY, files, mask);
+    }
+
+    /**
+     * Create a fanotify descriptor, reporting events on entire file system (or only mount point) with given path.
+     * Events carry kernel file handles, that identify affected objects, instead of paths. Requires Linux 5.1
+     * or newer (Linux 4.20 for entire file system). Such watches are refused, while a {@link PathPolicy} is set,
+     * because they cover much more than the path itself.
+     *
+     * <p>
+     *
+     * <b>Do not call this method from the main thread!</b>
+     *
+     * @param path any path on the file system or mount point to watch
+     * @param mask combination of {@code FAN_*} event constants from {@code linux/fanotify.h}
+     * @param mountOnly true to only watch the mount point, containing the path, false to watch entire file system
+     *
+     * @throws IOException recoverable error, such as when fanotify is not supported by kernel
+     * @throws FactoryBrokenException irrecoverable error, that renders this factory instance unusable
+     */
+    public @NonNull FsWatch watchFileSystem(File path, int mask, boolean mountOnly) throws IOException, FactoryBrokenException {
+        final FsWatch result = createWatch(mountOnly ? FsWatch.FANOTIFY_MOUNT : FsWatch.FANOTIFY_FILESYSTEM,
+                new File[] { path }, mask);
+
+        if (result.getError(0) != 0) {
+            result.close();
+
+            if (result.getError(0) == -PathPolicy.DENIED)
+                throw new PolicyDeniedException("Failed to mark " + path + POLICY_DENIAL);
+
+            throw new IOException("Failed to mark " + path + ", errno " + -result.getError(0));
+        }
+
+        return result;
+    }
+
+    private FsWatch createWatch(int kind, File[] paths, int mask) throws IOException, FactoryBrokenException {
+        final Object[] args = new Object[paths.length + 3];
+        args[0] = kind;
+        args[1] = mask;
+        args[2] = paths.length;
+        for (int i = 0; i < paths.length; i++)
+            args[i + 3] = paths[i].getPath();
+
+        final FdResp response = sendRequest(new FdReq(OP_WATCH, args), "Failed to create watch: ");
+
+        final ParcelFileDescriptor fd = FdCompat.adopt(response.fd);
+
+        // "READY", followed by watch descriptor or negated errno for each path
+        final String[] results = response.message.trim().split(" ");
+        final int[] watches = new int[paths.length];
+        for (int i = 0; i < watches.length; i++)
+            watches[i] = i + 1 < results.length ? Integer.parseInt(results[i + 1]) : -5; // EIO
+
+        return new FsWatch(kind, fd, paths, watches);
+    }
+
+    /**
+     * Obtain a kernel file handle for supplied file with superuser privileges. The handle can later be used to
+     * reopen the file via {@link #openByHandle} without resolving it's path, even if the file was renamed.
+     * Requires file system support (most disk-based file systems have it).
+     *
+     * <p>
+     *
+     * <b>Do not call this method from the main thread!</b>
+     *
+     * @param file the file to get handle for; if it is a symlink, the handle refers to symlink itself
+     *
+     * @throws IOException recoverable error, such as when file was not found or file system does not support handles
+     * @throws FactoryBrokenException irrecoverable error, that renders this factory instance unusable
+     */
+    public @NonNull FileHandle getHandle(File file) throws IOException, FactoryBrokenException {
+        final FdResp response = sendRequest(new FdReq(OP_GET_HANDLE, file.getPath(), 0), "Failed to get file handle: ");
+
+        return FileHandle.parse(response.message);
+    }
+
+    /**
+     * Return file descriptor for file, identified by the handle, open for specified access with supplied flags.
+     * Unlike {@link #open(File, int)} this does not involve path resolution.
+     * Under a {@link PathPolicy} the file is checked once opened, and {@link #O_TRUNC} is only applied, if the check passes.
+     *
+     * <p>
+     *
+     * <b>Do not call this method from the main thread!</b>
+     *
+     * @param handle the handle, returned by {@link #getHandle} (possibly in another process or before reboot)
+     * @param mode either {@link #O_RDONLY}, {@link #O_WRONLY} or {@link #O_RDWR}, or-ed with other {@link OpenFlag} constants
+     *
+     * @throws IOException recoverable error, such as when the file was deleted (the handle is stale)
+     * @throws FactoryBrokenException irrecoverable error, that renders this factory instance unusable
+     */
+    public @NonNull ParcelFileDescriptor openByHandle(FileHandle handle, @OpenFlag int mode) throws IOException, FactoryBrokenException {
+        final FdReq request = new FdReq(OP_OPEN_HANDLE, handle.type, handle.toHex(), handle.mountPoint, mode);
+
+        acquire(1);
+
+        return tracked(FdCompat.adopt(sendRequest(request, "Failed to open file by handle: ").fd));
+    }
+
+    /**
+     * Return file descriptors for supplied files, open for specified access with supplied flags. This is
+     * equivalent to calling {@link #open(File, int)} for each file, but takes a single round-trip to the helper
+     * per {@value #MAX_BATCH_OPEN} files.
+     *
+     * <p>
+     *
+     * <b>Do not call this method from the main thread!</b>
+     *
+     * @param files the files to open, not necessarily accessible to your UID
+     * @param mode either {@link #O_RDONLY}, {@link #O_WRONLY} or {@link #O_RDWR}, or-ed with other {@link OpenFlag} constants
+     *
+     * @return descriptors in the same order as files, with null in place of each file, that could not be opened
+     *
+     * @throws IOException recoverable error, such as when helper failed to transfer descriptors
+     * @throws FactoryBrokenException irrecoverable error, that renders this factory instance unusable
+     */
+    public @NonNull ParcelFileDescriptor[] openAll(List<File> files, @OpenFlag int mode) throws IOException, FactoryBrokenException {
+        final ParcelFileDescriptor[] results = openMany(files, mode);
+
+        for (int i = 0; i < results.length; i++)
+            if (results[i] != null)
+                results[i] = tracked(results[i]);
+
+        return results;
+    }
+
+    private ParcelFileDescriptor[] openMany(List<File> files, int mode) throws IOException, FactoryBrokenException {
+        final ParcelFileDescriptor[] results = new ParcelFileDescriptor[files.size()];
+
+        boolean success = false;
+        try {
+            for (int start = 0; start < results.length; start += MAX_BATCH_OPEN) {
+                final int count = Math.min(MAX_BATCH_OPEN, results.length - start);
+
+                final Object[] args = new Object[count * 2 + 1];
+                args[0] = count;
+                for (int i = 0; i < count; i++) {
+                    args[i * 2 + 1] = files.get(start + i).getPath();
+                    args[i * 2 + 2] = mode;
+                }
+
+                acquire(count);
+
+                final FdResp response = sendRequest(new FdReq(OP_OPEN_MANY, args), "Failed to open files: ");
+                try {
+                    final ParcelFileDescriptor[] received = adoptAll(response.fds);
+
+                    try {
+                        // "READY" (or "OK" if nothing was opened), followed by descriptor index or negated errno for each file
+                        final String[] indices = response.message.trim().split(" ");
+
+                        for (int i = 0; i < count; i++) {
+                            final int index = i + 1 < indices.length ? Integer.parseInt(indices[i + 1]) : -5; // EIO
+
+                            if (index >= 0 && index < received.length && received[index] != null) {
+                                results[start + i] = received[index];
+                                received[index] = null;
+                            }
+                        }
+                    } finally {
+                        for (ParcelFileDescriptor unclaimed : received)
+                            if (unclaimed != null)
+                                try { unclaimed.close(); } catch (IOException ignored) {}
+                    }
+                } finally {
+                    discard(response);
+                }
+            }
 
-        intake.offer(FdReq.PLACEHOLDER);
-    }
+            success = true;
 
-    private void startServer() throws IOException {
-        serverThread = new Server();
-        serverThread.start();
+            return results;
+        } finally {
+            if (!success)
+                for (ParcelFileDescriptor result : results)
+                    if (result != null)
+                        try { result.close(); } catch (IOException ignored) {}
+        }
     }
 
     /**
-     * Return file descriptor for supplied file, open for read-write access with default flags
-     * (which are {@link #O_RDWR} and {@link #O_CREAT}) and the same creation mode as used by
-     * {@link ParcelFileDescriptor#open(File, int)}.
+     * Read up to {@code length} first bytes of each file with superuser privileges, together with it's device,
+     * inode, size and modification time. The bytes are sent back inline with the helper response, so no
+     * descriptors are transferred, and each round-trip covers as many files, as fit into a single response
+     * (16 files of 1024 bytes or 7 files of 4096 bytes). This is meant for sniffing file types of many files at once.
+     *
+     * <p>
+     *
+     * Only regular files are read, other kinds of files are reported as unreadable.
      *
      * <p>
      *
      * <b>Do not call this method from the main thread!</b>
      *
-     * @throws IOException recoverable error, such as when file was not found
+     * @param files the files to read, not necessarily accessible to your UID
+     * @param length number of bytes to read from the start of each file, at most {@link #MAX_HEADER_SIZE}
+     *
+     * @return headers in the same order as files, with null in place of each file, that could not be read
+     *
+     * @throws IOException recoverable error, such as when the response could not be parsed
      * @throws FactoryBrokenException irrecoverable error, that renders this factory instance unusable
      */
-    public @NonNull ParcelFileDescriptor open(File file) throws IOException, FactoryBrokenException {
-        return open(file, O_RDWR | O_CREAT);
+    public @NonNull FileHeader[] readHeaders(List<File> files, int length) throws IOException, FactoryBrokenException {
+        if (length <= 0 || length > MAX_HEADER_SIZE)
+            throw new IllegalArgumentException("Invalid header length " + length);
+
+        final int perRequest = Math.min(MAX_BATCH_OPEN, (MAX_RESPONSE_SIZE - 8) / (length * 2 + HEADER_RECORD_OVERHEAD));
+
+        final FileHeader[] results = new FileHeader[files.size()];
+
+        for (int start = 0; start < results.length; start += perRequest) {
+            final int count = Math.min(perRequest, results.length - start);
+
+            final Object[] args = new Object[count + 2];
+            args[0] = length;
+            args[1] = count;
+            for (int i = 0; i < count; i++)
+                args[i + 2] = files.get(start + i).getPath();
+
+            final String message = sendRequest(new FdReq(OP_READ_HEADERS, args), "Failed to read files: ").message;
+
+            // "OK", followed by a record for each file
+            FileHeader.parse(message, 2, results, start, count);
+        }
+
+        return results;
+    }
+
+    // Wrap received descriptors without duplicating them, if possible. Wrapped ones are removed from the array
+    private static ParcelFileDescriptor[] adoptAll(FileDescriptor[] fds) throws IOException {
+        final int[] raw = new int[fds.length];
+        Arrays.fill(raw, -1);
+
+        try {
+            for (int i = 0; i < fds.length; i++) {
+                if (fds[i] != null) {
+                    raw[i] = FdCompat.detach(fds[i]);
+                    fds[i] = null;
+                }
+            }
+        } catch (IOException cantDetach) {
+            // the remaining ones are duplicated below
+        }
+
+        final ParcelFileDescriptor[] results = FdCompat.adoptAll(raw);
+
+        boolean success = false;
+        try {
+            for (int i = 0; i < fds.length; i++) {
+                if (fds[i] != null) {
+                    results[i] = FdCompat.adopt(fds[i]);
+                    fds[i] = null;
+                }
+            }
+
+            success = true;
+
+            return results;
+        } finally {
+            if (!success)
+                for (ParcelFileDescriptor result : results)
+                    if (result != null)
+                        try { result.close(); } catch (IOException ignored) {}
+        }
     }
 
     /**
-     * Return file descriptor for supplied file, open for specified access with supplied flags
-     * and the same creation mode as used by {@link ParcelFileDescriptor#open(File, int)}.
+     * Start a command with superuser privileges. Unlike running {@code su -c} for each command, this reuses
+     * the helper, that has already been granted privileges, so no new "su" process (and no permission
+     * check) is involved. The command is started directly, not via shell.
      *
      * <p>
      *
      * <b>Do not call this method from the main thread!</b>
      *
-     * @param file the {@link File} object, with path to the target file, not necessarily accessible to your UID
-     * @param mode either {@link #O_RDONLY}, {@link #O_WRONLY} or {@link #O_RDWR}, or-ed with other {@link OpenFlag} constants
+     * @param command the executable (looked up in {@code PATH}, if it does not contain slashes), followed by arguments
+     * @param env environment of the process, or null to inherit one of the helper
+     * @param cwd working directory of the process, or null to inherit one of the helper
      *
-     * @throws IOException recoverable error, such as when file was not found
+     * @throws IOException recoverable error, such as when the executable was not found; also when path policy
+     * is installed, because commands can access any file
      * @throws FactoryBrokenException irrecoverable error, that renders this factory instance unusable
      */
-    public @NonNull ParcelFileDescriptor open(File file, @OpenFlag int mode) throws IOException, FactoryBrokenException {
-        return FdCompat.adopt(openFileDescriptor(file, mode));
+    public @NonNull SpawnedProcess spawn(List<String> command, @Nullable Map<String, String> env, @Nullable File cwd)
+            throws IOException, FactoryBrokenException {
+        if (command.isEmpty())
+            throw new IllegalArgumentException("Empty command");
+
+        final ArrayList<Object> args = new ArrayList<>(command.size() + (env == null ? 0 : env.size()) + 3);
+        args.add(command.size());
+        args.addAll(command);
+        if (env == null) {
+            args.add(-1);
+        } else {
+            args.add(env.size());
+            for (Map.Entry<String, String> variable : env.entrySet())
+                args.add(variable.getKey() + '=' + variable.getValue());
+        }
+        args.add(cwd == null ? "" : cwd.getPath());
+
+        acquire(5);
+
+        final FdResp response = sendRequest(new FdReq(OP_SPAWN, args.toArray()), "Failed to spawn " + command.get(0) + ": ");
+
+        final ParcelFileDescriptor[] fds = adoptAll(response.fds);
+
+        // "READY <pid>", followed by stdin, stdout, stderr, status and, optionally, pidfd
+        if (fds.length < 4) {
+            for (ParcelFileDescriptor fd : fds)
+                fd.close();
+
+            throw new IOException("Failed to spawn " + command.get(0) + ": incomplete response from helper");
+        }
+
+        return new SpawnedProcess(this, Integer.parseInt(response.message.substring(6).trim()), fds);
+    }
+
+    void signal(int pid, int signal) throws IOException, FactoryBrokenException {
+        sendRequest(new FdReq(OP_KILL, pid, signal), "Failed to signal process " + pid + ": ");
+    }
+
+    // close descriptors of abandoned (or partially consumed) response without blocking the caller, if possible
+    private void discard(FdResp response) {
+        if (closer == null) {
+            response.closeDescriptors();
+            return;
+        }
+
+        for (FileDescriptor descriptor : response.fds)
+            if (descriptor != null)
+                closer.defer(descriptor);
+    }
+
+    // prefetching is pointless, when there is no room for prefetched descriptors
+    private ParcelFileDescriptor[] prefetch(List<File> files, int mode) throws IOException, FactoryBrokenException {
+        return budget != null && budget.isUnderPressure(files.size())
+                ? new ParcelFileDescriptor[files.size()]
+                : openMany(files, mode);
+    }
+
+    private void acquire(int descriptors) throws IOException {
+        if (budget != null)
+            budget.acquire(descriptors);
+    }
+
+    // handed out descriptors are wrapped, when leak tracker or budget needs to know, that they are closed
+    private ParcelFileDescriptor tracked(ParcelFileDescriptor fd) {
+        if (leakTracker == null && budget == null)
+            return fd;
+
+        final CloseAware.Descriptor owner = new CloseAware.Descriptor(fd);
+
+        owner.onClose = onClose(owner, fd.getFileDescriptor());
+
+        return owner;
+    }
+
+    private Runnable onClose(Object owner, FileDescriptor fd) {
+        final Runnable tracking = leakTracker == null ? null : leakTracker.track(owner, fd);
+
+        return () -> {
+            if (tracking != null)
+                tracking.run();
+
+            if (budget != null)
+                budget.release();
+        };
     }
 
     /**
-     * Shorthand for creating a {@link RandomAccessFile} from {@link FileDescriptor}, when all you need is
-     * a simple read/write functionality.
+     * Return descriptors, handed out by this factory and not closed yet, along with call sites, that leak most
+     * of them, and usage of process descriptor table. Both must be enabled by {@link FactoryOptions#trackLeaks}
+     * and {@link FactoryOptions#descriptorBudget} respectively.
+     *
+     * @param limit maximum number of descriptors and call sites to report
      */
-    public @NonNull RandomAccessFile openRandomAccessFile(File file) throws IOException, FactoryBrokenException {
-        return FdCompat.convert(openFileDescriptor(file, O_RDWR | O_CREAT));
+    public @NonNull FactoryStats getStats(int limit) {
+        final FactoryStats stats = leakTracker == null ? new FactoryStats() : leakTracker.snapshot(limit);
+
+        if (budget != null)
+            budget.report(stats);
+
+        return stats;
     }
 
     @NonNull FileDescriptor openFileDescriptor(File file, @OpenFlag int mode) throws IOException, FactoryBrokenException {
-        if (closedStatus.get())
-            throw new FactoryBrokenException("Already closed");
+        acquire(1);
+
+        return sendRequest(FdReq.open(file.getPath(), mode), "Failed to open file: ").fd;
+    }
+
+    private @NonNull FdResp sendRequest(FdReq request, String failure) throws IOException, FactoryBrokenException {
+        if (recorder == null)
+            return exchange(request, failure);
+
+        final long start = System.nanoTime();
+
+        int result = TraceRecorder.RESULT_BROKEN;
+        try {
+            final FdResp response = exchange(request, failure);
+
+            result = TraceRecorder.RESULT_OK;
 
-        final String path = file.getPath();
+            return response;
+        } catch (PolicyDeniedException e) {
+            result = PathPolicy.DENIED;
+
+            throw e;
+        } catch (IOException e) {
+            result = TraceRecorder.RESULT_ERROR;
 
-        final FdReq request = new FdReq(path, mode);
+            throw e;
+        } finally {
+            recorder.record(start, request.op, request.args, result);
+        }
+    }
 
+    private @NonNull FdResp exchange(FdReq request, String failure) throws IOException, FactoryBrokenException {
+        if (closedStatus.get())
+            throw new FactoryBrokenException("Already closed");
 
         FdResp response;
         try {
-            if (intake.offer(request, HELPER_TIMEOUT, TimeUnit.MILLISECONDS)
+            if (reactor != null) {
+                if (connected.await(HELPER_TIMEOUT, TimeUnit.MILLISECONDS)
+                        && connection != null
+                        && (response = connection.roundTrip(request)) != null)
+                    return checkResponse(response, failure);
+            } else if (intake.offer(request, HELPER_TIMEOUT, TimeUnit.MILLISECONDS)
                     && (response = responses.poll(IO_TIMEOUT, TimeUnit.MILLISECONDS)) != null
                     && response.request == request) {
-                if (response.fd != null)
-                    return response.fd;
-                else
-                    throw new IOException("Failed to open file: " + response.message);
+                return checkResponse(response, failure);
             }
         } catch (InterruptedException e) {
             Thread.currentThread().interrupt();
@@ -300,6 +1140,16 @@ public final class FileDescriptorFactory implements Closeable {
         throw new FactoryBrokenException("Failed to retrieve response from helper");
     }
 
+    private static FdResp checkResponse(FdResp response, String failure) throws IOException {
+        // successful responses without descriptor start with "OK"
+        if (response.fd != null || response.message.startsWith("OK"))
+            return response;
+        else if (response.message.endsWith(POLICY_DENIAL))
+            throw new PolicyDeniedException(failure + response.message);
+        else
+            throw new IOException(failure + response.message);
+    }
+
     /**
      * Set the flag, indicating the internally used thread and helper process to stop and making further attempts
      * to use this instance fail. This method can be used any number of times, even if the instance is already closed.
@@ -307,9 +1157,26 @@ public final class FileDescriptorFactory implements Closeable {
      */
     @Override
     public void close() {
+        if (recorder != null)
+            recorder.close();
+
+        if (prefetcher != null)
+            prefetcher.close();
+
+        final Connection handedOff = connection;
+        if (handedOff != null && handedOff.close()) {
+            FdCompat.set(closedStatus);
+
+            shut(clientProcess);
+            shut(serverSocket);
+
+            return;
+        }
+
         if (!closedStatus.compareAndSet(false, true)) {
             shut(clientProcess);
             shut(serverSocket);
+            shut(daemonSocket);
 
             if (serverThread != null) {
                 serverThread.interrupt();
@@ -327,7 +1194,13 @@ public final class FileDescriptorFactory implements Closeable {
     }
 
     private final class Server extends Thread {
-        private final ByteBuffer statusMsg = ByteBuffer.allocate(512).order(ByteOrder.nativeOrder());
+        private final ByteBuffer statusMsg = ByteBuffer.allocate(MAX_RESPONSE_SIZE).order(ByteOrder.nativeOrder());
+
+        // descriptors, received by FdNative
+        private final int[] receivedFds = new int[MAX_BATCH_OPEN];
+
+        // descriptors, received along with current response
+        private final ArrayList<FileDescriptor> receivedDescriptors = new ArrayList<>(MAX_BATCH_OPEN);
 
         int lastClientReadCount;
 
@@ -337,34 +1210,79 @@ public final class FileDescriptorFactory implements Closeable {
 
         @Override
         public void run() {
+            if (daemonSocket != null) {
+                runConnected();
+
+                return;
+            }
+
             try (ReadableByteChannel clientOutput = Channels.newChannel(clientProcess.getInputStream());
                  Closeable c = new CloseableSocket(serverSocket))
             {
                 try {
                     initializeAndHandleRequests(readHelperPid(clientOutput));
                 } finally {
+                    // once handed off to reactor, the output is abandoned: the helper does not write anything
+                    // after startup, and the process is destroyed by close()
+                    if (connection == null)
+                        drainOutput(clientOutput);
+                }
+            } catch (Exception e) {
+                logException("Server thread forced to quit by error", e);
+            } finally {
+                if (connection == null) {
+                    FdCompat.set(closedStatus);
+
+                    connected.countDown();
+
                     try {
-                        do {
-                            lastClientReadCount = clientOutput.read(statusMsg);
+                        setName("BUG: Waiting for su process, which won't quit");
 
-                            if (statusMsg.position() == statusMsg.limit())
-                                statusMsg.clear();
-                        }
-                        while (lastClientReadCount != -1);
+                        clientProcess.waitFor();
+                    } catch (InterruptedException e) {
+                        Thread.currentThread().interrupt();
                     }
-                    catch (IOException ignored) {}
                 }
+            }
+        }
+
+        private void drainOutput(ReadableByteChannel clientOutput) {
+            try {
+                do {
+                    lastClientReadCount = clientOutput.read(statusMsg);
+
+                    if (statusMsg.position() == statusMsg.limit())
+                        statusMsg.clear();
+                }
+                while (lastClientReadCount != -1);
+            }
+            catch (IOException ignored) {}
+        }
+
+        private void runConnected() {
+            try {
+                final InputStream status = daemonSocket.getInputStream();
+
+                if (intake.take() == FdReq.STOP)
+                    return;
+
+                installPolicy(daemonSocket, status);
+
+                if (reactor != null) {
+                    handOff(daemonSocket, status, null);
+                    return;
+                }
+
+                processRequestsUntilStopped(daemonSocket, status);
             } catch (Exception e) {
                 logException("Server thread forced to quit by error", e);
             } finally {
-                FdCompat.set(closedStatus);
+                if (connection == null) {
+                    FdCompat.set(closedStatus);
 
-                try {
-                    setName("BUG: Waiting for su process, which won't quit");
+                    shut(daemonSocket);
 
-                    clientProcess.waitFor();
-                } catch (InterruptedException e) {
-                    Thread.currentThread().interrupt();
+                    connected.countDown();
                 }
             }
         }
@@ -386,58 +1304,105 @@ public final class FileDescriptorFactory implements Closeable {
 
         private void initializeAndHandleRequests(int helperPid) throws Exception {
             while (!isInterrupted()) {
-                try (LocalSocket localSocket = serverSocket.accept())
-                {
+                final LocalSocket localSocket = serverSocket.accept();
+
+                Writer clientTty = null;
+                boolean handedOff = false;
+                try {
                     final int socketPid = localSocket.getPeerCredentials().getPid();
                     if (socketPid != helperPid)
                         continue;
 
-                    try (ReadableByteChannel status = Channels.newChannel(localSocket.getInputStream())) {
-                        final String socketMsg = readMessage(status);
-                        final FileDescriptor ptmxFd = getFd(localSocket);
+                    final InputStream status = localSocket.getInputStream();
 
-                        if (ptmxFd == null)
-                            throw new Exception("Can't get client tty" + (socketMsg.length() == 0 ? "" : " : " + socketMsg));
+                    final FdResp greeting = receiveResponse(null, status, localSocket);
+                    final String socketMsg = greeting.message;
+                    final FileDescriptor ptmxFd = greeting.fds.length == 1 ? greeting.fd : null;
 
-                        logTrace(Log.DEBUG, "Response to tty request: '" + socketMsg + "', descriptor " + ptmxFd);
+                    if (ptmxFd == null)
+                        throw new Exception("Can't get client tty" + (socketMsg.length() == 0 ? "" : " : " + socketMsg));
 
-                        try (Writer clientTty = Channels.newWriter(new FileOutputStream(ptmxFd).getChannel(), "UTF-8")) {
-                            // Indicate to the helper that it can close it's copy of it's controlling tty.
-                            // When our end is closed the kernel tty driver will send SIGHUP to the helper,
-                            // cleanly killing it's root process for us
-                            clientTty.append("GO\n");
-                            clientTty.flush();
+                    logTrace(Log.DEBUG, "Response to tty request: '" + socketMsg + "', descriptor " + ptmxFd);
 
-                            // as little exercise in preparation to real deal, try to protect our helper from OOM killer
-                            final String oomFile = "/proc/" + helperPid + "/oom_score_adj";
+                    clientTty = Channels.newWriter(new FileOutputStream(ptmxFd).getChannel(), "UTF-8");
 
-                            final FdResp oomFileTestResp = sendFdRequest(new FdReq(oomFile, O_RDWR), clientTty, status, localSocket);
+                    // Indicate to the helper that it can close it's copy of it's controlling tty.
+                    // When our end is closed the kernel tty driver will send SIGHUP to the helper,
+                    // cleanly killing it's root process for us
+                    clientTty.append("GO\n");
+                    clientTty.flush();
 
-                            logTrace(Log.DEBUG, "Response to " + oomFile + " request: " + oomFileTestResp);
+                    // as little exercise in preparation to real deal, try to protect our helper from OOM killer
+                    final String oomFile = "/proc/" + helperPid + "/oom_score_adj";
 
-                            if (oomFileTestResp.fd != null) {
-                                try (OutputStreamWriter oow = new OutputStreamWriter(new FileOutputStream(oomFileTestResp.fd))) {
-                                    oow.append("-1000");
+                    final FdResp oomFileTestResp = sendFdRequest(FdReq.open(oomFile, O_RDWR), status, localSocket);
 
-                                    logTrace(Log.DEBUG, "Successfully adjusted helper's OOM score to -1000");
-                                } catch (IOException ok) {
-                                    logException("Write to " + oomFile + " failed", ok);
-                                }
-                            }
-
-                            if (intake.take() == FdReq.STOP)
-                                return;
+                    logTrace(Log.DEBUG, "Response to " + oomFile + " request: " + oomFileTestResp);
 
-                            processRequestsUntilStopped(localSocket, status, clientTty);
+                    if (oomFileTestResp.fd != null) {
+                        try (OutputStreamWriter oow = new OutputStreamWriter(new FileOutputStream(oomFileTestResp.fd))) {
+                            oow.append("-1000");
 
-                            break;
+                            logTrace(Log.DEBUG, "Successfully adjusted helper's OOM score to -1000");
+                        } catch (IOException ok) {
+                            logException("Write to " + oomFile + " failed", ok);
                         }
                     }
+
+                    if (intake.take() == FdReq.STOP)
+                        return;
+
+                    installPolicy(localSocket, status);
+
+                    if (reactor != null) {
+                        handOff(localSocket, status, clientTty);
+
+                        handedOff = true;
+
+                        return;
+                    }
+
+                    processRequestsUntilStopped(localSocket, status);
+
+                    break;
+                } finally {
+                    if (!handedOff) {
+                        if (clientTty != null)
+                            try { clientTty.close(); } catch (IOException ignored) {}
+
+                        shut(localSocket);
+                    }
                 }
             }
         }
 
-        private void processRequestsUntilStopped(LocalSocket fdrecv, ReadableByteChannel status, Writer control) throws IOException, InterruptedException {
+        // The connection is served by shared reactor from now on, the thread quits
+        private void handOff(LocalSocket socket, InputStream status, @Nullable Closeable tty) throws IOException {
+            final Connection handedOff = new Connection(this, socket, status, tty);
+
+            connection = handedOff;
+
+            reactor.register(handedOff);
+
+            connected.countDown();
+
+            // closed during initialization
+            if (closedStatus.get())
+                FileDescriptorFactory.this.close();
+        }
+
+        // Must be done before serving any requests: if the policy can not be installed, the factory is unusable
+        private void installPolicy(LocalSocket fdrecv, InputStream status) throws IOException {
+            if (policyRequest == null)
+                return;
+
+            final FdResp response = sendFdRequest(policyRequest, status, fdrecv);
+
+            if (!response.message.startsWith("OK"))
+                throw new IOException("Failed to install path policy: " + response.message);
+        }
+
+        private void processRequestsUntilStopped(LocalSocket fdrecv, InputStream status) throws IOException, InterruptedException {
             FdReq fileOps;
 
             while ((fileOps = intake.take()) != FdReq.STOP) {
@@ -445,39 +1410,115 @@ public final class FileDescriptorFactory implements Closeable {
 
                 try {
                     try {
-                        response = sendFdRequest(fileOps, control, status, fdrecv);
+                        response = sendFdRequest(fileOps, status, fdrecv);
 
                         if (!responses.offer(response, IO_TIMEOUT, TimeUnit.MILLISECONDS))
-                            FdCompat.closeDescriptor(response.fd);
+                            discard(response);
                     } catch (IOException ioe) {
-                        responses.offer(new FdResp(fileOps, ioe.getMessage(), null), IO_TIMEOUT, TimeUnit.MILLISECONDS);
+                        responses.offer(new FdResp(fileOps, ioe.getMessage(), NO_FDS), IO_TIMEOUT, TimeUnit.MILLISECONDS);
 
                         throw ioe;
                     }
                 } catch (InterruptedException ie) {
                     if (response != null)
-                        FdCompat.closeDescriptor(response.fd);
+                        discard(response);
 
                     throw ie;
                 }
             }
         }
 
-        private FdResp sendFdRequest(FdReq fileOps, Writer req, ReadableByteChannel resp, LocalSocket ls) throws IOException {
-            req.append(String.valueOf(fileOps.fileName.getBytes().length)).flush();
-            req.append(fileOps.fileName).append('\n').append(String.valueOf(fileOps.mode)).append('\n').flush();
+        // Requests are sent over the socket rather than the tty, bypassing line discipline (and it's limit
+        // on line length). The request is written at once, so that the attachment is sent exactly once.
+        private FdResp sendFdRequest(FdReq fileOps, InputStream resp, LocalSocket ls) throws IOException {
+            writeRequest(fileOps, ls);
+
+            return checkDescriptors(receiveResponse(fileOps, resp, ls));
+        }
 
-            String responseStr = readMessage(resp);
+        void writeRequest(FdReq fileOps, LocalSocket ls) throws IOException {
+            final byte[] request = fileOps.toBytes();
 
-            final FileDescriptor fd = getFd(ls);
+            if (fileOps.attachment != null) {
+                ls.setFileDescriptorsForSend(new FileDescriptor[] { fileOps.attachment });
+                try {
+                    ls.getOutputStream().write(request);
+                } finally {
+                    ls.setFileDescriptorsForSend(null);
+                }
+            } else {
+                ls.getOutputStream().write(request);
+            }
+        }
 
-            if (fd == null && "READY".equals(responseStr)) { // unlikely, but..
-                responseStr = "Received no file descriptor from helper";
+        FdResp checkDescriptors(FdResp response) {
+            if (response.fds.length == 0 && response.message.startsWith("READY")) { // unlikely, but..
+                return new FdResp(response.request, "Received no file descriptor from helper", NO_FDS);
             }
 
-            return new FdResp(fileOps, responseStr, fd);
+            return response;
+        }
+
+        // Each message from helper is prefixed with it's length as 4-byte big-endian integer, because a single
+        // read from stream socket may return a part of message or several of them. Descriptors arrive with
+        // the length prefix.
+        private FdResp receiveResponse(FdReq fileOps, InputStream resp, LocalSocket ls) throws IOException {
+            final byte[] buffer = statusMsg.array();
+
+            receivedDescriptors.clear();
+
+            try {
+                receiveFully(resp, ls, buffer, 4);
+
+                final int length = (buffer[0] & 0xff) << 24 | (buffer[1] & 0xff) << 16 | (buffer[2] & 0xff) << 8 | buffer[3] & 0xff;
+
+                if (length < 0 || length > buffer.length)
+                    throw new IOException("Invalid length of helper response: " + length);
+
+                receiveFully(resp, ls, buffer, length);
+
+                final FileDescriptor[] fds = receivedDescriptors.isEmpty() ? NO_FDS
+                        : receivedDescriptors.toArray(new FileDescriptor[receivedDescriptors.size()]);
+
+                return new FdResp(fileOps, new String(buffer, 0, length, "UTF-8"), fds);
+            } catch (IOException ioe) {
+                for (FileDescriptor fd : receivedDescriptors)
+                    FdCompat.closeDescriptor(fd);
+
+                throw ioe;
+            }
         }
 
+        private void receiveFully(InputStream resp, LocalSocket ls, byte[] buffer, int count) throws IOException {
+            int done = 0;
+
+            while (done < count) {
+                final int received;
+
+                if (FdNative.isAvailable()) {
+                    received = FdNative.receive(ls.getFileDescriptor(), buffer, done, count - done, receivedFds);
+
+                    if (received < 0)
+                        throw new IOException("Failed to receive response, errno " + -received);
+
+                    for (int i = 0; i < receivedFds.length && receivedFds[i] != -1; i++)
+                        receivedDescriptors.add(FdNative.wrap(receivedFds[i]));
+                } else {
+                    received = resp.read(buffer, done, count - done);
+
+                    final FileDescriptor[] fds = ls.getAncillaryFileDescriptors();
+                    if (fds != null)
+                        for (FileDescriptor fd : fds)
+                            if (fd != null)
+                                receivedDescriptors.add(fd);
+                }
+
+                if (received <= 0)
+                    throw new EOFException("Helper closed the connection");
+
+                done += received;
+            }
+        }
 
         private String readMessage(ReadableByteChannel channel) throws IOException {
             statusMsg.clear();
@@ -486,12 +1527,6 @@ public final class FileDescriptorFactory implements Closeable {
 
             return new String(statusMsg.array(), 0, statusMsg.position());
         }
-
-        private FileDescriptor getFd(LocalSocket ls) throws IOException {
-            final FileDescriptor[] fds = ls.getAncillaryFileDescriptors();
-
-            return fds != null && fds.length == 1 && fds[0] != null ? fds[0] : null;
-        }
     }
 
     private static void logTrace(int proprity, String message, Object... args) {
@@ -527,6 +1562,15 @@ public final class FileDescriptorFactory implements Closeable {
         }
     }
 
+    private static void shut(LocalSocket sock) {
+        try {
+            if (sock != null)
+                sock.close();
+        } catch (IOException e) {
+            // just as planned
+        }
+    }
+
     private static void shut(Process proc) {
         try {
             if (proc != null) {
@@ -540,38 +1584,190 @@ public final class FileDescriptorFactory implements Closeable {
     }
 
     private static final class FdReq {
-        static FdReq STOP = new FdReq(null, 0);
+        static FdReq STOP = new FdReq('\0');
+
+        static FdReq PLACEHOLDER = new FdReq('\0');
+
+        final char op;
+        final Object[] args;
+
+        FileDescriptor attachment;
+
+        public FdReq(char op, Object... args) {
+            this.op = op;
+            this.args = args;
+        }
+
+        FdReq attach(FileDescriptor fd) {
+            this.attachment = fd;
+            return this;
+        }
+
+        static FdReq open(String fileName, int mode) {
+            return new FdReq(OP_OPEN, fileName, mode);
+        }
+
+        // The opcode is followed by space-separated arguments: numbers are written in decimal, strings are
+        // prefixed with their byte length and colon, so that the helper does not have to look for delimiters
+        byte[] toBytes() throws IOException {
+            final ByteArrayOutputStream buffer = new ByteArrayOutputStream(64);
 
-        static FdReq PLACEHOLDER = new FdReq(null, 0);
+            buffer.write(op);
 
-        final String fileName;
-        final int mode;
+            for (Object arg : args) {
+                buffer.write(' ');
 
-        public FdReq(String fileName, int mode) {
-            this.fileName = fileName;
-            this.mode = mode;
+                if (arg instanceof String) {
+                    final byte[] str = ((String) arg).getBytes("UTF-8");
+
+                    buffer.write(String.valueOf(str.length).getBytes("UTF-8"));
+                    buffer.write(':');
+                    buffer.write(str);
+                } else {
+                    buffer.write(String.valueOf(arg).getBytes("UTF-8"));
+                }
+            }
+
+            buffer.write('\n');
+
+            return buffer.toByteArray();
         }
 
         @Override
         public String toString() {
-            return fileName + ',' + mode;
+            return op + Arrays.toString(args);
         }
     }
 
+    private static final FileDescriptor[] NO_FDS = new FileDescriptor[0];
+
     private static final class FdResp {
         final FdReq request;
         final String message;
         final FileDescriptor fd;
+        final FileDescriptor[] fds;
 
-        public FdResp(FdReq request, String message, FileDescriptor fd) {
+        public FdResp(FdReq request, String message, FileDescriptor[] fds) {
             this.request = request;
             this.message = message;
-            this.fd = fd;
+            this.fds = fds;
+            this.fd = fds.length == 0 ? null : fds[0];
+        }
+
+        void closeDescriptors() {
+            for (FileDescriptor descriptor : fds)
+                FdCompat.closeDescriptor(descriptor);
         }
 
         @Override
         public String toString() {
-            return "Request: " + request + ". Helper response: '" + message + "', descriptor: " + fd;
+            return "Request: " + request + ". Helper response: '" + message + "', descriptors: " + Arrays.toString(fds);
+        }
+    }
+
+    // Connection to the helper, served by SharedReactor. Callers write requests and read responses themselves,
+    // one at a time; the reactor only tells them, that the socket has become readable, and notices the helper
+    // going away between requests. No socket reads happen on the reactor thread, so a slow helper stalls
+    // nobody but it's own callers.
+    private final class Connection implements SharedReactor.Channel {
+        private final Server server;
+        private final LocalSocket socket;
+        private final InputStream status;
+        private final Closeable tty;
+
+        // a single slot is enough, as requests are sent one at a time
+        private final ArrayBlockingQueue<Boolean> readable = new ArrayBlockingQueue<>(1);
+
+        private volatile FdReq pending;
+
+        private volatile boolean closed;
+
+        Connection(Server server, LocalSocket socket, InputStream status, @Nullable Closeable tty) throws IOException {
+            this.server = server;
+            this.socket = socket;
+            this.status = status;
+            this.tty = tty;
+
+            // a response, that stops midway, must not block the caller forever
+            socket.setSoTimeout((int) IO_TIMEOUT);
+        }
+
+        /**
+         * @return the response or null if it was not received in time, in which case the factory is closed: a late
+         * response would otherwise be taken for the response to next request
+         */
+        synchronized @Nullable FdResp roundTrip(FdReq request) throws InterruptedException {
+            if (closed)
+                return null;
+
+            readable.clear();
+
+            pending = request;
+
+            boolean received = false;
+            try {
+                server.writeRequest(request, socket);
+
+                if (readable.poll(IO_TIMEOUT, TimeUnit.MILLISECONDS) == null)
+                    return null;
+
+                final FdResp response = server.checkDescriptors(server.receiveResponse(request, status, socket));
+
+                received = true;
+
+                return response;
+            } catch (IOException ioe) {
+                logException("Connection to helper failed", ioe);
+
+                return null;
+            } finally {
+                pending = null;
+
+                if (received)
+                    reactor.arm(this);
+                else
+                    FileDescriptorFactory.this.close();
+            }
+        }
+
+        @Override
+        public FileDescriptor getDescriptor() {
+            return socket.getFileDescriptor();
+        }
+
+        // called on reactor thread
+        @Override
+        public void onReadable() {
+            if (closed)
+                return;
+
+            if (pending == null || !readable.offer(Boolean.TRUE)) {
+                // nothing is expected between requests, the helper either exited or is misbehaving
+                logTrace(Log.ERROR, "Unsolicited data or end of stream from helper");
+
+                FileDescriptorFactory.this.close();
+            }
+        }
+
+        /**
+         * @return true if the connection was open
+         */
+        boolean close() {
+            synchronized (readable) {
+                if (closed)
+                    return false;
+
+                closed = true;
+            }
+
+            reactor.unregister(this);
+
+            if (tty != null)
+                try { tty.close(); } catch (IOException ignored) {}
+
+            shut(socket);
+
+            return true;
         }
     }
 
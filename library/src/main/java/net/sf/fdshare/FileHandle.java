@@ -0,0 +1,130 @@
+/*
+ * Copyright © 2015 Alexander Rvachev
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+package net.sf.fdshare;
+
+import android.support.annotation.NonNull;
+
+import java.io.ByteArrayInputStream;
+import java.io.ByteArrayOutputStream;
+import java.io.DataInputStream;
+import java.io.DataOutputStream;
+import java.io.IOException;
+import java.util.Arrays;
+
+/**
+ * An opaque kernel file handle, returned by {@link FileDescriptorFactory#getHandle}. The handle identifies a file
+ * independently of it's path, so it stays valid after the file is renamed or moved within the same file system.
+ * <p>
+ * Handles can be persisted via {@link #toByteArray()}. Whether they survive reboot depends on file system; most
+ * disk-based ones (ext4, f2fs) produce persistent handles, but some (tmpfs, FUSE) do not. The mount point of
+ * file system is recorded within the handle, so the file system must be mounted at the same place to reopen it.
+ */
+public final class FileHandle {
+    private static final int FORMAT_VERSION = 1;
+
+    final int type;
+    final byte[] handle;
+    final String mountPoint;
+
+    FileHandle(int type, byte[] handle, String mountPoint) {
+        this.type = type;
+        this.handle = handle;
+        this.mountPoint = mountPoint;
+    }
+
+    /**
+     * Serialize the handle to compact binary form, suitable for storage.
+     */
+    public @NonNull byte[] toByteArray() {
+        final ByteArrayOutputStream bytes = new ByteArrayOutputStream(handle.length + mountPoint.length() + 8);
+
+        try (DataOutputStream out = new DataOutputStream(bytes)) {
+            out.writeByte(FORMAT_VERSION);
+            out.writeInt(type);
+            out.writeByte(handle.length);
+            out.write(handle);
+            out.writeUTF(mountPoint);
+        } catch (IOException e) {
+            throw new AssertionError(e);
+        }
+
+        return bytes.toByteArray();
+    }
+
+    /**
+     * Restore the handle, previously serialized with {@link #toByteArray()}.
+     *
+     * @throws IOException if the data is not a serialized handle
+     */
+    public static @NonNull FileHandle fromByteArray(byte[] serialized) throws IOException {
+        try (DataInputStream in = new DataInputStream(new ByteArrayInputStream(serialized))) {
+            if (in.readByte() != FORMAT_VERSION)
+                throw new IOException("Unknown handle format");
+
+            final int type = in.readInt();
+            final byte[] handle = new byte[in.readUnsignedByte()];
+            in.readFully(handle);
+
+            return new FileHandle(type, handle, in.readUTF());
+        }
+    }
+
+    String toHex() {
+        final char[] digits = "0123456789abcdef".toCharArray();
+
+        final char[] hex = new char[handle.length * 2];
+        for (int i = 0; i < handle.length; i++) {
+            hex[i * 2] = digits[(handle[i] >> 4) & 0xf];
+            hex[i * 2 + 1] = digits[handle[i] & 0xf];
+        }
+
+        return new String(hex);
+    }
+
+    static FileHandle parse(String response) throws IOException {
+        // "OK <handle type> <hex handle bytes> <mount point>"
+        final String[] parts = response.split(" ", 4);
+
+        if (parts.length != 4 || parts[2].length() % 2 != 0)
+            throw new IOException("Malformed handle: " + response);
+
+        final byte[] handle = new byte[parts[2].length() / 2];
+        for (int i = 0; i < handle.length; i++)
+            handle[i] = (byte) Integer.parseInt(parts[2].substring(i * 2, i * 2 + 2), 16);
+
+        return new FileHandle(Integer.parseInt(parts[1]), handle, parts[3]);
+    }
+
+    @Override
+    public boolean equals(Object o) {
+        if (this == o) return true;
+        if (!(o instanceof FileHandle)) return false;
+
+        final FileHandle other = (FileHandle) o;
+
+        return type == other.type && Arrays.equals(handle, other.handle) && mountPoint.equals(other.mountPoint);
+    }
+
+    @Override
+    public int hashCode() {
+        return 31 * (31 * type + Arrays.hashCode(handle)) + mountPoint.hashCode();
+    }
+
+    @Override
+    public String toString() {
+        return "FileHandle " + type + ':' + toHex() + " on " + mountPoint;
+    }
+}
@@ -0,0 +1,110 @@
+/*
+ * Copyright © 2015 Alexander Rvachev
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+package net.sf.fdshare;
+
+import android.support.annotation.NonNull;
+
+import java.io.IOException;
+
+/**
+ * First bytes of a regular file together with it's identity, returned by {@link FileDescriptorFactory#readHeaders}.
+ * Both are taken from the same open descriptor, so the header belongs to the file, described by the rest of fields.
+ */
+public final class FileHeader {
+    private final long device;
+    private final long inode;
+    private final long size;
+    private final long modified;
+    private final byte[] bytes;
+
+    FileHeader(long device, long inode, long size, long modified, byte[] bytes) {
+        this.device = device;
+        this.inode = inode;
+        this.size = size;
+        this.modified = modified;
+        this.bytes = bytes;
+    }
+
+    public long getDevice() {
+        return device;
+    }
+
+    public long getInode() {
+        return inode;
+    }
+
+    /**
+     * @return size of the whole file, which may exceed length of header
+     */
+    public long getSize() {
+        return size;
+    }
+
+    /**
+     * @return time of last modification, in nanoseconds since the epoch
+     */
+    public long getModified() {
+        return modified;
+    }
+
+    /**
+     * @return bytes from the start of file, shorter than requested if the file is shorter; not a copy
+     */
+    public @NonNull byte[] getBytes() {
+        return bytes;
+    }
+
+    /**
+     * Parse records, sent by helper in response to header request, starting at given position, into results.
+     *
+     * @return position after the last parsed record
+     */
+    static int parse(String response, int position, FileHeader[] results, int start, int count) throws IOException {
+        // " <byte count>,<dev>,<inode>,<size>,<mtime>:<hex bytes>" or " -<errno>:" for each file
+        for (int i = 0; i < count; i++) {
+            final int colon = response.indexOf(':', position);
+
+            if (colon == -1 || response.charAt(position) != ' ')
+                throw new IOException("Malformed header response");
+
+            final String[] fields = response.substring(position + 1, colon).split(",");
+
+            position = colon + 1;
+
+            try {
+                final int length = Integer.parseInt(fields[0]);
+
+                if (length < 0)
+                    continue;
+
+                if (fields.length != 5 || position + length * 2 > response.length())
+                    throw new IOException("Malformed header response");
+
+                final byte[] bytes = new byte[length];
+                for (int j = 0; j < length; j++, position += 2)
+                    bytes[j] = (byte) (Character.digit(response.charAt(position), 16) << 4
+                            | Character.digit(response.charAt(position + 1), 16));
+
+                results[start + i] = new FileHeader(Long.parseLong(fields[1]), Long.parseLong(fields[2]),
+                        Long.parseLong(fields[3]), Long.parseLong(fields[4]), bytes);
+            } catch (NumberFormatException nfe) {
+                throw new IOException("Malformed header response");
+            }
+        }
+
+        return position;
+    }
+}
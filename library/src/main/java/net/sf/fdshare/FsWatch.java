@@ -0,0 +1,287 @@
+/*
+ * Copyright © 2015 Alexander Rvachev
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+package net.sf.fdshare;
+
+import android.os.FileObserver;
+import android.os.ParcelFileDescriptor;
+import android.support.annotation.NonNull;
+import android.support.annotation.Nullable;
+
+import java.io.Closeable;
+import java.io.File;
+import java.io.FileInputStream;
+import java.io.IOException;
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
+import java.util.ArrayList;
+import java.util.List;
+
+/**
+ * A notification descriptor, created by {@link FileDescriptorFactory#watch} or
+ * {@link FileDescriptorFactory#watchFileSystem}, along with decoder for events, read from it.
+ * <p>
+ * The descriptor can be polled by other means (for example, with {@code android.system.Os#poll}), but events
+ * must be read via {@link #read()}. Instances are not thread-safe.
+ */
+public final class FsWatch implements Closeable {
+    // must match WATCH_* constants in fdhelper.c
+    static final int INOTIFY = 0;
+    static final int FANOTIFY_FILESYSTEM = 1;
+    static final int FANOTIFY_MOUNT = 2;
+
+    /**
+     * The kernel event queue overflowed and some events were lost. Cached state should be discarded.
+     */
+    public static final int IN_Q_OVERFLOW = 0x00004000;
+
+    /**
+     * The watch was removed, either explicitly or because the watched file was deleted or unmounted.
+     */
+    public static final int IN_IGNORED = 0x00008000;
+
+    /**
+     * The subject of event is a directory.
+     */
+    public static final int IN_ISDIR = 0x40000000;
+
+    private static final int INOTIFY_HEADER_SIZE = 16;
+    private static final int FANOTIFY_METADATA_MIN_SIZE = 24;
+    private static final int FAN_EVENT_INFO_TYPE_FID = 1;
+    private static final int FAN_EVENT_INFO_TYPE_DFID_NAME = 2;
+
+    private final int kind;
+    private final ParcelFileDescriptor fd;
+    private final FileInputStream input;
+    private final File[] paths;
+    private final int[] watches;
+    private final ByteBuffer buffer = ByteBuffer.allocate(16 * 1024).order(ByteOrder.nativeOrder());
+
+    FsWatch(int kind, ParcelFileDescriptor fd, File[] paths, int[] watches) {
+        this.kind = kind;
+        this.fd = fd;
+        this.paths = paths;
+        this.watches = watches;
+
+        input = new ParcelFileDescriptor.AutoCloseInputStream(fd);
+    }
+
+    /**
+     * @return the notification descriptor, still owned by this instance
+     */
+    public @NonNull ParcelFileDescriptor getDescriptor() {
+        return fd;
+    }
+
+    /**
+     * @return negated {@code errno} value (or negated {@link PathPolicy#DENIED}), if adding a watch for the path
+     * at given index failed, zero otherwise
+     */
+    public int getError(int index) {
+        return watches[index] < 0 ? watches[index] : 0;
+    }
+
+    /**
+     * Block until at least one event is available and decode all events, read at once.
+     *
+     * @return decoded events, empty list if the descriptor was closed
+     */
+    public @NonNull List<Event> read() throws IOException {
+        final List<Event> events = new ArrayList<>();
+
+        buffer.clear();
+
+        final int read = input.read(buffer.array());
+
+        if (read <= 0)
+            return events;
+
+        buffer.limit(read);
+
+        if (kind == INOTIFY)
+            decodeInotify(events);
+        else
+            decodeFanotify(events);
+
+        return events;
+    }
+
+    @Override
+    public void close() throws IOException {
+        input.close();
+    }
+
+    // struct inotify_event { int wd; uint32_t mask; uint32_t cookie; uint32_t len; char name[len]; }
+    private void decodeInotify(List<Event> events) {
+        while (buffer.remaining() >= INOTIFY_HEADER_SIZE) {
+            final int start = buffer.position();
+
+            final Event event = new Event();
+            final int wd = buffer.getInt();
+            event.mask = buffer.getInt() & 0xffffffffL;
+            event.cookie = buffer.getInt();
+
+            final int nameLength = buffer.getInt();
+
+            final File watched = pathOf(wd);
+
+            if (nameLength > 0) {
+                int end = start + INOTIFY_HEADER_SIZE;
+                final int limit = end + nameLength;
+                while (end < limit && buffer.get(end) != 0)
+                    end++;
+
+                final String name = new String(buffer.array(), start + INOTIFY_HEADER_SIZE, end - start - INOTIFY_HEADER_SIZE);
+
+                event.file = watched == null ? new File(name) : new File(watched, name);
+            } else {
+                event.file = watched;
+            }
+
+            events.add(event);
+
+            buffer.position(start + INOTIFY_HEADER_SIZE + nameLength);
+        }
+    }
+
+    // struct fanotify_event_metadata { uint32_t event_len; uint8_t vers; uint8_t reserved; uint16_t metadata_len;
+    // uint64_t mask; int32_t fd; int32_t pid; } followed by information records
+    private void decodeFanotify(List<Event> events) {
+        while (buffer.remaining() >= FANOTIFY_METADATA_MIN_SIZE) {
+            final int start = buffer.position();
+
+            final int eventLength = buffer.getInt();
+            buffer.get(); // version
+            buffer.get(); // reserved
+            final int metadataLength = buffer.getShort() & 0xffff;
+
+            final Event event = new Event();
+            event.mask = buffer.getLong();
+            buffer.getInt(); // always FAN_NOFD with FAN_REPORT_FID
+            event.pid = buffer.getInt();
+
+            int info = start + metadataLength;
+            while (info + 4 <= start + eventLength) {
+                final int infoType = buffer.get(info) & 0xff;
+                final int infoLength = buffer.getShort(info + 2) & 0xffff;
+
+                if (infoLength == 0)
+                    break;
+
+                if (infoType == FAN_EVENT_INFO_TYPE_FID || infoType == FAN_EVENT_INFO_TYPE_DFID_NAME) {
+                    // header, __kernel_fsid_t, struct file_handle { uint32_t handle_bytes; int handle_type; }
+                    event.fsid = buffer.getLong(info + 4);
+
+                    final int handleBytes = buffer.getInt(info + 12);
+                    event.handleType = buffer.getInt(info + 16);
+                    event.handle = new byte[handleBytes];
+
+                    buffer.position(info + 20);
+                    buffer.get(event.handle);
+                    break;
+                }
+
+                info += infoLength;
+            }
+
+            events.add(event);
+
+            buffer.position(start + eventLength);
+        }
+    }
+
+    private @Nullable File pathOf(int wd) {
+        for (int i = 0; i < watches.length; i++) {
+            if (watches[i] == wd)
+                return paths[i];
+        }
+
+        return null;
+    }
+
+    /**
+     * A single decoded event.
+     */
+    public static final class Event {
+        long mask;
+        int cookie;
+        int pid;
+        File file;
+        long fsid;
+        int handleType;
+        byte[] handle;
+
+        Event() {
+        }
+
+        /**
+         * @return event mask; for inotify watches the bits are same as {@link FileObserver} constants,
+         * {@link #IN_Q_OVERFLOW}, {@link #IN_IGNORED} and {@link #IN_ISDIR}; for fanotify watches these are
+         * {@code FAN_*} constants from {@code linux/fanotify.h}
+         */
+        public long getMask() {
+            return mask;
+        }
+
+        /**
+         * @return cookie, connecting related {@link FileObserver#MOVED_FROM} and {@link FileObserver#MOVED_TO}
+         * events (inotify only)
+         */
+        public int getCookie() {
+            return cookie;
+        }
+
+        /**
+         * @return the file, event happened to, or null if the event is not associated with a file
+         * (inotify only)
+         */
+        public @Nullable File getFile() {
+            return file;
+        }
+
+        /**
+         * @return pid of process, that caused the event (fanotify only)
+         */
+        public int getPid() {
+            return pid;
+        }
+
+        /**
+         * @return filesystem id of the object, event happened to (fanotify only)
+         */
+        public long getFsid() {
+            return fsid;
+        }
+
+        /**
+         * @return kernel file handle of the object, event happened to (fanotify only)
+         */
+        public @Nullable byte[] getHandle() {
+            return handle;
+        }
+
+        /**
+         * @return type of {@link #getHandle() file handle} (fanotify only)
+         */
+        public int getHandleType() {
+            return handleType;
+        }
+
+        @Override
+        public String toString() {
+            return "Event " + Long.toHexString(mask) + (file == null ? "" : " on " + file);
+        }
+    }
+}
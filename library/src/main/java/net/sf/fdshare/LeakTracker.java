@@ -0,0 +1,211 @@
+/*
+ * Copyright © 2015 Alexander Rvachev
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+package net.sf.fdshare;
+
+import java.io.FileDescriptor;
+import java.lang.ref.ReferenceQueue;
+import java.lang.ref.WeakReference;
+import java.util.ArrayList;
+import java.util.Arrays;
+import java.util.Collections;
+import java.util.HashMap;
+import java.util.HashSet;
+import java.util.Iterator;
+import java.util.List;
+import java.util.Map;
+import java.util.concurrent.atomic.AtomicInteger;
+
+/**
+ * Keeps track of descriptors, handed out by factory, until they are closed. The owner of each descriptor
+ * (such as ParcelFileDescriptor) is referenced weakly, and it's collection before the descriptor is closed
+ * is counted as leak, much like platform's CloseGuard does. Unlike CloseGuard, the call site is captured
+ * only for every n-th descriptor, which keeps the cost of tracking low.
+ * <p>
+ * Owners close their descriptors in finalizers, so validity of descriptor tells nothing about a collected owner.
+ * Instead the owners ({@link CloseAware}) report calls to close(). A finalizer runs after weak references to
+ * the object are cleared, so close(), called by it, is told apart by the reference being empty.
+ */
+final class LeakTracker {
+    // number of most recent leaks, whose call sites are retained
+    private static final int MAX_LEAK_RECORDS = 256;
+
+    // closed descriptors are swept, when number of tracked ones doubles since the last sweep
+    private static final int MIN_SWEEP_SIZE = 64;
+
+    private final int sampleInterval;
+
+    private final AtomicInteger counter = new AtomicInteger();
+
+    private final ReferenceQueue<Object> collected = new ReferenceQueue<>();
+
+    // guarded by itself
+    private final HashSet<Record> outstanding = new HashSet<>();
+
+    // guarded by outstanding
+    private final ArrayList<Record> leaked = new ArrayList<>();
+
+    private int leakCount;
+
+    private int sweepSize = MIN_SWEEP_SIZE;
+
+    private static final class Record extends WeakReference<Object> {
+        final FileDescriptor fd;
+        final long created = System.currentTimeMillis();
+        final Throwable site;
+
+        volatile boolean closed;
+
+        Record(Object owner, FileDescriptor fd, Throwable site, ReferenceQueue<Object> queue) {
+            super(owner, queue);
+
+            this.fd = fd;
+            this.site = site;
+        }
+
+        void onClose() {
+            if (get() != null)
+                closed = true;
+        }
+    }
+
+    /**
+     * @param sampleRate fraction of descriptors, whose call sites are captured, between 0 and 1
+     */
+    LeakTracker(float sampleRate) {
+        sampleInterval = sampleRate <= 0 ? 0 : Math.max(1, Math.round(1 / sampleRate));
+    }
+
+    /**
+     * Start tracking the descriptor, owned by supplied object.
+     *
+     * @return callback, that must be run, when the owner is closed
+     */
+    Runnable track(Object owner, FileDescriptor fd) {
+        final int serial = counter.getAndIncrement();
+
+        final boolean sampled = sampleInterval != 0 && (serial & Integer.MAX_VALUE) % sampleInterval == 0;
+
+        final Record record = new Record(owner, fd, sampled ? new Throwable() : null, collected);
+
+        synchronized (outstanding) {
+            outstanding.add(record);
+
+            pollCollected();
+
+            if (outstanding.size() >= sweepSize)
+                sweep();
+        }
+
+        return record::onClose;
+    }
+
+    FactoryStats snapshot(int limit) {
+        synchronized (outstanding) {
+            sweep();
+
+            final ArrayList<Record> open = new ArrayList<>(outstanding);
+
+            Collections.sort(open, (a, b) -> a.created < b.created ? -1 : (a.created == b.created ? 0 : 1));
+
+            final long now = System.currentTimeMillis();
+
+            final ArrayList<FactoryStats.Descriptor> oldest = new ArrayList<>();
+            for (Record record : open.subList(0, Math.min(limit, open.size())))
+                oldest.add(new FactoryStats.Descriptor(now - record.created, trim(record.site)));
+
+            // group sampled descriptors by call site, outstanding ones are likely to be leaked as well
+            final Map<List<StackTraceElement>, FactoryStats.Site> sites = new HashMap<>();
+            for (Record record : open)
+                site(sites, record).outstanding++;
+            for (Record record : leaked)
+                site(sites, record).leaked++;
+
+            sites.remove(Collections.<StackTraceElement>emptyList());
+
+            final ArrayList<FactoryStats.Site> biggest = new ArrayList<>(sites.values());
+
+            Collections.sort(biggest, (a, b) -> (b.leaked + b.outstanding) - (a.leaked + a.outstanding));
+
+            return new FactoryStats(outstanding.size(), leakCount, oldest,
+                    biggest.subList(0, Math.min(limit, biggest.size())));
+        }
+    }
+
+    // must be called with lock held
+    private void sweep() {
+        pollCollected();
+
+        // descriptors may also be closed without involving the owner, such as via it's channel
+        for (Iterator<Record> i = outstanding.iterator(); i.hasNext(); ) {
+            final Record record = i.next();
+
+            if (record.closed || !record.fd.valid() && record.get() != null)
+                i.remove();
+        }
+
+        sweepSize = Math.max(MIN_SWEEP_SIZE, outstanding.size() * 2);
+    }
+
+    // must be called with lock held
+    private void pollCollected() {
+        Record record;
+        while ((record = (Record) collected.poll()) != null) {
+            if (outstanding.remove(record) && !record.closed) {
+                leakCount++;
+
+                if (record.site != null) {
+                    if (leaked.size() == MAX_LEAK_RECORDS)
+                        leaked.remove(0);
+
+                    leaked.add(record);
+                }
+            }
+        }
+    }
+
+    private static FactoryStats.Site site(Map<List<StackTraceElement>, FactoryStats.Site> sites, Record record) {
+        final StackTraceElement[] trace = trim(record.site);
+        final List<StackTraceElement> stack = Arrays.asList(trace);
+
+        FactoryStats.Site site = sites.get(stack);
+        if (site == null)
+            sites.put(stack, site = new FactoryStats.Site(trace));
+
+        return site;
+    }
+
+    // drop the frames inside of the library itself, leaving the caller on top
+    private static StackTraceElement[] trim(Throwable site) {
+        if (site == null)
+            return new StackTraceElement[0];
+
+        final StackTraceElement[] stack = site.getStackTrace();
+
+        int start = 0;
+        while (start < stack.length && isInternal(stack[start].getClassName()))
+            start++;
+
+        final StackTraceElement[] trimmed = new StackTraceElement[stack.length - start];
+        System.arraycopy(stack, start, trimmed, 0, trimmed.length);
+
+        return trimmed;
+    }
+
+    private static boolean isInternal(String className) {
+        return className.startsWith(LeakTracker.class.getName())
+                || className.startsWith(FileDescriptorFactory.class.getName());
+    }
+}
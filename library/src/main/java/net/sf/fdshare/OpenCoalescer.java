@@ -0,0 +1,129 @@
+/*
+ * Copyright © 2015 Alexander Rvachev
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+package net.sf.fdshare;
+
+import android.os.ParcelFileDescriptor;
+import net.sf.fdshare.internal.FdCompat;
+
+import java.io.File;
+import java.io.IOException;
+import java.util.ArrayDeque;
+import java.util.concurrent.ConcurrentHashMap;
+
+/**
+ * Merges concurrent opens of the same path with the same mode. The first caller (the leader) performs the
+ * actual open, others wait for it and receive duplicates of the result.
+ */
+final class OpenCoalescer {
+    interface Opener {
+        ParcelFileDescriptor open(File file, int mode) throws IOException, FactoryBrokenException;
+    }
+
+    private final ConcurrentHashMap<OpenKey, Pending> inFlight = new ConcurrentHashMap<>();
+
+    private final boolean includeWrites;
+
+    OpenCoalescer(boolean includeWrites) {
+        this.includeWrites = includeWrites;
+    }
+
+    ParcelFileDescriptor open(File file, int mode, Opener opener) throws IOException, FactoryBrokenException {
+        final OpenKey key = new OpenKey(file.getPath(), mode);
+
+        if (!includeWrites && !key.isReadOnly())
+            return opener.open(file, mode);
+
+        final Pending ours = new Pending();
+
+        final Pending existing = inFlight.putIfAbsent(key, ours);
+        if (existing != null) {
+            final ParcelFileDescriptor copy = existing.join();
+
+            // null means, that the leader has already finished, and a new request is needed to see fresh state
+            return copy != null ? copy : opener.open(file, mode);
+        }
+
+        ParcelFileDescriptor result = null;
+        Exception error = null;
+        try {
+            result = opener.open(file, mode);
+
+            return result;
+        } catch (IOException | FactoryBrokenException | RuntimeException e) {
+            error = e;
+
+            // the leader sees it's own failure as well as waiters do
+            throw e;
+        } finally {
+            inFlight.remove(key, ours);
+
+            ours.complete(result, error);
+        }
+    }
+
+    private static final class Pending {
+        private final ArrayDeque<ParcelFileDescriptor> copies = new ArrayDeque<>();
+
+        private int waiters;
+        private boolean done;
+        private Exception error;
+
+        // duplicates are created under lock, so every waiter, that has not given up yet, gets one
+        synchronized void complete(ParcelFileDescriptor result, Exception error) {
+            this.error = error;
+
+            if (result != null) {
+                try {
+                    for (int i = 0; i < waiters; i++)
+                        copies.add(FdCompat.dup(result));
+                } catch (IOException e) {
+                    this.error = e;
+                }
+            }
+
+            done = true;
+
+            notifyAll();
+        }
+
+        synchronized ParcelFileDescriptor join() throws IOException, FactoryBrokenException {
+            if (done)
+                return null;
+
+            waiters++;
+
+            try {
+                while (!done)
+                    wait();
+            } catch (InterruptedException ie) {
+                waiters--;
+
+                Thread.currentThread().interrupt();
+
+                throw new IOException("Interrupted before completion");
+            }
+
+            final ParcelFileDescriptor copy = copies.poll();
+            if (copy != null)
+                return copy;
+
+            if (error instanceof FactoryBrokenException)
+                throw new FactoryBrokenException(error.getMessage());
+
+            throw new IOException(error == null ? "Failed to duplicate descriptor" : error.getMessage());
+        }
+    }
+}
@@ -0,0 +1,54 @@
+/*
+ * Copyright © 2015 Alexander Rvachev
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+package net.sf.fdshare;
+
+/**
+ * Path and mode of a single open request, used to find equivalent requests.
+ */
+final class OpenKey {
+    private static final int WRITE_FLAGS = FileDescriptorFactory.O_WRONLY | FileDescriptorFactory.O_RDWR
+            | FileDescriptorFactory.O_APPEND | FileDescriptorFactory.O_CREAT | FileDescriptorFactory.O_TRUNC;
+
+    final String path;
+    final int mode;
+
+    OpenKey(String path, int mode) {
+        this.path = path;
+        this.mode = mode;
+    }
+
+    /**
+     * @return true, if the request can neither modify, nor create the file
+     */
+    boolean isReadOnly() {
+        return (mode & WRITE_FLAGS) == 0;
+    }
+
+    @Override
+    public boolean equals(Object o) {
+        if (this == o) return true;
+        if (!(o instanceof OpenKey)) return false;
+
+        final OpenKey other = (OpenKey) o;
+
+        return mode == other.mode && path.equals(other.path);
+    }
+
+    @Override
+    public int hashCode() {
+        return 31 * path.hashCode() + mode;
+    }
+}
@@ -0,0 +1,129 @@
+/*
+ * Copyright © 2015 Alexander Rvachev
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+package net.sf.fdshare;
+
+import android.support.annotation.IntDef;
+
+import java.lang.annotation.Documented;
+import java.lang.annotation.Retention;
+import java.lang.annotation.RetentionPolicy;
+import java.util.ArrayList;
+
+/**
+ * A list of rules, restricting files, that can be accessed via {@link FileDescriptorFactory}. The rules are
+ * compiled and enforced by the helper process itself, so they protect against bugs (such as path traversal)
+ * in the application, that uses the factory, not just against honest mistakes.
+ * <p>
+ * Each rule is an absolute path pattern, that applies to the matching file and everything below it.
+ * Path components may be literal names, shell globs (such as {@code *.jpg}) or {@code **}, matching any number
+ * of components. When several rules match, the most specific one wins: the one, that matches more
+ * path components, then the one with more literal components, then deny rule. Everything, that matches
+ * no rules, is denied.
+ * <p>
+ * Paths are checked after resolving symlinks, so a link can not be used to escape the allowed area.
+ * Denied requests fail with {@link PolicyDeniedException}. {@link FileDescriptorFactory#spawn} is always denied,
+ * because commands can access any file.
+ *
+ * @see FactoryOptions#pathPolicy(PathPolicy)
+ */
+public final class PathPolicy {
+    /**
+     * Kinds of access, granted by {@link #allow}.
+     */
+    @IntDef(flag = true, value = {
+            READ,
+            WRITE,
+            CREATE
+    })
+    @Documented
+    @Retention(RetentionPolicy.SOURCE)
+    public @interface Access {}
+
+    // must match POLICY_* constants in policy.h
+    public static final int READ = 1;
+    public static final int WRITE = 2;
+    public static final int CREATE = 4;
+
+    /**
+     * The error code, reported in place of errno for paths, denied by policy, such as by
+     * {@link FileDescriptorFactory#openAll}. Must match EPOLICY in fdhelper.c
+     */
+    public static final int DENIED = 1000;
+
+    // must match MAX_POLICY_RULES in fdhelper.c
+    private static final int MAX_RULES = 4096;
+
+    final ArrayList<Object> rules = new ArrayList<>();
+
+    private int count;
+
+    /**
+     * Allow specified kinds of access to files, matching the pattern.
+     *
+     * @param pattern absolute path pattern, such as {@code /data/media/0/DCIM/**}
+     */
+    public PathPolicy allow(String pattern, @Access int access) {
+        if (access == 0 || (access & ~(READ | WRITE | CREATE)) != 0)
+            throw new IllegalArgumentException("Invalid access: " + access);
+
+        return add(1, access, pattern);
+    }
+
+    /**
+     * Deny any access to files, matching the pattern, overriding less specific rules.
+     *
+     * @param pattern absolute path pattern, such as {@code /data/data/*}
+     */
+    public PathPolicy deny(String pattern) {
+        return add(0, 0, pattern);
+    }
+
+    private PathPolicy add(int allow, int access, String pattern) {
+        if (!pattern.startsWith("/"))
+            throw new IllegalArgumentException("Pattern must be absolute: " + pattern);
+
+        for (String component : pattern.split("/"))
+            if (".".equals(component) || "..".equals(component))
+                throw new IllegalArgumentException("Pattern must not contain relative components: " + pattern);
+
+        if (count == MAX_RULES)
+            throw new IllegalStateException("Too many rules");
+
+        rules.add(allow);
+        rules.add(access);
+        rules.add(pattern);
+
+        count++;
+
+        return this;
+    }
+
+    // the rule count, followed by allow flag, access and pattern of each rule
+    Object[] toArgs() {
+        final Object[] args = new Object[rules.size() + 1];
+
+        args[0] = count;
+
+        for (int i = 0; i < rules.size(); i++)
+            args[i + 1] = rules.get(i);
+
+        return args;
+    }
+
+    boolean isEmpty() {
+        return count == 0;
+    }
+}
@@ -0,0 +1,57 @@
+/*
+ * Copyright © 2015 Alexander Rvachev
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+package net.sf.fdshare;
+
+import android.os.ParcelFileDescriptor;
+import android.support.annotation.NonNull;
+import android.support.annotation.Nullable;
+
+import java.io.Closeable;
+import java.io.IOException;
+
+/**
+ * A descriptor, returned by {@link FileDescriptorFactory#open(java.io.File, String, int, int)}, along with path
+ * of the opened file, as seen by kernel at the moment of opening.
+ */
+public final class ResolvedDescriptor implements Closeable {
+    private final ParcelFileDescriptor descriptor;
+    private final String canonicalPath;
+
+    ResolvedDescriptor(ParcelFileDescriptor descriptor, String canonicalPath) {
+        this.descriptor = descriptor;
+        this.canonicalPath = canonicalPath;
+    }
+
+    /**
+     * @return the descriptor, owned by this instance
+     */
+    public @NonNull ParcelFileDescriptor getDescriptor() {
+        return descriptor;
+    }
+
+    /**
+     * @return canonical path of opened file, or null if the kernel could not report it (for example, when it is
+     * too long)
+     */
+    public @Nullable String getCanonicalPath() {
+        return canonicalPath;
+    }
+
+    @Override
+    public void close() throws IOException {
+        descriptor.close();
+    }
+}
@@ -0,0 +1,189 @@
+/*
+ * Copyright © 2015 Alexander Rvachev
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+package net.sf.fdshare;
+
+import android.annotation.TargetApi;
+import android.os.Build;
+import android.support.annotation.Nullable;
+import android.system.ErrnoException;
+import android.system.Os;
+import android.system.OsConstants;
+import android.system.StructPollfd;
+import android.util.Log;
+
+import java.io.FileDescriptor;
+import java.io.InterruptedIOException;
+import java.util.ArrayList;
+import java.util.HashSet;
+
+/**
+ * A single thread, that waits for responses on sockets of all factories, created with
+ * {@link FactoryOptions#shareReactor}, and wakes up their callers. This keeps the number of threads constant,
+ * regardless of number of factories in the process. The reactor never reads from channels itself.
+ * <p>
+ * Requires {@code poll} from {@link Os}, available since Lollipop.
+ */
+@TargetApi(21)
+final class SharedReactor {
+    interface Channel {
+        FileDescriptor getDescriptor();
+
+        /**
+         * Called on reactor thread, when the descriptor becomes readable (or reaches end of stream). The channel
+         * is not polled again until {@link #arm} is called for it, so there is no need to consume anything here.
+         * Must not block or throw.
+         */
+        void onReadable();
+    }
+
+    private static final String TAG = "SharedReactor";
+
+    private static SharedReactor instance;
+
+    private final FileDescriptor wakeupRead;
+    private final FileDescriptor wakeupWrite;
+
+    // guarded by itself
+    private final ArrayList<Channel> channels = new ArrayList<>();
+
+    // channels, that became readable and have not been armed again, guarded by channels
+    private final HashSet<Channel> disarmed = new HashSet<>();
+
+    // guarded by channels
+    private boolean changed;
+
+    /**
+     * @return the reactor, started on first call, or null if not supported by current platform
+     */
+    static synchronized @Nullable SharedReactor get() {
+        if (instance == null && Build.VERSION.SDK_INT >= 21) {
+            try {
+                instance = new SharedReactor(Os.pipe());
+            } catch (ErrnoException e) {
+                Log.w(TAG, "Failed to create wakeup pipe", e);
+            }
+        }
+
+        return instance;
+    }
+
+    private SharedReactor(FileDescriptor[] pipe) {
+        wakeupRead = pipe[0];
+        wakeupWrite = pipe[1];
+
+        final Thread thread = new Thread(this::run, "fd reactor");
+        thread.setDaemon(true);
+        thread.start();
+    }
+
+    void register(Channel channel) {
+        synchronized (channels) {
+            channels.add(channel);
+            changed = true;
+        }
+
+        wakeup();
+    }
+
+    void unregister(Channel channel) {
+        synchronized (channels) {
+            channels.remove(channel);
+            disarmed.remove(channel);
+            changed = true;
+        }
+
+        wakeup();
+    }
+
+    /**
+     * Resume polling the channel after {@link Channel#onReadable} and consuming whatever has been readable.
+     */
+    void arm(Channel channel) {
+        synchronized (channels) {
+            if (!disarmed.remove(channel))
+                return;
+
+            changed = true;
+        }
+
+        wakeup();
+    }
+
+    private void wakeup() {
+        try {
+            Os.write(wakeupWrite, new byte[1], 0, 1);
+        } catch (ErrnoException | InterruptedIOException e) {
+            Log.w(TAG, "Failed to wake up reactor", e);
+        }
+    }
+
+    private void run() {
+        final byte[] drain = new byte[64];
+
+        Channel[] polled = new Channel[0];
+        StructPollfd[] pollFds = null;
+
+        while (true) {
+            synchronized (channels) {
+                if (pollFds == null || changed) {
+                    final ArrayList<Channel> armed = new ArrayList<>(channels);
+                    armed.removeAll(disarmed);
+
+                    polled = armed.toArray(new Channel[armed.size()]);
+                    pollFds = new StructPollfd[polled.length + 1];
+
+                    for (int i = 0; i < pollFds.length; i++) {
+                        pollFds[i] = new StructPollfd();
+                        pollFds[i].fd = i == 0 ? wakeupRead : polled[i - 1].getDescriptor();
+                        pollFds[i].events = (short) OsConstants.POLLIN;
+                    }
+
+                    changed = false;
+                }
+            }
+
+            try {
+                Os.poll(pollFds, -1);
+
+                if (pollFds[0].revents != 0)
+                    Os.read(wakeupRead, drain, 0, drain.length);
+            } catch (ErrnoException e) {
+                if (e.errno != OsConstants.EINTR)
+                    Log.e(TAG, "poll failed", e);
+
+                continue;
+            } catch (InterruptedIOException e) {
+                continue;
+            }
+
+            for (int i = 1; i < pollFds.length; i++) {
+                if (pollFds[i].revents != 0) {
+                    pollFds[i].revents = 0;
+
+                    // before the callback, so that the channel can be armed again as soon as it returns
+                    synchronized (channels) {
+                        if (channels.contains(polled[i - 1])) {
+                            disarmed.add(polled[i - 1]);
+                            changed = true;
+                        }
+                    }
+
+                    polled[i - 1].onReadable();
+                }
+            }
+        }
+    }
+}
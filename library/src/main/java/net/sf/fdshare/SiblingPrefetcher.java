@@ -0,0 +1,290 @@
+/*
+ * Copyright © 2015 Alexander Rvachev
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+package net.sf.fdshare;
+
+import android.os.ParcelFileDescriptor;
+import android.os.SystemClock;
+import android.support.annotation.Nullable;
+
+import net.sf.fdshare.internal.DeferredCloser;
+
+import java.io.Closeable;
+import java.io.File;
+import java.io.IOException;
+import java.util.ArrayList;
+import java.util.HashSet;
+import java.util.Iterator;
+import java.util.LinkedHashMap;
+import java.util.List;
+import java.util.Map;
+import java.util.concurrent.ExecutorService;
+import java.util.concurrent.Executors;
+import java.util.concurrent.RejectedExecutionException;
+
+/**
+ * Detects sequential opens of numbered files within a directory ({@code IMG_0001.jpg}, {@code IMG_0002.jpg}...)
+ * and opens next few files in background, so that they are ready by the time they are requested.
+ * <p>
+ * Prefetched descriptors are kept for a short time, the total number of them is bounded. When the limit is
+ * reached, oldest descriptors are closed first.
+ */
+final class SiblingPrefetcher implements Closeable {
+    interface BatchOpener {
+        ParcelFileDescriptor[] openAll(List<File> files, int mode) throws IOException, FactoryBrokenException;
+    }
+
+    // long enough to cover a user flipping pages, short enough to not hand out badly stale descriptors
+    private static final long EXPIRATION_MS = 3000;
+
+    // number of directories to track access patterns in
+    private static final int MAX_DIRECTORIES = 8;
+
+    private final LinkedHashMap<OpenKey, Prefetched> cache = new LinkedHashMap<>();
+    private final HashSet<OpenKey> pending = new HashSet<>();
+
+    private final LinkedHashMap<String, String> lastOpened = new LinkedHashMap<String, String>(16, 0.75f, true) {
+        @Override
+        protected boolean removeEldestEntry(Map.Entry<String, String> eldest) {
+            return size() > MAX_DIRECTORIES;
+        }
+    };
+
+    private final ExecutorService executor = Executors.newSingleThreadExecutor(r -> {
+        final Thread thread = new Thread(r, "fd prefetcher");
+        thread.setDaemon(true);
+        return thread;
+    });
+
+    private final BatchOpener opener;
+    private final DeferredCloser closer;
+    private final int depth;
+    private final int limit;
+
+    private boolean closed;
+
+    SiblingPrefetcher(BatchOpener opener, int depth, int limit, @Nullable DeferredCloser closer) {
+        this.opener = opener;
+        this.closer = closer;
+        this.depth = Math.min(depth, FileDescriptorFactory.MAX_BATCH_OPEN);
+        this.limit = limit;
+    }
+
+    /**
+     * @return previously prefetched descriptor, now owned by caller, or null
+     */
+    synchronized ParcelFileDescriptor take(File file, int mode) {
+        evictExpired();
+
+        final Prefetched prefetched = cache.remove(new OpenKey(file.getPath(), mode));
+
+        return prefetched == null ? null : prefetched.fd;
+    }
+
+    /**
+     * Record a successful open, possibly scheduling prefetch of files, likely to be opened next.
+     */
+    void onOpened(File file, int mode) {
+        final OpenKey opened = new OpenKey(file.getPath(), mode);
+
+        final String dir = file.getParent();
+        if (dir == null || !opened.isReadOnly())
+            return;
+
+        final List<File> candidates = new ArrayList<>(depth);
+
+        synchronized (this) {
+            final String name = file.getName();
+            final String previous = lastOpened.put(dir, name);
+
+            if (closed || previous == null || !name.equals(nextName(previous)))
+                return;
+
+            evictExpired();
+
+            String next = name;
+
+            for (int i = 0; i < depth && cache.size() + pending.size() < limit; i++) {
+                if ((next = nextName(next)) == null)
+                    break;
+
+                final File sibling = new File(dir, next);
+                final OpenKey key = new OpenKey(sibling.getPath(), mode);
+
+                if (!cache.containsKey(key) && pending.add(key))
+                    candidates.add(sibling);
+            }
+        }
+
+        if (candidates.isEmpty())
+            return;
+
+        try {
+            executor.execute(() -> prefetch(candidates, mode));
+        } catch (RejectedExecutionException closedConcurrently) {
+            synchronized (this) {
+                for (File candidate : candidates)
+                    pending.remove(new OpenKey(candidate.getPath(), mode));
+            }
+        }
+    }
+
+    private void prefetch(List<File> files, int mode) {
+        ParcelFileDescriptor[] results = null;
+        try {
+            results = opener.openAll(files, mode);
+        } catch (IOException | FactoryBrokenException ignored) {
+            // prefetching is best-effort, the failure will be reported once the file is actually requested
+        }
+
+        final long expires = SystemClock.uptimeMillis() + EXPIRATION_MS;
+
+        synchronized (this) {
+            for (int i = 0; i < files.size(); i++) {
+                final OpenKey key = new OpenKey(files.get(i).getPath(), mode);
+
+                pending.remove(key);
+
+                final ParcelFileDescriptor fd = results == null ? null : results[i];
+                if (fd == null)
+                    continue;
+
+                if (closed) {
+                    closeQuietly(fd);
+                    continue;
+                }
+
+                // a replaced entry is removed first, so that the new one is put at the end: re-putting an existing
+                // key keeps it's old position, which would break the ordering, evictExpired relies on
+                final Prefetched old = cache.remove(key);
+                if (old != null)
+                    closeQuietly(old.fd);
+
+                // newer predictions are more relevant, make room by closing the oldest ones
+                while (cache.size() >= limit)
+                    evictEldest();
+
+                cache.put(key, new Prefetched(fd, expires));
+            }
+        }
+    }
+
+    private void evictExpired() {
+        final long now = SystemClock.uptimeMillis();
+
+        final Iterator<Prefetched> iterator = cache.values().iterator();
+        while (iterator.hasNext()) {
+            final Prefetched prefetched = iterator.next();
+
+            // entries are ordered by insertion, so expiration times are non-decreasing
+            if (prefetched.expires > now)
+                break;
+
+            iterator.remove();
+            closeQuietly(prefetched.fd);
+        }
+    }
+
+    private void evictEldest() {
+        final Iterator<Prefetched> iterator = cache.values().iterator();
+
+        closeQuietly(iterator.next().fd);
+        iterator.remove();
+    }
+
+    /**
+     * Close all prefetched descriptors, such as when the process runs out of descriptors.
+     *
+     * @return number of closed descriptors
+     */
+    synchronized int evictAll() {
+        final int evicted = cache.size();
+
+        for (Prefetched prefetched : cache.values())
+            closeQuietly(prefetched.fd);
+
+        cache.clear();
+
+        return evicted;
+    }
+
+    @Override
+    public void close() {
+        executor.shutdown();
+
+        synchronized (this) {
+            closed = true;
+
+            for (Prefetched prefetched : cache.values())
+                closeQuietly(prefetched.fd);
+
+            cache.clear();
+        }
+    }
+
+    /**
+     * Increment the last number within file name, preserving it's width (IMG_0009.jpg becomes IMG_0010.jpg).
+     *
+     * @return name of the next file or null if the name does not contain numbers
+     */
+    static String nextName(String name) {
+        int end = name.length();
+        while (end > 0 && !isDigit(name.charAt(end - 1)))
+            end--;
+
+        int start = end;
+        while (start > 0 && isDigit(name.charAt(start - 1)))
+            start--;
+
+        // also rejects numbers, that may not fit into long
+        if (start == end || end - start > 18)
+            return null;
+
+        final String incremented = String.valueOf(Long.parseLong(name.substring(start, end)) + 1);
+
+        final StringBuilder result = new StringBuilder(name.length() + 1).append(name, 0, start);
+        for (int i = incremented.length(); i < end - start; i++)
+            result.append('0');
+
+        return result.append(incremented).append(name, end, name.length()).toString();
+    }
+
+    private static boolean isDigit(char c) {
+        return c >= '0' && c <= '9';
+    }
+
+    // evicted descriptors are likely to be the last ones, referring to their files, so closing may be slow
+    private void closeQuietly(ParcelFileDescriptor fd) {
+        if (closer != null) {
+            closer.defer(fd);
+            return;
+        }
+
+        try {
+            fd.close();
+        } catch (IOException ignored) {
+        }
+    }
+
+    private static final class Prefetched {
+        final ParcelFileDescriptor fd;
+        final long expires;
+
+        Prefetched(ParcelFileDescriptor fd, long expires) {
+            this.fd = fd;
+            this.expires = expires;
+        }
+    }
+}
@@ -0,0 +1,146 @@
+/*
+ * Copyright © 2015 Alexander Rvachev
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+package net.sf.fdshare;
+
+import android.os.ParcelFileDescriptor;
+import android.support.annotation.NonNull;
+import android.support.annotation.Nullable;
+
+import java.io.Closeable;
+import java.io.DataInputStream;
+import java.io.EOFException;
+import java.io.IOException;
+import java.io.InputStream;
+import java.io.OutputStream;
+
+/**
+ * A process, started with superuser privileges by {@link FileDescriptorFactory#spawn}. The process is connected
+ * to this one by pipes, much like {@link Process}, but it's exit code is delivered by another pipe, because
+ * only the helper can wait for it.
+ * <p>
+ * Closing the instance closes the pipes, but does not stop the process. Processes, that are still running
+ * when the factory is closed, receive SIGHUP, once the helper process serving the factory exits (including
+ * the one, serving a connection to daemon). A process, that executes a setuid program, loses this signal.
+ */
+public final class SpawnedProcess implements Closeable {
+    public static final int SIGKILL = 9;
+    public static final int SIGTERM = 15;
+
+    private final FileDescriptorFactory factory;
+    private final int pid;
+    private final OutputStream stdin;
+    private final InputStream stdout;
+    private final InputStream stderr;
+    private final DataInputStream status;
+    private final ParcelFileDescriptor pidFd;
+
+    // guarded by status
+    private Integer exitCode;
+
+    // the descriptors are stdin, stdout, stderr, status and, optionally, pidfd
+    SpawnedProcess(FileDescriptorFactory factory, int pid, ParcelFileDescriptor[] fds) {
+        this.factory = factory;
+        this.pid = pid;
+        this.stdin = new ParcelFileDescriptor.AutoCloseOutputStream(fds[0]);
+        this.stdout = new ParcelFileDescriptor.AutoCloseInputStream(fds[1]);
+        this.stderr = new ParcelFileDescriptor.AutoCloseInputStream(fds[2]);
+        this.status = new DataInputStream(new ParcelFileDescriptor.AutoCloseInputStream(fds[3]));
+        this.pidFd = fds.length > 4 ? fds[4] : null;
+    }
+
+    public int getPid() {
+        return pid;
+    }
+
+    /**
+     * @return the stream, connected to standard input of the process
+     */
+    public @NonNull OutputStream getOutputStream() {
+        return stdin;
+    }
+
+    /**
+     * @return the stream, connected to standard output of the process
+     */
+    public @NonNull InputStream getInputStream() {
+        return stdout;
+    }
+
+    /**
+     * @return the stream, connected to standard error of the process
+     */
+    public @NonNull InputStream getErrorStream() {
+        return stderr;
+    }
+
+    /**
+     * @return pidfd of the process, that becomes readable (in terms of {@code poll}), when the process exits,
+     * or null if the kernel does not support pidfd (Linux 5.3 is required)
+     */
+    public @Nullable ParcelFileDescriptor getPidDescriptor() {
+        return pidFd;
+    }
+
+    /**
+     * Block until the process exits.
+     *
+     * @return the exit code of process, or 128 plus signal number, if it was killed by signal
+     *
+     * @throws IOException if the helper died before the process
+     */
+    public int waitFor() throws IOException {
+        synchronized (status) {
+            if (exitCode == null) {
+                try {
+                    exitCode = status.readInt();
+                } catch (EOFException e) {
+                    throw new IOException("The helper quit before the process " + pid);
+                }
+            }
+
+            return exitCode;
+        }
+    }
+
+    /**
+     * Send the signal to the process via helper.
+     *
+     * @param signal signal number, such as {@link #SIGTERM}
+     *
+     * @throws IOException if the process has already exited
+     * @throws FactoryBrokenException irrecoverable error, that renders the factory unusable
+     */
+    public void kill(int signal) throws IOException, FactoryBrokenException {
+        factory.signal(pid, signal);
+    }
+
+    /**
+     * Close the pipes and pidfd. The process keeps running, if it has not exited yet.
+     */
+    @Override
+    public void close() {
+        shut(stdin);
+        shut(stdout);
+        shut(stderr);
+        shut(status);
+        shut(pidFd);
+    }
+
+    private static void shut(Closeable closeable) {
+        if (closeable != null)
+            try { closeable.close(); } catch (IOException ignored) {}
+    }
+}
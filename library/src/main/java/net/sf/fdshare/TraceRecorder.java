@@ -0,0 +1,144 @@
+/*
+ * Copyright © 2015 Alexander Rvachev
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+package net.sf.fdshare;
+
+import android.util.Log;
+
+import java.io.BufferedOutputStream;
+import java.io.DataOutputStream;
+import java.io.File;
+import java.io.FileOutputStream;
+import java.io.IOException;
+import java.nio.charset.Charset;
+
+/**
+ * Writes requests, sent to helper, into a compact binary trace, that can be replayed later by {@link TraceReplay}
+ * or the {@code fdreplay} tool. All numbers are big-endian.
+ * <pre>
+ * header: "FDTR", u8 version (1), u8 flags (FLAG_PATHS), i64 wall clock time of start in milliseconds
+ * record: i32 microseconds since start of previous request, i32 latency in microseconds, u8 opcode,
+ *         i16 result (one of RESULT_* or PathPolicy.DENIED), u8 argument count, arguments
+ * argument: 'i' i32 | 'p' absolute path | 'q' relative path (or other string)
+ * path: u16 length and UTF-8 bytes with FLAG_PATHS, otherwise i64 FNV-1a hash of UTF-8 bytes
+ * </pre>
+ * Only the path hashes are recorded by default, so that traces from users' devices don't disclose their files.
+ */
+final class TraceRecorder {
+    static final int VERSION = 1;
+
+    static final int FLAG_PATHS = 1;
+
+    static final int RESULT_OK = 0;
+    static final int RESULT_ERROR = 1;
+    static final int RESULT_BROKEN = 2;
+
+    private static final Charset UTF_8 = Charset.forName("UTF-8");
+
+    private final boolean withPaths;
+
+    // guarded by this
+    private DataOutputStream out;
+    private long lastStart;
+
+    TraceRecorder(File file, boolean withPaths) throws IOException {
+        this.withPaths = withPaths;
+
+        final DataOutputStream stream = new DataOutputStream(new BufferedOutputStream(new FileOutputStream(file), 64 * 1024));
+        try {
+            stream.writeBytes("FDTR");
+            stream.writeByte(VERSION);
+            stream.writeByte(withPaths ? FLAG_PATHS : 0);
+            stream.writeLong(System.currentTimeMillis());
+        } catch (IOException e) {
+            stream.close();
+
+            throw e;
+        }
+
+        this.out = stream;
+        this.lastStart = System.nanoTime();
+    }
+
+    static long hash(byte[] bytes) {
+        long hash = 0xcbf29ce484222325L;
+
+        for (byte b : bytes) {
+            hash ^= b & 0xff;
+            hash *= 0x100000001b3L;
+        }
+
+        return hash;
+    }
+
+    /**
+     * @param start {@link System#nanoTime()} before sending the request
+     */
+    synchronized void record(long start, char op, Object[] args, int result) {
+        if (out == null)
+            return;
+
+        final long now = System.nanoTime();
+
+        try {
+            out.writeInt(toMicros(start - lastStart));
+            out.writeInt(toMicros(now - start));
+            out.writeByte(op);
+            out.writeShort(result);
+            out.writeByte(args.length);
+
+            for (Object arg : args) {
+                if (arg instanceof String) {
+                    final String str = (String) arg;
+                    final byte[] bytes = str.getBytes(UTF_8);
+
+                    out.writeByte(str.startsWith("/") ? 'p' : 'q');
+
+                    if (withPaths) {
+                        out.writeShort(bytes.length);
+                        out.write(bytes);
+                    } else {
+                        out.writeLong(hash(bytes));
+                    }
+                } else {
+                    out.writeByte('i');
+                    out.writeInt(((Number) arg).intValue());
+                }
+            }
+
+            lastStart = Math.max(lastStart, start);
+        } catch (IOException e) {
+            Log.e("fdshare", "Failed to write the trace, recording stopped", e);
+
+            close();
+        }
+    }
+
+    synchronized void close() {
+        if (out == null)
+            return;
+
+        try {
+            out.close();
+        } catch (IOException ignored) {
+        } finally {
+            out = null;
+        }
+    }
+
+    private static int toMicros(long nanos) {
+        return (int) Math.max(0, Math.min(Integer.MAX_VALUE, nanos / 1000));
+    }
+}
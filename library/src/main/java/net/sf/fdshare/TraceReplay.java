@@ -0,0 +1,289 @@
+/*
+ * Copyright © 2015 Alexander Rvachev
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+package net.sf.fdshare;
+
+import android.os.ParcelFileDescriptor;
+import android.support.annotation.NonNull;
+
+import java.io.BufferedInputStream;
+import java.io.DataInputStream;
+import java.io.EOFException;
+import java.io.File;
+import java.io.IOException;
+import java.io.InputStream;
+import java.util.ArrayList;
+import java.util.Arrays;
+import java.util.Locale;
+
+/**
+ * Replays a trace, recorded with {@link FactoryOptions#recordTrace}, against a factory. Paths from the trace
+ * are placed under the root directory; hashed paths become files, named after the hash, in the root itself.
+ * Such tree can be generated by {@code fdreplay tree} (see {@code tools/fdreplay}) on a Linux host and pushed to
+ * the device.
+ * <p>
+ * Requests are replayed one at a time. Only opening, hashing, archiving and requesting file handles is replayed,
+ * other requests are skipped.
+ */
+public final class TraceReplay {
+    /**
+     * Speed value, that makes the replay issue requests as fast as possible, ignoring the recorded timing.
+     */
+    public static final float MAX_SPEED = 0;
+
+    /**
+     * Outcome of replay.
+     */
+    public static final class Result {
+        private final long[] latencies;
+        private final int skipped;
+        private final int mismatched;
+        private final long duration;
+
+        Result(long[] latencies, int skipped, int mismatched, long duration) {
+            this.latencies = latencies;
+            this.skipped = skipped;
+            this.mismatched = mismatched;
+            this.duration = duration;
+        }
+
+        /**
+         * @return number of replayed requests
+         */
+        public int getRequests() {
+            return latencies.length;
+        }
+
+        /**
+         * @return number of requests, that were not replayed
+         */
+        public int getSkipped() {
+            return skipped;
+        }
+
+        /**
+         * @return number of replayed requests, whose outcome (success, failure, denial) differs from the recorded one
+         */
+        public int getMismatched() {
+            return mismatched;
+        }
+
+        /**
+         * @return wall clock duration of replay in microseconds
+         */
+        public long getDuration() {
+            return duration;
+        }
+
+        /**
+         * @param percentile such as 50 or 99
+         *
+         * @return latency of replayed requests at given percentile in microseconds, or 0 if there were none
+         */
+        public long getLatency(double percentile) {
+            if (latencies.length == 0)
+                return 0;
+
+            final int index = (int) Math.ceil(percentile / 100 * latencies.length) - 1;
+
+            return latencies[Math.max(0, Math.min(latencies.length - 1, index))];
+        }
+
+        @Override
+        public String toString() {
+            return String.format(Locale.US, "%d requests (%d skipped, %d mismatched) in %d us, p50 %d us, p99 %d us, max %d us",
+                    getRequests(), skipped, mismatched, duration, getLatency(50), getLatency(99), getLatency(100));
+        }
+    }
+
+    private TraceReplay() {
+        throw new AssertionError("No instances");
+    }
+
+    /**
+     * Replay the trace. The factory must have the same path policy, as the recording one, for results to match.
+     *
+     * @param speed 1 to keep recorded intervals between requests, 2 to halve them etc., or {@link #MAX_SPEED}
+     *
+     * @throws IOException if the trace is malformed
+     * @throws FactoryBrokenException if the factory breaks during replay
+     */
+    public static @NonNull Result replay(FileDescriptorFactory factory, InputStream trace, File root, float speed)
+            throws IOException, FactoryBrokenException {
+        if (!(speed >= 0))
+            throw new IllegalArgumentException("Invalid speed: " + speed);
+
+        final DataInputStream in = new DataInputStream(new BufferedInputStream(trace));
+
+        final byte[] magic = new byte[4];
+        in.readFully(magic);
+        if (!"FDTR".equals(new String(magic, "US-ASCII")) || in.readUnsignedByte() != TraceRecorder.VERSION)
+            throw new IOException("Not a trace or unsupported version");
+
+        final boolean withPaths = (in.readUnsignedByte() & TraceRecorder.FLAG_PATHS) != 0;
+
+        in.readLong(); // wall clock time of recording
+
+        final ArrayList<Object> args = new ArrayList<>();
+
+        long[] latencies = new long[256];
+        int count = 0, skipped = 0, mismatched = 0;
+
+        final long started = System.nanoTime();
+
+        long offset = 0;
+
+        while (true) {
+            final int delay;
+            try {
+                delay = in.readInt();
+            } catch (EOFException e) {
+                break;
+            }
+
+            in.readInt(); // recorded latency
+
+            final char op = (char) in.readUnsignedByte();
+            final int recorded = in.readShort();
+            final int argc = in.readUnsignedByte();
+
+            args.clear();
+            for (int i = 0; i < argc; i++)
+                args.add(readArg(in, withPaths, root));
+
+            offset += delay;
+
+            if (speed != MAX_SPEED)
+                sleepUntil(started + (long) (offset * 1000 / speed));
+
+            final long start = System.nanoTime();
+
+            final int result;
+            try {
+                if (!replayRequest(factory, op, args)) {
+                    skipped++;
+                    continue;
+                }
+
+                result = TraceRecorder.RESULT_OK;
+            } catch (PolicyDeniedException e) {
+                result = PathPolicy.DENIED;
+            } catch (IOException e) {
+                result = TraceRecorder.RESULT_ERROR;
+            }
+
+            if (count == latencies.length)
+                latencies = Arrays.copyOf(latencies, count * 2);
+
+            latencies[count++] = (System.nanoTime() - start) / 1000;
+
+            if (result != recorded && recorded != TraceRecorder.RESULT_BROKEN)
+                mismatched++;
+        }
+
+        final long[] sorted = Arrays.copyOf(latencies, count);
+        Arrays.sort(sorted);
+
+        return new Result(sorted, skipped, mismatched, (System.nanoTime() - started) / 1000);
+    }
+
+    private static Object readArg(DataInputStream in, boolean withPaths, File root) throws IOException {
+        final int type = in.readUnsignedByte();
+
+        switch (type) {
+            case 'i':
+                return in.readInt();
+            case 'p':
+            case 'q':
+                final String path;
+                if (withPaths) {
+                    final byte[] bytes = new byte[in.readUnsignedShort()];
+                    in.readFully(bytes);
+                    path = new String(bytes, "UTF-8");
+                } else {
+                    path = String.format(Locale.US, "%016x", in.readLong());
+                }
+
+                return type == 'p' ? new File(root, path).getPath() : path;
+            default:
+                throw new IOException("Malformed trace: unknown argument type " + type);
+        }
+    }
+
+    private static boolean replayRequest(FileDescriptorFactory factory, char op, ArrayList<Object> args)
+            throws IOException, FactoryBrokenException {
+        switch (op) {
+            case FileDescriptorFactory.OP_OPEN:
+                factory.open(new File((String) args.get(0)), (Integer) args.get(1)).close();
+                return true;
+            case FileDescriptorFactory.OP_OPEN_RESOLVED:
+                factory.open(new File((String) args.get(0)), (String) args.get(1), (Integer) args.get(2),
+                        (Integer) args.get(3)).close();
+                return true;
+            case FileDescriptorFactory.OP_OPEN_MANY:
+                final ArrayList<File> opened = new ArrayList<>();
+                for (int i = 1; i < args.size(); i += 2)
+                    opened.add(new File((String) args.get(i)));
+
+                for (ParcelFileDescriptor fd : factory.openAll(opened, (Integer) args.get(2)))
+                    if (fd != null)
+                        fd.close();
+                return true;
+            case FileDescriptorFactory.OP_HASH:
+                final ArrayList<File> hashed = new ArrayList<>();
+                for (int i = 2; i < args.size(); i++)
+                    hashed.add(new File((String) args.get(i)));
+
+                factory.hash(hashed, (Integer) args.get(0));
+                return true;
+            case FileDescriptorFactory.OP_ARCHIVE:
+                final ArchiveOptions options = new ArchiveOptions();
+                options.flags = (Integer) args.get(1);
+
+                try (InputStream archive = new ParcelFileDescriptor.AutoCloseInputStream(
+                        factory.archive(new File((String) args.get(0)), options)))
+                {
+                    final byte[] buffer = new byte[64 * 1024];
+                    while (archive.read(buffer) != -1);
+                }
+                return true;
+            case FileDescriptorFactory.OP_GET_HANDLE:
+                factory.getHandle(new File((String) args.get(0)));
+                return true;
+            case FileDescriptorFactory.OP_READ_HEADERS:
+                final ArrayList<File> sniffed = new ArrayList<>();
+                for (int i = 2; i < args.size(); i++)
+                    sniffed.add(new File((String) args.get(i)));
+
+                factory.readHeaders(sniffed, (Integer) args.get(0));
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    private static void sleepUntil(long deadline) throws IOException {
+        long remaining;
+        while ((remaining = deadline - System.nanoTime()) > 0) {
+            try {
+                Thread.sleep(remaining / 1000000, (int) (remaining % 1000000));
+            } catch (InterruptedException e) {
+                Thread.currentThread().interrupt();
+
+                throw new IOException("Interrupted");
+            }
+        }
+    }
+}
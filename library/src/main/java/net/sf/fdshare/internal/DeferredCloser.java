@@ -0,0 +1,144 @@
+/*
+ * Copyright © 2015 Alexander Rvachev
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+package net.sf.fdshare.internal;
+
+import android.os.ParcelFileDescriptor;
+import android.support.annotation.NonNull;
+import android.util.Log;
+
+import java.io.FileDescriptor;
+import java.io.IOException;
+import java.util.ArrayList;
+import java.util.concurrent.LinkedBlockingQueue;
+import java.util.concurrent.TimeUnit;
+
+/**
+ * Closes descriptors on a background thread. Closing the last descriptor of a file on FUSE or network
+ * filesystem may flush it and block for a long time, which must not stall the caller.
+ * <p>
+ * Descriptors are detached from their owners immediately and closed in batches. With native library
+ * available, contiguous runs of descriptors are closed by a single {@code close_range} call.
+ */
+public final class DeferredCloser {
+    private static final String TAG = "DeferredCloser";
+
+    private static final int MAX_BATCH = 64;
+
+    private static final long IDLE_TIMEOUT_MS = 5000;
+
+    private final LinkedBlockingQueue<Integer> queue = new LinkedBlockingQueue<>();
+
+    private Thread worker;
+
+    /**
+     * Schedule the descriptor to be closed. The descriptor is invalidated right away.
+     */
+    public void defer(@NonNull FileDescriptor fd) {
+        final int value;
+        try {
+            value = FdCompat.detach(fd);
+        } catch (IOException e) {
+            // can not take the descriptor away, close it right here
+            FdCompat.closeDescriptor(fd);
+            return;
+        }
+
+        enqueue(value);
+    }
+
+    /**
+     * Schedule the descriptor to be closed. The descriptor is detached from supplied object right away.
+     */
+    public void defer(@NonNull ParcelFileDescriptor fd) {
+        final int value;
+        try {
+            value = FdCompat.detach(fd);
+        } catch (IOException e) {
+            try { fd.close(); } catch (IOException ignored) {}
+            return;
+        }
+
+        enqueue(value);
+    }
+
+    private void enqueue(int fd) {
+        if (fd < 0)
+            return;
+
+        queue.add(fd);
+
+        synchronized (this) {
+            if (worker == null) {
+                worker = new Thread(this::closeUntilIdle, "fd closer");
+                worker.setDaemon(true);
+                worker.start();
+            }
+        }
+    }
+
+    // the thread quits after some time without work, and is restarted on demand
+    private void closeUntilIdle() {
+        final ArrayList<Integer> batch = new ArrayList<>(MAX_BATCH);
+        final int[] fds = new int[MAX_BATCH];
+
+        try {
+            while (true) {
+                final Integer first = queue.poll(IDLE_TIMEOUT_MS, TimeUnit.MILLISECONDS);
+
+                if (first == null) {
+                    synchronized (this) {
+                        if (queue.isEmpty()) {
+                            worker = null;
+                            return;
+                        }
+                    }
+
+                    continue;
+                }
+
+                batch.add(first);
+                queue.drainTo(batch, MAX_BATCH - 1);
+
+                for (int i = 0; i < batch.size(); i++)
+                    fds[i] = batch.get(i);
+
+                closeAll(fds, batch.size());
+
+                batch.clear();
+            }
+        } catch (InterruptedException e) {
+            Log.w(TAG, "Descriptor closer interrupted", e);
+
+            synchronized (this) {
+                worker = null;
+            }
+        }
+    }
+
+    private static void closeAll(int[] fds, int count) {
+        if (FdNative.isAvailable()) {
+            FdNative.closeAll(fds, count);
+            return;
+        }
+
+        for (int i = 0; i < count; i++) {
+            try {
+                FdCompat.adopt(fds[i]).close();
+            } catch (IOException ignored) {
+            }
+        }
+    }
+}
@@ -11,8 +11,10 @@ import android.support.annotation.NonNull;
 import android.support.annotation.Nullable;
 import android.system.ErrnoException;
 import android.system.Os;
+import android.system.StructStat;
 import android.text.TextUtils;
 
+import java.io.BufferedReader;
 import java.io.File;
 import java.io.FileDescriptor;
 import java.io.FileInputStream;
@@ -21,12 +23,14 @@ import java.io.FileOutputStream;
 import java.io.FileReader;
 import java.io.IOException;
 import java.io.RandomAccessFile;
+import java.lang.reflect.Constructor;
 import java.lang.reflect.Field;
 import java.net.DatagramSocket;
 import java.net.Socket;
 import java.nio.ByteBuffer;
 import java.nio.channels.Channel;
 import java.nio.channels.FileChannel;
+import java.util.Arrays;
 import java.util.concurrent.atomic.AtomicBoolean;
 
 /**
@@ -95,6 +99,74 @@ public final class FdCompat {
         return resolved;
     }
 
+    /**
+     * Same as {@link #describeAll(boolean, ParcelFileDescriptor...)} without paths.
+     */
+    public static @NonNull FdInfo describeAll(@NonNull ParcelFileDescriptor... fds) throws IOException {
+        return describeAll(false, fds);
+    }
+
+    /**
+     * Collect type, size, modification time, offset, flags, mount id and (optionally) path of each descriptor. With native
+     * library available this takes a single JNI call and no per-descriptor allocations besides paths.
+     *
+     * @param withPaths whether to resolve paths, which is relatively expensive
+     */
+    public static @NonNull FdInfo describeAll(boolean withPaths, @NonNull ParcelFileDescriptor... fds)
+            throws IOException {
+        final int[] rawFds = new int[fds.length];
+        for (int i = 0; i < fds.length; i++)
+            rawFds[i] = getIntFd(fds[i]);
+
+        final long[] values = new long[fds.length * FdInfo.FIELD_COUNT];
+        final String[] paths = withPaths ? new String[fds.length] : null;
+
+        if (FdNative.isAvailable()) {
+            FdNative.describe(rawFds, values, paths);
+        } else {
+            Arrays.fill(values, -1);
+
+            for (int i = 0; i < fds.length; i++) {
+                describeInternal(rawFds[i], values, i * FdInfo.FIELD_COUNT);
+
+                if (paths != null)
+                    paths[i] = getFdPath(fds[i]);
+            }
+        }
+
+        return new FdInfo(values, paths);
+    }
+
+    private static void describeInternal(int fd, long[] values, int offset) {
+        try (BufferedReader reader = new BufferedReader(new FileReader("/proc/self/fdinfo/" + fd))) {
+            String line;
+            while ((line = reader.readLine()) != null) {
+                final int colon = line.indexOf(':');
+                if (colon == -1)
+                    continue;
+
+                final String value = line.substring(colon + 1).trim();
+
+                switch (line.substring(0, colon)) {
+                    case "pos":
+                        values[offset + FdInfo.FIELD_POSITION] = Long.parseLong(value);
+                        break;
+                    case "flags":
+                        values[offset + FdInfo.FIELD_FLAGS] = Long.parseLong(value, 8);
+                        break;
+                    case "mnt_id":
+                        values[offset + FdInfo.FIELD_MOUNT_ID] = Long.parseLong(value);
+                        break;
+                }
+            }
+        } catch (IOException | NumberFormatException ignored) {
+            // the descriptor is not open, or the kernel is too old
+        }
+
+        if (Build.VERSION.SDK_INT >= 21)
+            FdCompat21.fstat(fd, values, offset);
+    }
+
     /**
      * Copy contents of AssetFileDescriptor (with account for size and offset) to given target.
      *
@@ -103,7 +175,7 @@ public final class FdCompat {
      * @param target must refer to ordinary file
      */
     public static void fastCopy(@NonNull AssetFileDescriptor source, @NonNull ParcelFileDescriptor target) throws IOException {
-        final ParcelFileDescriptor dup = Build.VERSION.SDK_INT < 13 ? dupInternal(target) : FdCompat9.dup(target);
+        final ParcelFileDescriptor dup = dup(target);
 
         try (FileChannel fileInputStream = source.createInputStream().getChannel();
              FileChannel output = new FileOutputStream(dup.getFileDescriptor()).getChannel())
@@ -150,6 +222,62 @@ public final class FdCompat {
         return Build.VERSION.SDK_INT < 13 ? createFdInternal(fd) : FdCompat9.createFdInternal(fd);
     }
 
+    /**
+     * Same as {@link ParcelFileDescriptor#dup(FileDescriptor)}, applied to descriptor of ParcelFileDescriptor.
+     * The supplied descriptor remains open.
+     */
+    public static @NonNull ParcelFileDescriptor dup(@NonNull ParcelFileDescriptor fd) throws IOException {
+        return Build.VERSION.SDK_INT < 13 ? dupInternal(fd) : FdCompat9.dup(fd);
+    }
+
+    /**
+     * Wrap each of supplied integer descriptors into ParcelFileDescriptor, that takes ownership of it. Unlike
+     * {@link #adopt(FileDescriptor)} this does not duplicate descriptors, so no system calls are made.
+     *
+     * @param rawFds the descriptors, negative entries are skipped
+     *
+     * @return wrapped descriptors in the same order, with null in place of each negative entry
+     *
+     * @throws IOException if descriptors can not be wrapped, in which case all of them are closed
+     */
+    public static @NonNull ParcelFileDescriptor[] adoptAll(@NonNull int[] rawFds) throws IOException {
+        final ParcelFileDescriptor[] results = new ParcelFileDescriptor[rawFds.length];
+
+        int i = 0;
+        try {
+            for (; i < rawFds.length; i++)
+                if (rawFds[i] >= 0)
+                    results[i] = Build.VERSION.SDK_INT < 13 ? wrapInternal(rawFds[i]) : FdCompat9.createFdInternal(rawFds[i]);
+
+            return results;
+        } catch (IOException | RuntimeException e) {
+            for (ParcelFileDescriptor result : results)
+                if (result != null)
+                    try { result.close(); } catch (IOException ignored) {}
+
+            for (; i < rawFds.length; i++)
+                if (rawFds[i] >= 0)
+                    try { createFdInternal(rawFds[i]).close(); } catch (IOException ignored) {}
+
+            throw e;
+        }
+    }
+
+    /**
+     * Take the integer descriptor away from supplied object, leaving it invalid. The caller becomes responsible
+     * for closing the returned descriptor.
+     */
+    public static int detach(@NonNull FileDescriptor fd) throws IOException {
+        return FdNative.isAvailable() ? FdNative.release(fd) : detachInternal(fd);
+    }
+
+    /**
+     * Same as {@link ParcelFileDescriptor#detachFd()}.
+     */
+    public static int detach(@NonNull ParcelFileDescriptor fd) throws IOException {
+        return Build.VERSION.SDK_INT < 12 ? detach(fd.getFileDescriptor()) : FdCompat9.detachFd(fd);
+    }
+
     /**
      * Same as {@link ParcelFileDescriptor#getFd()}.
      */
@@ -176,7 +304,16 @@ public final class FdCompat {
      * @return {@link RandomAccessFile}, that now owns the given descriptor
      */
     public static @NonNull RandomAccessFile convert(@NonNull FileDescriptor donor) throws IOException {
-        final RandomAccessFile raf = new RandomAccessFile("/dev/null", "rw");
+        return convert(donor, new RandomAccessFile("/dev/null", "rw"));
+    }
+
+    /**
+     * Same as {@link #convert(FileDescriptor)}, but moves the descriptor into supplied RandomAccessFile (such as
+     * instance of a subclass), closing whatever it was opened on.
+     *
+     * @return the recipient
+     */
+    public static @NonNull RandomAccessFile convert(@NonNull FileDescriptor donor, @NonNull RandomAccessFile raf) throws IOException {
         final FileDescriptor recipient = raf.getFD();
 
         // closeDescriptor the /dev/null fd
@@ -269,6 +406,49 @@ public final class FdCompat {
         }
     }
 
+    private static int detachInternal(FileDescriptor fd) throws IOException {
+        try {
+            readCachedField();
+
+            final int value = integerField.getInt(fd);
+            integerField.setInt(fd, -1);
+
+            return value;
+        } catch (Exception e) {
+            throw new IOException("Can not detach descriptor on this Android version: " + e.getMessage());
+        }
+    }
+
+    private static Constructor<ParcelFileDescriptor> wrappingConstructor;
+
+    // the hidden constructor simply takes ownership of FileDescriptor, unlike createFdInternal, which has to
+    // open /dev/null to obtain an instance
+    private static ParcelFileDescriptor wrapInternal(int value) throws IOException {
+        try {
+            if (wrappingConstructor == null) {
+                final Constructor<ParcelFileDescriptor> constructor =
+                        ParcelFileDescriptor.class.getDeclaredConstructor(FileDescriptor.class);
+                constructor.setAccessible(true);
+
+                wrappingConstructor = constructor;
+            }
+
+            final FileDescriptor fd;
+            if (FdNative.isAvailable()) {
+                fd = FdNative.wrap(value);
+            } else {
+                readCachedField();
+
+                fd = new FileDescriptor();
+                integerField.setInt(fd, value);
+            }
+
+            return wrappingConstructor.newInstance(fd);
+        } catch (Exception e) {
+            return createFdInternal(value);
+        }
+    }
+
     private static ParcelFileDescriptor createFdInternal(int value) throws IOException {
         try {
             readCachedField();
@@ -320,6 +500,11 @@ public final class FdCompat {
             return descriptor.getFd();
         }
 
+        @TargetApi(12)
+        static int detachFd(ParcelFileDescriptor descriptor) {
+            return descriptor.detachFd();
+        }
+
         @TargetApi(13)
         static ParcelFileDescriptor createFdInternal(int fd) {
             return ParcelFileDescriptor.adoptFd(fd);
@@ -350,6 +535,28 @@ public final class FdCompat {
         }
     }
 
+    @TargetApi(21)
+    private static final class FdCompat21 {
+        static void fstat(int fd, long[] values, int offset) {
+            final FileDescriptor descriptor = new FileDescriptor();
+            try {
+                readCachedField();
+                integerField.setInt(descriptor, fd);
+
+                final StructStat stat = Os.fstat(descriptor);
+
+                values[offset + FdInfo.FIELD_MODE] = stat.st_mode;
+                values[offset + FdInfo.FIELD_DEV] = stat.st_dev;
+                values[offset + FdInfo.FIELD_INODE] = stat.st_ino;
+                values[offset + FdInfo.FIELD_SIZE] = stat.st_size;
+                // StructStat#st_mtim is not available at compile SDK, nanoseconds come from FdNative#describe
+                values[offset + FdInfo.FIELD_MTIME] = stat.st_mtime * 1000000000L;
+            } catch (Exception ignored) {
+                // leave the values unknown
+            }
+        }
+    }
+
     // those jerks... Making a new exception public will give everyone TONS of hassle and fancy VerifyErrors
     private static final class NotErrnoException extends Exception {
         public NotErrnoException(Throwable throwable) {
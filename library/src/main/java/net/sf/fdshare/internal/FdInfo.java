@@ -0,0 +1,127 @@
+/*
+ * Copyright © 2015 Alexander Rvachev
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+package net.sf.fdshare.internal;
+
+import android.support.annotation.Nullable;
+
+/**
+ * Properties of several descriptors, collected by {@link FdCompat#describeAll} at once. Values are stored
+ * in a single packed array, paths are only collected on request. Unknown values are reported as -1.
+ */
+public final class FdInfo {
+    // layout of each record, must match FIELD_* constants in fdnative.c
+    static final int FIELD_MODE = 0;
+    static final int FIELD_DEV = 1;
+    static final int FIELD_INODE = 2;
+    static final int FIELD_SIZE = 3;
+    static final int FIELD_POSITION = 4;
+    static final int FIELD_FLAGS = 5;
+    static final int FIELD_MOUNT_ID = 6;
+    static final int FIELD_MTIME = 7;
+
+    static final int FIELD_COUNT = 8;
+
+    // st_mode file type bits
+    public static final int S_IFMT = 0170000;
+    public static final int S_IFSOCK = 0140000;
+    public static final int S_IFLNK = 0120000;
+    public static final int S_IFREG = 0100000;
+    public static final int S_IFBLK = 0060000;
+    public static final int S_IFDIR = 0040000;
+    public static final int S_IFCHR = 0020000;
+    public static final int S_IFIFO = 0010000;
+
+    private final long[] values;
+    private final String[] paths;
+
+    FdInfo(long[] values, @Nullable String[] paths) {
+        this.values = values;
+        this.paths = paths;
+    }
+
+    public int size() {
+        return values.length / FIELD_COUNT;
+    }
+
+    /**
+     * @return {@code st_mode}, including file type (one of S_IF* constants) and permission bits
+     */
+    public int getMode(int index) {
+        return (int) get(index, FIELD_MODE);
+    }
+
+    /**
+     * @return file type, one of S_IF* constants, or -1 if unknown
+     */
+    public int getType(int index) {
+        final long mode = get(index, FIELD_MODE);
+
+        return mode == -1 ? -1 : (int) mode & S_IFMT;
+    }
+
+    public long getDevice(int index) {
+        return get(index, FIELD_DEV);
+    }
+
+    public long getInode(int index) {
+        return get(index, FIELD_INODE);
+    }
+
+    public long getSize(int index) {
+        return get(index, FIELD_SIZE);
+    }
+
+    /**
+     * @return time of last modification, in nanoseconds since the epoch; precision depends on file system
+     * (whole seconds, when native library is unavailable)
+     */
+    public long getModified(int index) {
+        return get(index, FIELD_MTIME);
+    }
+
+    /**
+     * @return current file offset
+     */
+    public long getPosition(int index) {
+        return get(index, FIELD_POSITION);
+    }
+
+    /**
+     * @return file status flags and access mode, as passed to {@code open} (in kernel's numbering)
+     */
+    public int getFlags(int index) {
+        return (int) get(index, FIELD_FLAGS);
+    }
+
+    /**
+     * @return id of the mount, containing the file (see {@code /proc/self/mountinfo}), available since Linux 3.15
+     */
+    public int getMountId(int index) {
+        return (int) get(index, FIELD_MOUNT_ID);
+    }
+
+    /**
+     * @return name of the file, as reported by {@code /proc/self/fd}, or null if it was not requested or
+     * is unavailable
+     */
+    public @Nullable String getPath(int index) {
+        return paths == null ? null : paths[index];
+    }
+
+    private long get(int index, int field) {
+        return values[index * FIELD_COUNT + field];
+    }
+}
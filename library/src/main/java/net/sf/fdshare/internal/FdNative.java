@@ -0,0 +1,91 @@
+/*
+ * Copyright © 2015 Alexander Rvachev
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+package net.sf.fdshare.internal;
+
+import android.support.annotation.NonNull;
+import android.support.annotation.Nullable;
+
+import java.io.FileDescriptor;
+
+/**
+ * Optional native counterparts of some {@link FdCompat} methods. The native library may be missing
+ * (e.g. stripped by packaging or unavailable for current ABI), so callers must check {@link #isAvailable}
+ * and fall back to Java implementation.
+ */
+public final class FdNative {
+    public static final String LIBRARY_NAME = "fdshare-jni";
+
+    private static final boolean available;
+
+    static {
+        boolean loaded;
+        try {
+            System.loadLibrary(LIBRARY_NAME);
+
+            loaded = true;
+        } catch (UnsatisfiedLinkError | SecurityException e) {
+            loaded = false;
+        }
+
+        available = loaded;
+    }
+
+    private FdNative() {
+        throw new AssertionError("No instances");
+    }
+
+    public static boolean isAvailable() {
+        return available;
+    }
+
+    /**
+     * Receive data along with descriptors from the socket, using a single {@code recvmsg} call. Unlike
+     * {@link android.net.LocalSocket#getAncillaryFileDescriptors} this does not allocate anything per message
+     * and handles several control messages, received at once. Received descriptors have close-on-exec flag set.
+     *
+     * @param socket connected Unix domain socket
+     * @param fds receives descriptors, remaining entries are set to -1. Excess descriptors are closed
+     *
+     * @return number of received bytes, 0 at end of stream, or negated errno
+     */
+    public static native int receive(@NonNull FileDescriptor socket, @NonNull byte[] data, int offset, int length,
+                                     @NonNull int[] fds);
+
+    /**
+     * Create a FileDescriptor object, referring to (and owning) given integer descriptor.
+     */
+    public static native @NonNull FileDescriptor wrap(int fd);
+
+    /**
+     * Take the integer descriptor away from FileDescriptor object, leaving it invalid.
+     */
+    public static native int release(@NonNull FileDescriptor fd);
+
+    /**
+     * Close given integer descriptors, using a single {@code close_range} call for each contiguous run of them,
+     * if the kernel supports it. The array is sorted in process, negative values are ignored.
+     */
+    public static native void closeAll(@NonNull int[] fds, int count);
+
+    /**
+     * Collect {@code fstat} results, {@code /proc/self/fdinfo} fields and (optionally) paths of given
+     * descriptors in a single call. See {@link FdInfo} for layout of values.
+     *
+     * @param values receives {@link FdInfo#FIELD_COUNT} values per descriptor, -1 for unknown ones
+     * @param paths receives path of each descriptor, or null if paths are not needed
+     */
+    public static native void describe(@NonNull int[] fds, @NonNull long[] values, @Nullable String[] paths);
+}
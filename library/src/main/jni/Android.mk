@@ -3,8 +3,16 @@ LOCAL_PATH := $(call my-dir)
 include $(CLEAR_VARS)
 
 LOCAL_MODULE := fdshare
-LOCAL_SRC_FILES := fdhelper.c
+LOCAL_SRC_FILES := fdhelper.c daemon.c digest.c io.c policy.c request.c tar.c
 LOCAL_LDLIBS := -llog
 LOCAL_CFLAGS := -Os
 
-include $(BUILD_EXECUTABLE)
\ No newline at end of file
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := fdshare-jni
+LOCAL_SRC_FILES := fdnative.c
+LOCAL_CFLAGS := -Os
+
+include $(BUILD_SHARED_LIBRARY)
\ No newline at end of file
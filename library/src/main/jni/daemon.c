@@ -0,0 +1,364 @@
+/*
+ * Copyright © 2015 Alexander Rvachev
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <android/log.h>
+
+#include "daemon.h"
+#include "policy.h"
+
+#define LOG_TAG "fdshare"
+
+#define MAX_POLICY_ENTRIES 256
+#define MAX_CLIENTS 64
+#define MAX_RULES_PATH 128
+
+struct PolicyEntry {
+    uid_t uid;
+    int maxConnections;
+    char rules[MAX_RULES_PATH]; // empty, if the UID is not restricted
+};
+
+struct Client {
+    pid_t pid;
+    uid_t uid;
+};
+
+static struct PolicyEntry policy[MAX_POLICY_ENTRIES];
+static int policySize;
+
+static struct Client clients[MAX_CLIENTS];
+static int clientCount;
+
+static volatile sig_atomic_t reloadRequested;
+static volatile sig_atomic_t childExited;
+
+// a signal, arriving between checking the flags and entering poll(), would otherwise be noticed only
+// with the next connection, so the handler also wakes poll() up through this pipe
+static int signalPipe[2];
+
+static void OnSignal(int signal) {
+    int saved = errno;
+
+    if (signal == SIGHUP)
+        reloadRequested = 1;
+    else
+        childExited = 1;
+
+    write(signalPipe[1], "", 1);
+
+    errno = saved;
+}
+
+// On failure the previous policy is kept.
+static int LoadPolicy(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+        return -1;
+
+    struct PolicyEntry loaded[MAX_POLICY_ENTRIES];
+    int count = 0;
+
+    char line[256];
+    while (fgets(line, sizeof(line), file)) {
+        unsigned long uid;
+        int maxConnections;
+        char rules[MAX_RULES_PATH] = "";
+
+        char *start = line + strspn(line, " \t");
+        if (*start == '#' || *start == '\n' || *start == '\0')
+            continue;
+
+        int fields = sscanf(start, "%lu %d %127s", &uid, &maxConnections, rules);
+
+        if (fields < 2 || maxConnections < 0 || (fields == 3 && rules[0] != '/') || count == MAX_POLICY_ENTRIES) {
+            fclose(file);
+            errno = EINVAL;
+            return -1;
+        }
+
+        loaded[count].uid = (uid_t) uid;
+        loaded[count].maxConnections = maxConnections;
+        strcpy(loaded[count].rules, rules);
+        count++;
+    }
+
+    fclose(file);
+
+    memcpy(policy, loaded, sizeof(struct PolicyEntry) * count);
+    policySize = count;
+
+    return 0;
+}
+
+// Install path policy from the rules file: "allow <access> <pattern>" or "deny <pattern>" on each line, access
+// being any combination of 'r', 'w' and 'c' letters. Called in the client process before serving any request.
+static int LoadRules(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+        return -1;
+
+    int added = 0;
+
+    char line[PATH_MAX + 16];
+    while (fgets(line, sizeof(line), file)) {
+        line[strcspn(line, "\n")] = '\0';
+
+        char *start = line + strspn(line, " \t");
+        if (*start == '#' || *start == '\0')
+            continue;
+
+        int allow = !strncmp(start, "allow ", 6);
+        int access = 0;
+
+        if (allow) {
+            start += 6 + strspn(start + 6, " \t");
+
+            for (; *start && *start != ' ' && *start != '\t'; start++) {
+                switch (*start) {
+                    case 'r': access |= POLICY_READ; break;
+                    case 'w': access |= POLICY_WRITE; break;
+                    case 'c': access |= POLICY_CREATE; break;
+                    default: access = -1; break;
+                }
+            }
+        } else if (!strncmp(start, "deny ", 5)) {
+            start += 5;
+        } else {
+            access = -1;
+        }
+
+        start += strspn(start, " \t");
+
+        if (access < 0 || PolicyAddRule(allow, access, start)) {
+            fclose(file);
+            errno = EINVAL;
+            return -1;
+        }
+
+        added++;
+    }
+
+    fclose(file);
+
+    // a file without rules would leave the client unrestricted
+    if (!added) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return 0;
+}
+
+static const struct PolicyEntry* FindPolicy(uid_t uid) {
+    int i;
+    for (i = 0; i < policySize; i++)
+        if (policy[i].uid == uid)
+            return &policy[i];
+
+    return NULL;
+}
+
+static int CountConnections(uid_t uid) {
+    int i, count = 0;
+    for (i = 0; i < clientCount; i++)
+        if (clients[i].uid == uid)
+            count++;
+
+    return count;
+}
+
+static void ReapChildren() {
+    pid_t pid;
+
+    while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+        int i;
+        for (i = 0; i < clientCount; i++) {
+            if (clients[i].pid == pid) {
+                clients[i] = clients[--clientCount];
+                break;
+            }
+        }
+    }
+}
+
+static int Listen(const char *name) {
+    int sock = socket(PF_LOCAL, SOCK_STREAM, 0);
+    if (sock < 0)
+        return -1;
+
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_LOCAL;
+
+    // abstract namespace, same as used by LocalSocketAddress by default
+    strncpy(address.sun_path + 1, name, sizeof(address.sun_path) - 2);
+
+    socklen_t size = (socklen_t) (sizeof(address) - sizeof(address.sun_path) + strlen(address.sun_path + 1) + 1);
+
+    if (bind(sock, (struct sockaddr *) &address, size) || listen(sock, 16)) {
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+// The reply must not block the daemon, so it is dropped, if it does not fit into socket buffer
+static void Reject(int sock, const char *rejection, ClientHandler handler) {
+    int flags = fcntl(sock, F_GETFL);
+
+    if (flags != -1 && !fcntl(sock, F_SETFL, flags | O_NONBLOCK))
+        handler(sock, rejection);
+
+    close(sock);
+}
+
+static void Accept(int listener, ClientHandler handler) {
+    int sock;
+    do {
+        sock = accept(listener, NULL, NULL);
+    } while (sock < 0 && errno == EINTR);
+
+    if (sock < 0)
+        return;
+
+    struct ucred credentials;
+    socklen_t size = sizeof(credentials);
+    memset(&credentials, 0, sizeof(credentials));
+
+    const struct PolicyEntry *entry = NULL;
+    const char *rejection = NULL;
+
+    if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &credentials, &size)) {
+        __android_log_print(ANDROID_LOG_INFO, LOG_TAG, "Failed to get peer credentials: %s", strerror(errno));
+
+        rejection = "failed to get peer credentials";
+    }
+    else if ((entry = FindPolicy(credentials.uid)) == NULL)
+        rejection = "UID is not allowed";
+    else if (CountConnections(credentials.uid) >= entry->maxConnections)
+        rejection = "too many connections from UID";
+    else if (clientCount == MAX_CLIENTS)
+        rejection = "too many connections";
+
+    if (rejection) {
+        __android_log_print(ANDROID_LOG_INFO, LOG_TAG, "Rejected client (pid %d): %s", credentials.pid, rejection);
+
+        Reject(sock, rejection, handler);
+        return;
+    }
+
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        close(listener);
+        close(signalPipe[0]);
+        close(signalPipe[1]);
+
+        signal(SIGHUP, SIG_DFL);
+        signal(SIGCHLD, SIG_DFL);
+
+        // the policy is in place before the client can send anything, and can not be replaced by it
+        if (entry->rules[0] && LoadRules(entry->rules)) {
+            __android_log_print(ANDROID_LOG_ERROR, LOG_TAG, "Failed to load path policy from %s: %s",
+                                entry->rules, strerror(errno));
+
+            Reject(sock, "failed to load path policy", handler);
+            exit(1);
+        }
+
+        handler(sock, NULL);
+        exit(0);
+    }
+
+    if (pid > 0) {
+        clients[clientCount].pid = pid;
+        clients[clientCount].uid = credentials.uid;
+        clientCount++;
+    } else {
+        Reject(sock, "fork() failed", handler);
+        return;
+    }
+
+    close(sock);
+}
+
+void RunDaemon(const char *name, const char *policyPath, ClientHandler handler) {
+    if (LoadPolicy(policyPath)) {
+        fprintf(stderr, "Error: failed to load policy from %s - %s\n", policyPath, strerror(errno));
+        exit(1);
+    }
+
+    int listener = Listen(name);
+    if (listener < 0) {
+        fprintf(stderr, "Error: failed to listen on %s - %s\n", name, strerror(errno));
+        exit(1);
+    }
+
+    if (pipe(signalPipe)
+            || fcntl(signalPipe[0], F_SETFL, O_NONBLOCK) || fcntl(signalPipe[1], F_SETFL, O_NONBLOCK)) {
+        fprintf(stderr, "Error: failed to create a pipe - %s\n", strerror(errno));
+        exit(1);
+    }
+
+    // no SA_RESTART, so that the signals interrupt poll()
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = OnSignal;
+    sigemptyset(&action.sa_mask);
+
+    sigaction(SIGHUP, &action, NULL);
+    sigaction(SIGCHLD, &action, NULL);
+
+    struct pollfd pfds[2];
+    pfds[0].fd = listener;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = signalPipe[0];
+    pfds[1].events = POLLIN;
+
+    while (1) {
+        char drained[16];
+        while (read(signalPipe[0], drained, sizeof(drained)) > 0);
+
+        if (childExited) {
+            childExited = 0;
+            ReapChildren();
+        }
+
+        if (reloadRequested) {
+            reloadRequested = 0;
+
+            if (LoadPolicy(policyPath))
+                __android_log_print(ANDROID_LOG_ERROR, LOG_TAG, "Failed to reload policy: %s", strerror(errno));
+        }
+
+        if (poll(pfds, 2, -1) > 0 && (pfds[0].revents & POLLIN))
+            Accept(listener, handler);
+    }
+}
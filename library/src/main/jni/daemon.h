@@ -0,0 +1,31 @@
+/*
+ * Copyright © 2015 Alexander Rvachev
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef FDSHARE_DAEMON_H
+#define FDSHARE_DAEMON_H
+
+// Called for each client. When the client is rejected, the handler is called in daemon process with
+// the reason of rejection and a non-blocking socket, and must return without waiting for the client.
+// Otherwise it is called in a forked child with NULL reason and must not return.
+typedef void (*ClientHandler)(int sock, const char *rejection);
+
+// Accept connections on abstract socket with given name, serving each accepted client in it's own process.
+// Clients are identified by UID (SO_PEERCRED). The policy file lists allowed UIDs, one per line, each followed by
+// maximum number of concurrent connections from that UID and optionally by absolute path of a file with path policy
+// rules, installed into client's process before it is served. Empty lines and lines starting with '#' are ignored.
+// The policy is reloaded on SIGHUP. Does not return.
+void RunDaemon(const char *name, const char *policyPath, ClientHandler handler);
+
+#endif
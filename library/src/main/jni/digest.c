@@ -0,0 +1,272 @@
+/*
+ * Copyright © 2015 Alexander Rvachev
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#elif defined(__SSE4_2__)
+#include <nmmintrin.h>
+#endif
+
+#include "digest.h"
+
+// CRC32C (Castagnoli). Uses dedicated CPU instructions, when the compiler is allowed to emit them,
+// and slicing-by-8 tables otherwise.
+
+#define CRC32C_POLY 0x82F63B78u
+
+static uint32_t crcTable[8][256];
+static pthread_once_t crcTableInit = PTHREAD_ONCE_INIT;
+
+static void InitCrcTable() {
+    uint32_t i, j, crc;
+
+    for (i = 0; i < 256; i++) {
+        crc = i;
+        for (j = 0; j < 8; j++)
+            crc = (crc >> 1) ^ (CRC32C_POLY & (0u - (crc & 1)));
+        crcTable[0][i] = crc;
+    }
+
+    for (i = 0; i < 256; i++) {
+        crc = crcTable[0][i];
+        for (j = 1; j < 8; j++) {
+            crc = crcTable[0][crc & 0xff] ^ (crc >> 8);
+            crcTable[j][i] = crc;
+        }
+    }
+}
+
+static uint32_t Crc32cUpdate(uint32_t crc, const unsigned char *data, size_t length) {
+#if defined(__ARM_FEATURE_CRC32)
+    while (length && ((uintptr_t) data & 7)) {
+        crc = __crc32cb(crc, *data++);
+        length--;
+    }
+    while (length >= 8) {
+        crc = __crc32cd(crc, *(const uint64_t *) data);
+        data += 8;
+        length -= 8;
+    }
+    while (length--)
+        crc = __crc32cb(crc, *data++);
+#elif defined(__SSE4_2__)
+    while (length && ((uintptr_t) data & 3)) {
+        crc = _mm_crc32_u8(crc, *data++);
+        length--;
+    }
+    while (length >= 4) {
+        crc = _mm_crc32_u32(crc, *(const uint32_t *) data);
+        data += 4;
+        length -= 4;
+    }
+    while (length--)
+        crc = _mm_crc32_u8(crc, *data++);
+#else
+    while (length && ((uintptr_t) data & 3)) {
+        crc = crcTable[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+        length--;
+    }
+    while (length >= 8) {
+        // little-endian assembly of words, so that this works regardless of host byte order
+        uint32_t lo = crc ^ (data[0] | data[1] << 8 | data[2] << 16 | (uint32_t) data[3] << 24);
+        uint32_t hi = data[4] | data[5] << 8 | data[6] << 16 | (uint32_t) data[7] << 24;
+
+        crc = crcTable[7][lo & 0xff] ^ crcTable[6][(lo >> 8) & 0xff]
+            ^ crcTable[5][(lo >> 16) & 0xff] ^ crcTable[4][lo >> 24]
+            ^ crcTable[3][hi & 0xff] ^ crcTable[2][(hi >> 8) & 0xff]
+            ^ crcTable[1][(hi >> 16) & 0xff] ^ crcTable[0][hi >> 24];
+
+        data += 8;
+        length -= 8;
+    }
+    while (length--)
+        crc = crcTable[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+#endif
+    return crc;
+}
+
+// SHA-256, as per FIPS 180-4
+
+typedef struct {
+    uint32_t state[8];
+    uint64_t length;
+    unsigned char block[64];
+    size_t used;
+} Sha256Ctx;
+
+static const uint32_t K256[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void Sha256Compress(uint32_t *state, const unsigned char *block) {
+    uint32_t w[64];
+    uint32_t a, b, c, d, e, f, g, h, t1, t2;
+    int i;
+
+    for (i = 0; i < 16; i++)
+        w[i] = (uint32_t) block[i * 4] << 24 | block[i * 4 + 1] << 16 | block[i * 4 + 2] << 8 | block[i * 4 + 3];
+
+    for (i = 16; i < 64; i++) {
+        uint32_t s0 = ROR(w[i - 15], 7) ^ ROR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROR(w[i - 2], 17) ^ ROR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    a = state[0]; b = state[1]; c = state[2]; d = state[3];
+    e = state[4]; f = state[5]; g = state[6]; h = state[7];
+
+    for (i = 0; i < 64; i++) {
+        t1 = h + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25)) + ((e & f) ^ (~e & g)) + K256[i] + w[i];
+        t2 = (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+static void Sha256Init(Sha256Ctx *ctx) {
+    static const uint32_t initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+
+    memcpy(ctx->state, initial, sizeof(initial));
+    ctx->length = 0;
+    ctx->used = 0;
+}
+
+static void Sha256Update(Sha256Ctx *ctx, const unsigned char *data, size_t length) {
+    ctx->length += length;
+
+    if (ctx->used) {
+        size_t n = 64 - ctx->used < length ? 64 - ctx->used : length;
+        memcpy(ctx->block + ctx->used, data, n);
+        ctx->used += n;
+        data += n;
+        length -= n;
+
+        if (ctx->used < 64)
+            return;
+
+        Sha256Compress(ctx->state, ctx->block);
+        ctx->used = 0;
+    }
+
+    // compress straight from caller's buffer, avoiding an extra copy
+    while (length >= 64) {
+        Sha256Compress(ctx->state, data);
+        data += 64;
+        length -= 64;
+    }
+
+    memcpy(ctx->block, data, length);
+    ctx->used = length;
+}
+
+static void Sha256Final(Sha256Ctx *ctx, unsigned char *out) {
+    uint64_t bits = ctx->length * 8;
+    int i;
+
+    ctx->block[ctx->used++] = 0x80;
+
+    if (ctx->used > 56) {
+        memset(ctx->block + ctx->used, 0, 64 - ctx->used);
+        Sha256Compress(ctx->state, ctx->block);
+        ctx->used = 0;
+    }
+
+    memset(ctx->block + ctx->used, 0, 56 - ctx->used);
+    for (i = 0; i < 8; i++)
+        ctx->block[56 + i] = (unsigned char) (bits >> (56 - i * 8));
+    Sha256Compress(ctx->state, ctx->block);
+
+    for (i = 0; i < 8; i++) {
+        out[i * 4] = (unsigned char) (ctx->state[i] >> 24);
+        out[i * 4 + 1] = (unsigned char) (ctx->state[i] >> 16);
+        out[i * 4 + 2] = (unsigned char) (ctx->state[i] >> 8);
+        out[i * 4 + 3] = (unsigned char) ctx->state[i];
+    }
+}
+
+int DigestSize(int algorithm) {
+    switch (algorithm) {
+        case DIGEST_CRC32C:
+            return 4;
+        case DIGEST_SHA256:
+            return 32;
+        default:
+            return 0;
+    }
+}
+
+int DigestFd(int algorithm, int fd, unsigned char *buffer, size_t bufferSize, unsigned char *out) {
+    uint32_t crc = 0xFFFFFFFFu;
+    Sha256Ctx sha;
+    ssize_t got;
+
+    if (algorithm == DIGEST_CRC32C)
+        pthread_once(&crcTableInit, InitCrcTable);
+    else if (algorithm == DIGEST_SHA256)
+        Sha256Init(&sha);
+    else
+        return EINVAL;
+
+    for (;;) {
+        got = read(fd, buffer, bufferSize);
+
+        if (got == 0)
+            break;
+
+        if (got < 0) {
+            if (errno == EINTR)
+                continue;
+
+            return errno;
+        }
+
+        if (algorithm == DIGEST_CRC32C)
+            crc = Crc32cUpdate(crc, buffer, (size_t) got);
+        else
+            Sha256Update(&sha, buffer, (size_t) got);
+    }
+
+    if (algorithm == DIGEST_CRC32C) {
+        crc ^= 0xFFFFFFFFu;
+        out[0] = (unsigned char) (crc >> 24);
+        out[1] = (unsigned char) (crc >> 16);
+        out[2] = (unsigned char) (crc >> 8);
+        out[3] = (unsigned char) crc;
+    } else {
+        Sha256Final(&sha, out);
+    }
+
+    return 0;
+}
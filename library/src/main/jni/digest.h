@@ -0,0 +1,34 @@
+/*
+ * Copyright © 2015 Alexander Rvachev
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef FDSHARE_DIGEST_H
+#define FDSHARE_DIGEST_H
+
+#include <stddef.h>
+
+// must match FileDescriptorFactory#HASH_* constants
+#define DIGEST_CRC32C 1
+#define DIGEST_SHA256 2
+
+#define DIGEST_MAX_SIZE 32
+
+// Returns size of digest, produced by given algorithm, or 0 if the algorithm is not supported.
+int DigestSize(int algorithm);
+
+// Read the file from current position until EOF, using supplied buffer, and write it's digest to out.
+// Returns 0 on success or errno value on failure.
+int DigestFd(int algorithm, int fd, unsigned char *buffer, size_t bufferSize, unsigned char *out);
+
+#endif
@@ -15,22 +15,122 @@
  */
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
 #include <unistd.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
+#include <sys/prctl.h>
 #include <sys/uio.h>
 #include <sys/un.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <linux/fanotify.h>
+#include <arpa/inet.h> // htonl
 
+#include <limits.h> // PATH_MAX
 #include <stdlib.h> // exit
 #include <stdio.h> // printf
+#include <stdarg.h>
+#include <ctype.h>
 
 #include <android/log.h>
 
+#include "daemon.h"
+#include "digest.h"
+#include "io.h"
+#include "policy.h"
+#include "request.h"
+#include "tar.h"
+
 #define LOG_TAG "fdshare"
 
+// request opcodes, must match ones in FileDescriptorFactory
+#define OP_OPEN 'o'
+#define OP_HASH 'h'
+#define OP_ARCHIVE 'a'
+#define OP_EXTRACT 'x'
+#define OP_WATCH 'w'
+#define OP_GET_HANDLE 'g'
+#define OP_OPEN_HANDLE 'b'
+#define OP_OPEN_RESOLVED 'r'
+#define OP_OPEN_MANY 'm'
+#define OP_SET_POLICY 'p'
+#define OP_SPAWN 's'
+#define OP_KILL 'k'
+#define OP_READ_HEADERS 'f'
+
+// watch kinds, must match FsWatch constants
+#define WATCH_INOTIFY 0
+#define WATCH_FANOTIFY_FILESYSTEM 1
+#define WATCH_FANOTIFY_MOUNT 2
+
+#define MAX_WATCHES 256 // must match FileDescriptorFactory#MAX_WATCHES
+
+#define MAX_POLICY_RULES 4096
+
+#define MAX_SPAWN_ARGS 4096
+#define MAX_SPAWNED 256
+
+// must match FileDescriptorFactory#MAX_BATCH_OPEN, kept well below SCM_MAX_FD and LocalSocket limits
+#define MAX_BATCH_OPEN 16
+
+// must match FileDescriptorFactory#MAX_HEADER_SIZE and MAX_RESPONSE_SIZE
+#define MAX_HEADER_SIZE 8192
+#define MAX_RESPONSE_SIZE (64 * 1024)
+
+// hex-encoded header, preceded by space, byte count (or negated errno), stat fields and colon
+#define HEADER_RECORD_SIZE(length) ((length) * 2 + 96)
+
+// these are missing from older kernel headers
+#ifndef FAN_REPORT_FID
+#define FAN_REPORT_FID 0x00000200
+#endif
+
+#ifndef FAN_MARK_FILESYSTEM
+#define FAN_MARK_FILESYSTEM 0x00000100
+#endif
+
+#ifndef MAX_HANDLE_SZ
+#define MAX_HANDLE_SZ 128
+#endif
+
+#ifndef __NR_openat2
+#define __NR_openat2 437 // same on all architectures
+#endif
+
+#ifndef __NR_pidfd_open
+#define __NR_pidfd_open 434 // same on all architectures
+#endif
+
+// must match FileDescriptorFactory#RESOLVE_* constants (and linux/openat2.h)
+#define RESOLVE_NO_XDEV 0x01
+#define RESOLVE_NO_MAGICLINKS 0x02
+#define RESOLVE_NO_SYMLINKS 0x04
+#define RESOLVE_BENEATH 0x08
+#define RESOLVE_IN_ROOT 0x10
+
+struct OpenHow {
+    uint64_t flags;
+    uint64_t mode;
+    uint64_t resolve;
+};
+
+// same layout as struct file_handle, which is not defined by older headers
+struct HandleBuffer {
+    unsigned int handle_bytes;
+    int handle_type;
+    unsigned char f_handle[MAX_HANDLE_SZ];
+};
+
+#define MAX_HASH_FILES 4096
+#define MAX_HASH_WORKERS 8
+#define HASH_BUFFER_SIZE (1024 * 1024)
+
 static void DieWithError(const char *errorMessage)  /* Error handling function */
 {
     const char* errDesc = strerror(errno);
@@ -39,37 +139,94 @@ static void DieWithError(const char *errorMessage)  /* Error handling function *
     exit(errno);
 }
 
-static int ancil_send_fds_with_buffer(int sock, int fd)
+// Every message is prefixed with it's length as 4-byte big-endian integer, so that the server can tell
+// messages apart on the stream socket. Descriptors (at most MAX_BATCH_OPEN) are attached to the first byte of message.
+static int ancil_send_fds_with_message(int sock, const int* fds, int count, const char* message)
 {
+    uint32_t length = (uint32_t) strlen(message);
+    uint32_t header = htonl(length);
+
     struct msghdr msghdr;
     msghdr.msg_name = NULL;
     msghdr.msg_namelen = 0;
     msghdr.msg_flags = 0;
 
-    const char* success = "READY";
+    struct iovec iovec[2];
+    iovec[0].iov_base = &header;
+    iovec[0].iov_len = sizeof(header);
+    iovec[1].iov_base = (void*) message;
+    iovec[1].iov_len = length;
 
-    struct iovec iovec;
-    iovec.iov_base = (void*) success;
-    iovec.iov_len = sizeof(success) + 1;
-
-    msghdr.msg_iov = &iovec;
-    msghdr.msg_iovlen = 1;
+    msghdr.msg_iov = iovec;
+    msghdr.msg_iovlen = 2;
 
     union {
         struct cmsghdr  cmsghdr;
-        char        control[CMSG_SPACE(sizeof (int))];
+        char        control[CMSG_SPACE(sizeof (int) * MAX_BATCH_OPEN)];
     } cmsgfds;
-    msghdr.msg_control = cmsgfds.control;
-    msghdr.msg_controllen = sizeof(cmsgfds.control);
 
-    struct cmsghdr  *cmsg;
-    cmsg = CMSG_FIRSTHDR(&msghdr);
-    cmsg->cmsg_len = CMSG_LEN(sizeof (int));
-    cmsg->cmsg_level = SOL_SOCKET;
-    cmsg->cmsg_type = SCM_RIGHTS;
-    *((int *) CMSG_DATA(cmsg)) = fd;
+    if (count) {
+        msghdr.msg_control = cmsgfds.control;
+        msghdr.msg_controllen = CMSG_SPACE(sizeof (int) * count);
+
+        struct cmsghdr  *cmsg;
+        cmsg = CMSG_FIRSTHDR(&msghdr);
+        cmsg->cmsg_len = CMSG_LEN(sizeof (int) * count);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        memcpy(CMSG_DATA(cmsg), fds, sizeof (int) * count);
+    } else {
+        msghdr.msg_control = NULL;
+        msghdr.msg_controllen = 0;
+    }
+
+    ssize_t sent;
+    do {
+        sent = sendmsg(sock, &msghdr, 0);
+    } while (sent < 0 && errno == EINTR);
+
+    if (sent < 0)
+        return -1;
+
+    // stream sockets may accept only a part of long message
+    if ((size_t) sent < sizeof(header))
+        return WriteFully(sock, (const char*) &header + sent, sizeof(header) - sent) || WriteFully(sock, message, length);
+
+    sent -= sizeof(header);
+
+    return (size_t) sent < length ? WriteFully(sock, message + sent, length - sent) : 0;
+}
+
+static int ancil_send_fd_with_message(int sock, int fd, const char* message)
+{
+    return ancil_send_fds_with_message(sock, &fd, 1, message);
+}
+
+static int ancil_send_fds_with_buffer(int sock, int fd)
+{
+    return ancil_send_fd_with_message(sock, fd, "READY");
+}
+
+// Successful responses without descriptor start with "OK"
+static void SendMessage(int sock, const char* message)
+{
+    if (ancil_send_fds_with_message(sock, NULL, 0, message))
+        DieWithError("sending response failed");
+}
+
+// Failure responses start with "Error:"
+static void SendError(int sock, const char* format, ...)
+{
+    char message[PATH_MAX + 128];
+
+    int length = snprintf(message, sizeof(message), "Error: ");
+
+    va_list args;
+    va_start(args, format);
+    vsnprintf(message + length, sizeof(message) - length, format, args);
+    va_end(args);
 
-    return (sendmsg(sock, &msghdr, 0) >= 0 ? 0 : -1);
+    SendMessage(sock, message);
 }
 
 // Fork and get ourselves a tty. Acquired tty will be new stdin,
@@ -146,9 +303,7 @@ static int Bootstrap(char *socket_name) {
     if (connect(sock, (struct sockaddr *) &echoServAddr, size) < 0)
         DieWithError("connect() failed");
 
-    dup2(sock, 1);
-    dup2(sock, 2);
-
+    // stderr is left alone: messages from DieWithError would break framing, so they go to the helper's output
     if (ancil_send_fds_with_buffer(sock, tty))
         DieWithError("sending tty descriptor failed");
 
@@ -163,61 +318,1512 @@ static int Bootstrap(char *socket_name) {
     return sock;
 }
 
-int main(int argc, char *argv[]) {
-    // connect to supplied address and send the greeting message to server
-    int sock = Bootstrap(argv[1]);
+// Requests are read from the socket, see request.h
 
-    // process requests infinitely (we will be killed when done)
-    int* nameLength;
-    char status[3];
+#define MAX_STRING_LENGTH (1024 * 1024)
 
-    while(1) {
-        int nameLength;
-        if (scanf("%d", &nameLength) != 1)
-            DieWithError("reading a filename length failed");
+static void SkipSpaces() {
+    while (isspace(RequestPeek()))
+        RequestGet();
+}
 
-        __android_log_print(ANDROID_LOG_DEBUG, LOG_TAG, "Length is %d", nameLength);
+static char ReadOp() {
+    SkipSpaces();
 
-        char* filename;
-        if ((filename = (char*) calloc(nameLength + 1, 1)) == NULL)
-            DieWithError("calloc() failed");
+    int op = RequestGet();
+    if (op < 0)
+        DieWithError("reading a request failed");
 
-        __android_log_print(ANDROID_LOG_DEBUG, LOG_TAG, "Allocated %d - sized buffer", nameLength + 1);
+    return (char) op;
+}
 
-        if (fgets(filename, nameLength + 1, stdin) == NULL)
-            DieWithError("reading filename failed");
+static int ReadInt() {
+    SkipSpaces();
 
-        __android_log_print(ANDROID_LOG_DEBUG, LOG_TAG, "Attempting to open %s", filename);
+    int negative = RequestPeek() == '-';
+    if (negative)
+        RequestGet();
 
-        int mode;
-        if (scanf("%d", &mode) != 1)
-            DieWithError("reading a mode failed");
+    if (!isdigit(RequestPeek()))
+        DieWithError("reading a number failed");
 
-        // freaking MIPS...
-        if (mode&0x400) {
-            mode ^= 0x400;
-            mode |= O_APPEND;
-        }
+    // values up to UINT32_MAX are accepted for bit masks
+    unsigned long long value = 0;
+    while (isdigit(RequestPeek())) {
+        value = value * 10 + (RequestGet() - '0');
+
+        if (value > 0xFFFFFFFFull)
+            DieWithError("number is out of range");
+    }
+
+    return (int) (negative ? -value : value);
+}
+
+// Strings are sent as decimal byte length, followed by colon and the bytes themselves.
+// The returned buffer is zero-terminated and must be freed by caller.
+static char* ReadString() {
+    int length = ReadInt();
+
+    if (length < 0 || length > MAX_STRING_LENGTH || RequestGet() != ':')
+        DieWithError("reading a string length failed");
+
+    char* str;
+    if ((str = (char*) calloc(length + 1, 1)) == NULL)
+        DieWithError("calloc() failed");
+
+    if (RequestRead(str, length))
+        DieWithError("reading a string failed");
+
+    return str;
+}
+
+// Consume strings of a request, that was rejected by their count, so that following requests are still understood.
+static void SkipStrings(int count) {
+    while (count-- > 0)
+        free(ReadString());
+}
 
-        if (mode&0x40) {
-            mode ^= 0x40;
-            mode |= O_CREAT;
+// Same for requests, made of records, where each character of layout stands for a string ('s') or a number ('i').
+static void SkipRecords(int count, const char* layout) {
+    while (count-- > 0) {
+        const char* field;
+        for (field = layout; *field; field++) {
+            if (*field == 's')
+                free(ReadString());
+            else
+                ReadInt();
         }
+    }
+}
 
-        __android_log_print(ANDROID_LOG_DEBUG, LOG_TAG, "Mode is %d", mode);
+// Run the function on a detached thread. Returns 0 or error number.
+static int StartJob(void* (*job)(void*), void* arg) {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
 
-        int targetFd = open(filename, mode, S_IRWXU|S_IRWXG);
+    pthread_t thread;
+    int err = pthread_create(&thread, &attr, job, arg);
 
-        if (targetFd > 0) {
-            if (ancil_send_fds_with_buffer(sock, targetFd))
-                DieWithError("sending file descriptor failed");
-        } else {
-            fprintf(stderr, "Error: failed to open a file - %s\n", strerror(errno));
+    pthread_attr_destroy(&attr);
+
+    return err;
+}
+
+static int TranslateMode(int mode) {
+    // freaking MIPS...
+    if (mode&0x400) {
+        mode ^= 0x400;
+        mode |= O_APPEND;
+    }
+
+    if (mode&0x40) {
+        mode ^= 0x40;
+        mode |= O_CREAT;
+    }
+
+    return mode;
+}
+
+static const char* ErrorString(int err) {
+    return err == EPOLICY ? "denied by policy" : strerror(err);
+}
+
+static int PolicyAccess(int mode) {
+    int access = 0;
+    int accessMode = mode & O_ACCMODE;
+
+    if (accessMode == O_RDONLY || accessMode == O_RDWR)
+        access |= POLICY_READ;
+
+    if (accessMode != O_RDONLY || (mode & (O_TRUNC | O_APPEND)))
+        access |= POLICY_WRITE;
+
+    if (mode & O_CREAT)
+        access |= POLICY_CREATE;
+
+    return access;
+}
+
+// Check absolute path lexically before opening it, so that nothing is created or truncated at denied location.
+// Relative paths are refused, while a policy is active. Without a path (opening by handle, or relative to other
+// directory) only the opened file can be checked, so creation is refused. Truncation is removed from mode and
+// postponed until PolicyFinishOpen. Returns 0 or -1 with errno set.
+static int PolicyPrepareOpen(const char* path, int* mode) {
+    if (!PolicyIsActive())
+        return 0;
+
+    if (path == NULL) {
+        if (*mode & O_CREAT) {
+            errno = EPOLICY;
+            return -1;
         }
 
-        free(filename);
+        *mode &= ~O_TRUNC;
+
+        return 0;
+    }
+
+    // relative paths are resolved against whatever the helper's working directory happens to be
+    char normalized[PATH_MAX];
+
+    if (PolicyNormalize(path, normalized, sizeof(normalized)) || !PolicyCheck(normalized, PolicyAccess(*mode))) {
+        errno = EPOLICY;
+        return -1;
+    }
+
+    // creating a file through dangling symlink would escape the check below
+    struct stat st;
+    if ((*mode & O_CREAT) && !lstat(path, &st) && S_ISLNK(st.st_mode) && stat(path, &st)) {
+        errno = EPOLICY;
+        return -1;
+    }
+
+    *mode &= ~O_TRUNC;
+
+    return 0;
+}
+
+// Check the file, that was actually opened (after following any symlinks), and perform postponed truncation.
+// Returns the descriptor or -1 with errno set, closing the descriptor.
+static int PolicyFinishOpen(int fd, int mode) {
+    if (fd < 0 || !PolicyIsActive())
+        return fd;
+
+    char procPath[32];
+    char path[PATH_MAX];
+
+    snprintf(procPath, sizeof(procPath), "/proc/self/fd/%d", fd);
+
+    ssize_t length = readlink(procPath, path, sizeof(path) - 1);
+    if (length > 0)
+        path[length] = '\0';
+
+    if (length <= 0 || path[0] != '/' || !PolicyCheck(path, PolicyAccess(mode))) {
+        close(fd);
+        errno = EPOLICY;
+        return -1;
+    }
+
+    if ((mode & O_TRUNC) && ftruncate(fd, 0)) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+
+    return fd;
+}
+
+static int PolicyOpen(const char* path, int mode) {
+    int effectiveMode = mode;
+
+    if (PolicyPrepareOpen(path, &effectiveMode))
+        return -1;
+
+    return PolicyFinishOpen(open(path, effectiveMode, S_IRWXU|S_IRWXG), mode);
+}
+
+// Check a path, used by requests, that do not simply open it. Returns 0 or -1 with errno set.
+static int PolicyCheckPath(const char* path, int access) {
+    if (!PolicyIsActive())
+        return 0;
+
+    char resolved[PATH_MAX];
+
+    // the path may not exist yet (such as extraction target)
+    if (realpath(path, resolved) == NULL && PolicyNormalize(path, resolved, sizeof(resolved))) {
+        errno = EPOLICY;
+        return -1;
+    }
+
+    if (!PolicyCheck(resolved, access)) {
+        errno = EPOLICY;
+        return -1;
+    }
+
+    return 0;
+}
+
+static void HandleOpen(int sock) {
+    char* filename = ReadString();
+
+    __android_log_print(ANDROID_LOG_DEBUG, LOG_TAG, "Attempting to open %s", filename);
+
+    int mode = TranslateMode(ReadInt());
+
+    __android_log_print(ANDROID_LOG_DEBUG, LOG_TAG, "Mode is %d", mode);
+
+    int targetFd = PolicyOpen(filename, mode);
+
+    if (targetFd > 0) {
+        if (ancil_send_fds_with_buffer(sock, targetFd))
+            DieWithError("sending file descriptor failed");
+
         close(targetFd);
+    } else {
+        SendError(sock, "failed to open a file - %s", ErrorString(errno));
     }
 
-    return -1;
-}
\ No newline at end of file
+    free(filename);
+}
+
+struct HashResult {
+    int status;
+    unsigned char digest[DIGEST_MAX_SIZE];
+};
+
+struct HashJob {
+    int algorithm;
+    int count;
+    int output;
+    volatile int next;
+    char** files;
+    struct HashResult* results;
+};
+
+static void FreeHashJob(struct HashJob* job) {
+    int i;
+
+    for (i = 0; i < job->count; i++)
+        free(job->files[i]);
+
+    free(job->files);
+    free(job->results);
+    free(job);
+}
+
+// Each worker grabs the next unprocessed file until none remain, so that one large file
+// does not hold up the rest of the list.
+static void* HashWorker(void* arg) {
+    struct HashJob* job = (struct HashJob*) arg;
+
+    unsigned char* buffer = (unsigned char*) malloc(HASH_BUFFER_SIZE);
+
+    int i;
+    while ((i = __sync_fetch_and_add(&job->next, 1)) < job->count) {
+        struct HashResult* result = &job->results[i];
+
+        if (buffer == NULL) {
+            result->status = ENOMEM;
+            continue;
+        }
+
+        int fd = PolicyOpen(job->files[i], O_RDONLY);
+
+        if (fd < 0) {
+            result->status = errno;
+            continue;
+        }
+
+        result->status = DigestFd(job->algorithm, fd, buffer, HASH_BUFFER_SIZE, result->digest);
+
+        close(fd);
+    }
+
+    free(buffer);
+
+    return NULL;
+}
+
+// Results are written to the pipe in order of the requested files: network-order status (0 or errno),
+// network-order digest length and the digest itself.
+static void* HashJobMain(void* arg) {
+    struct HashJob* job = (struct HashJob*) arg;
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    int workers = cpus > 0 ? (int) cpus : 1;
+    if (workers > MAX_HASH_WORKERS)
+        workers = MAX_HASH_WORKERS;
+    if (workers > job->count)
+        workers = job->count;
+
+    pthread_t threads[MAX_HASH_WORKERS];
+
+    int started = 0;
+    while (started < workers - 1 && !pthread_create(&threads[started], NULL, HashWorker, job))
+        started++;
+
+    // the job thread works too
+    HashWorker(job);
+
+    int i;
+    for (i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    uint32_t digestSize = DigestSize(job->algorithm);
+
+    for (i = 0; i < job->count; i++) {
+        uint32_t header[2];
+        header[0] = htonl(job->results[i].status);
+        header[1] = htonl(job->results[i].status ? 0 : digestSize);
+
+        if (WriteFully(job->output, header, sizeof(header))
+                || (!job->results[i].status && WriteFully(job->output, job->results[i].digest, digestSize))) {
+            __android_log_print(ANDROID_LOG_DEBUG, LOG_TAG, "Hash results were abandoned: %s", strerror(errno));
+            break;
+        }
+    }
+
+    close(job->output);
+
+    FreeHashJob(job);
+
+    return NULL;
+}
+
+static void HandleHash(int sock) {
+    int algorithm = ReadInt();
+    int count = ReadInt();
+
+    if (count < 0 || count > MAX_HASH_FILES) {
+        SkipStrings(count);
+        SendError(sock, "invalid number of files to hash - %d", count);
+        return;
+    }
+
+    struct HashJob* job;
+    if ((job = (struct HashJob*) calloc(1, sizeof(struct HashJob))) == NULL
+            || (job->files = (char**) calloc(count + 1, sizeof(char*))) == NULL
+            || (job->results = (struct HashResult*) calloc(count + 1, sizeof(struct HashResult))) == NULL)
+        DieWithError("calloc() failed");
+
+    job->algorithm = algorithm;
+
+    // the whole request must be consumed, even if it can not be fulfilled
+    for (; job->count < count; job->count++)
+        job->files[job->count] = ReadString();
+
+    if (!DigestSize(algorithm)) {
+        SendError(sock, "unsupported hash algorithm %d", algorithm);
+        FreeHashJob(job);
+        return;
+    }
+
+    int pipeFds[2];
+    if (pipe(pipeFds)) {
+        SendError(sock, "failed to create a pipe - %s", ErrorString(errno));
+        FreeHashJob(job);
+        return;
+    }
+
+    job->output = pipeFds[1];
+
+    int err = StartJob(HashJobMain, job);
+    if (err) {
+        SendError(sock, "failed to start hashing - %s", ErrorString(err));
+        close(pipeFds[0]);
+        close(pipeFds[1]);
+        FreeHashJob(job);
+        return;
+    }
+
+    if (ancil_send_fds_with_buffer(sock, pipeFds[0]))
+        DieWithError("sending file descriptor failed");
+
+    close(pipeFds[0]);
+}
+
+struct TarJob {
+    char* dir;
+    int flags;
+    int stream;
+    int status;
+};
+
+static void FreeTarJob(struct TarJob* job) {
+    if (job->stream >= 0)
+        close(job->stream);
+
+    if (job->status >= 0)
+        close(job->status);
+
+    free(job->dir);
+    free(job);
+}
+
+static void* ArchiveJobMain(void* arg) {
+    struct TarJob* job = (struct TarJob*) arg;
+
+    int err = TarWriteTree(job->dir, job->stream, job->flags);
+    if (err)
+        __android_log_print(ANDROID_LOG_DEBUG, LOG_TAG, "Archiving %s stopped: %s", job->dir, strerror(err));
+
+    FreeTarJob(job);
+
+    return NULL;
+}
+
+// The outcome is written to status pipe as network-order error number, followed by it's description
+static void* ExtractJobMain(void* arg) {
+    struct TarJob* job = (struct TarJob*) arg;
+
+    int err = TarExtract(job->stream, job->dir, job->flags);
+
+    uint32_t status = htonl(err);
+    const char* description = err ? ErrorString(err) : "";
+
+    WriteFully(job->status, &status, sizeof(status));
+    WriteFully(job->status, description, strlen(description));
+
+    FreeTarJob(job);
+
+    return NULL;
+}
+
+static void HandleArchive(int sock) {
+    struct TarJob* job;
+    if ((job = (struct TarJob*) calloc(1, sizeof(struct TarJob))) == NULL)
+        DieWithError("calloc() failed");
+
+    job->dir = ReadString();
+    job->flags = ReadInt();
+    job->status = -1;
+
+    if (PolicyCheckPath(job->dir, POLICY_READ)) {
+        SendError(sock, "failed to start archiving - %s", ErrorString(errno));
+        job->stream = -1;
+        FreeTarJob(job);
+        return;
+    }
+
+    int pipeFds[2];
+    if (pipe(pipeFds)) {
+        SendError(sock, "failed to create a pipe - %s", ErrorString(errno));
+        job->stream = -1;
+        FreeTarJob(job);
+        return;
+    }
+
+    job->stream = pipeFds[1];
+
+    int err = StartJob(ArchiveJobMain, job);
+    if (err) {
+        SendError(sock, "failed to start archiving - %s", ErrorString(err));
+        close(pipeFds[0]);
+        FreeTarJob(job);
+        return;
+    }
+
+    if (ancil_send_fds_with_buffer(sock, pipeFds[0]))
+        DieWithError("sending file descriptor failed");
+
+    close(pipeFds[0]);
+}
+
+// The archive stream descriptor is attached to the request
+static void HandleExtract(int sock) {
+    struct TarJob* job;
+    if ((job = (struct TarJob*) calloc(1, sizeof(struct TarJob))) == NULL)
+        DieWithError("calloc() failed");
+
+    job->stream = RequestTakeFd();
+    if (job->stream < 0)
+        DieWithError("receiving archive descriptor failed");
+
+    job->dir = ReadString();
+    job->flags = ReadInt();
+
+    int err = 0;
+
+    // restored ownership (and setuid bits with it) would let archive contents grant themselves any access
+    if ((job->flags & TAR_RESTORE_OWNERSHIP) && PolicyIsActive())
+        err = EPOLICY;
+    else if (PolicyCheckPath(job->dir, POLICY_WRITE | POLICY_CREATE))
+        err = errno;
+
+    if (err) {
+        SendError(sock, "failed to start extraction - %s", ErrorString(err));
+        job->status = -1;
+        FreeTarJob(job);
+        return;
+    }
+
+    int pipeFds[2];
+    if (pipe(pipeFds)) {
+        SendError(sock, "failed to create a pipe - %s", ErrorString(errno));
+        job->status = -1;
+        FreeTarJob(job);
+        return;
+    }
+
+    job->status = pipeFds[1];
+
+    err = StartJob(ExtractJobMain, job);
+    if (err) {
+        SendError(sock, "failed to start extraction - %s", ErrorString(err));
+        close(pipeFds[0]);
+        FreeTarJob(job);
+        return;
+    }
+
+    if (ancil_send_fds_with_buffer(sock, pipeFds[0]))
+        DieWithError("sending file descriptor failed");
+
+    close(pipeFds[0]);
+}
+
+static int FanotifyMark(int fd, unsigned flags, uint64_t mask, const char* path) {
+#if defined(__LP64__)
+    return (int) syscall(__NR_fanotify_mark, fd, flags, mask, AT_FDCWD, path);
+#else
+    // the 64-bit mask is split in two registers (all supported 32-bit ABIs are little-endian)
+    return (int) syscall(__NR_fanotify_mark, fd, flags, (uint32_t) mask, (uint32_t) (mask >> 32), AT_FDCWD, path);
+#endif
+}
+
+// Sends back the notification descriptor along with space-separated watch descriptors for each path
+// (inotify) or zeros (fanotify). Watches, that could not be added, are reported as negated errno values.
+static void HandleWatch(int sock) {
+    int kind = ReadInt();
+    uint32_t mask = (uint32_t) ReadInt();
+    int count = ReadInt();
+
+    if (count < 0 || count > MAX_WATCHES) {
+        SkipStrings(count);
+        SendError(sock, "invalid number of paths to watch - %d", count);
+        return;
+    }
+
+    char** paths;
+    if ((paths = (char**) calloc(count + 1, sizeof(char*))) == NULL)
+        DieWithError("calloc() failed");
+
+    int i;
+    for (i = 0; i < count; i++)
+        paths[i] = ReadString();
+
+    int notifyFd;
+
+    switch (kind) {
+        case WATCH_INOTIFY:
+            notifyFd = inotify_init();
+            break;
+        case WATCH_FANOTIFY_FILESYSTEM:
+        case WATCH_FANOTIFY_MOUNT:
+            // these marks cover the whole filesystem (mount) and not just the paths, that policy allows
+            if (PolicyIsActive()) {
+                notifyFd = -1;
+                errno = EPOLICY;
+                break;
+            }
+
+            // with FAN_REPORT_FID events carry file handles instead of open descriptors
+            notifyFd = (int) syscall(__NR_fanotify_init, FAN_CLASS_NOTIF | FAN_REPORT_FID, O_RDONLY);
+            break;
+        default:
+            notifyFd = -1;
+            errno = EINVAL;
+    }
+
+    if (notifyFd < 0) {
+        SendError(sock, "failed to create notification descriptor - %s", ErrorString(errno));
+    } else {
+        char* message = (char*) malloc(6 + count * 12 + 1);
+        if (message == NULL)
+            DieWithError("malloc() failed");
+
+        int length = sprintf(message, "READY");
+
+        for (i = 0; i < count; i++) {
+            int result;
+
+            if (PolicyCheckPath(paths[i], POLICY_READ)) {
+                result = -1;
+            } else if (kind == WATCH_INOTIFY) {
+                result = inotify_add_watch(notifyFd, paths[i], mask);
+            } else {
+                unsigned flags = FAN_MARK_ADD | (kind == WATCH_FANOTIFY_MOUNT ? FAN_MARK_MOUNT : FAN_MARK_FILESYSTEM);
+
+                result = FanotifyMark(notifyFd, flags, mask, paths[i]);
+            }
+
+            length += sprintf(message + length, " %d", result < 0 ? -errno : result);
+        }
+
+        if (ancil_send_fd_with_message(sock, notifyFd, message))
+            DieWithError("sending file descriptor failed");
+
+        free(message);
+        close(notifyFd);
+    }
+
+    for (i = 0; i < count; i++)
+        free(paths[i]);
+
+    free(paths);
+}
+
+// Find mount point with given id in /proc/self/mountinfo. Returns 0 on success.
+static int FindMountPoint(int mountId, char* mountPoint, size_t size) {
+    FILE* mountInfo = fopen("/proc/self/mountinfo", "r");
+    if (mountInfo == NULL)
+        return errno;
+
+    char line[PATH_MAX * 2];
+    char escaped[PATH_MAX];
+    int found = 0;
+
+    while (!found && fgets(line, sizeof(line), mountInfo)) {
+        int id;
+        if (sscanf(line, "%d %*d %*s %*s %4095s", &id, escaped) == 2 && id == mountId)
+            found = 1;
+    }
+
+    fclose(mountInfo);
+
+    if (!found)
+        return ENOENT;
+
+    // spaces, tabs, newlines and backslashes are escaped as octal
+    size_t i = 0;
+    const char* c = escaped;
+    while (*c && i + 1 < size) {
+        if (c[0] == '\\' && c[1] >= '0' && c[1] <= '3' && c[2] >= '0' && c[2] <= '7' && c[3] >= '0' && c[3] <= '7') {
+            mountPoint[i++] = (char) ((c[1] - '0') << 6 | (c[2] - '0') << 3 | (c[3] - '0'));
+            c += 4;
+        } else {
+            mountPoint[i++] = *c++;
+        }
+    }
+    mountPoint[i] = '\0';
+
+    return 0;
+}
+
+// Responds with "OK <handle type> <hex handle bytes> <mount point>"
+static void HandleGetHandle(int sock) {
+    char* filename = ReadString();
+    int follow = ReadInt();
+
+    struct HandleBuffer handle;
+    handle.handle_bytes = MAX_HANDLE_SZ;
+
+    int mountId, err = 0;
+    char mountPoint[PATH_MAX];
+
+    if (PolicyCheckPath(filename, POLICY_READ))
+        err = errno;
+    else if (syscall(__NR_name_to_handle_at, AT_FDCWD, filename, &handle, &mountId, follow ? AT_SYMLINK_FOLLOW : 0))
+        err = errno;
+    else
+        err = FindMountPoint(mountId, mountPoint, sizeof(mountPoint));
+
+    if (err) {
+        SendError(sock, "failed to get file handle - %s", ErrorString(err));
+    } else {
+        char* message = (char*) malloc(32 + handle.handle_bytes * 2 + strlen(mountPoint));
+        if (message == NULL)
+            DieWithError("malloc() failed");
+
+        int length = sprintf(message, "OK %d ", handle.handle_type);
+
+        unsigned i;
+        for (i = 0; i < handle.handle_bytes; i++)
+            length += sprintf(message + length, "%02x", handle.f_handle[i]);
+
+        sprintf(message + length, " %s", mountPoint);
+
+        SendMessage(sock, message);
+
+        free(message);
+    }
+
+    free(filename);
+}
+
+static int ParseHex(const char* hex, unsigned char* out, size_t size) {
+    size_t length = strlen(hex);
+
+    if (length % 2 || length / 2 > size)
+        return -1;
+
+    size_t i;
+    for (i = 0; i < length / 2; i++) {
+        unsigned value;
+        if (sscanf(hex + i * 2, "%2x", &value) != 1)
+            return -1;
+
+        out[i] = (unsigned char) value;
+    }
+
+    return (int) (length / 2);
+}
+
+static void HandleOpenHandle(int sock) {
+    int type = ReadInt();
+    char* hex = ReadString();
+    char* mountPoint = ReadString();
+    int mode = TranslateMode(ReadInt());
+
+    struct HandleBuffer handle;
+    handle.handle_type = type;
+
+    int size = ParseHex(hex, handle.f_handle, sizeof(handle.f_handle));
+
+    int targetFd = -1;
+
+    if (size < 0) {
+        errno = EINVAL;
+    } else {
+        handle.handle_bytes = (unsigned) size;
+
+        // there is no path to check in advance, the opened file is checked instead
+        int effectiveMode = mode;
+        int mountFd = PolicyPrepareOpen(NULL, &effectiveMode) ? -1 : open(mountPoint, O_RDONLY | O_DIRECTORY);
+
+        if (mountFd >= 0) {
+            targetFd = PolicyFinishOpen((int) syscall(__NR_open_by_handle_at, mountFd, &handle, effectiveMode), mode);
+
+            int saved = errno;
+            close(mountFd);
+            errno = saved;
+        }
+    }
+
+    if (targetFd >= 0) {
+        if (ancil_send_fds_with_buffer(sock, targetFd))
+            DieWithError("sending file descriptor failed");
+
+        close(targetFd);
+    } else {
+        SendError(sock, "failed to open a file by handle - %s", ErrorString(errno));
+    }
+
+    free(hex);
+    free(mountPoint);
+}
+
+// Poor man's openat2 for kernels before 5.6: walk the path one component at a time, refusing to traverse
+// any symlinks or "..". This is stricter than any combination of RESOLVE_* flags, but never weaker.
+static int OpenByWalking(int dirFd, const char* path, int mode, int resolve) {
+    if (path[0] == '/' && (resolve & (RESOLVE_BENEATH | RESOLVE_IN_ROOT))) {
+        errno = EXDEV;
+        return -1;
+    }
+
+    char* copy = strdup(path);
+    if (copy == NULL)
+        return -1;
+
+    struct stat rootStat;
+    int current = path[0] == '/' ? open("/", O_RDONLY | O_DIRECTORY) : dup(dirFd);
+
+    if (current >= 0 && (resolve & RESOLVE_NO_XDEV) && fstat(current, &rootStat)) {
+        close(current);
+        current = -1;
+    }
+
+    char* component = copy;
+    while (current >= 0) {
+        while (*component == '/')
+            component++;
+
+        char* end = component + strcspn(component, "/");
+        char* rest = end;
+        while (*rest == '/')
+            rest++;
+
+        int last = *rest == '\0';
+
+        *end = '\0';
+
+        if (!strcmp(component, "..")) {
+            close(current);
+            current = -1;
+            errno = EXDEV;
+            break;
+        }
+
+        const char* name = *component ? component : ".";
+
+        int next;
+        if (last)
+            next = openat(current, name, mode | O_NOFOLLOW, S_IRWXU|S_IRWXG);
+        else
+            next = openat(current, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+
+        if (next < 0 && errno == ENOTDIR && !last)
+            errno = ELOOP; // most likely a symlink
+
+        int saved = errno;
+        close(current);
+        errno = saved;
+
+        current = next;
+
+        if (current >= 0 && (resolve & RESOLVE_NO_XDEV)) {
+            struct stat st;
+            if (fstat(current, &st) || st.st_dev != rootStat.st_dev) {
+                close(current);
+                current = -1;
+                errno = EXDEV;
+            }
+        }
+
+        if (last)
+            break;
+
+        component = rest;
+    }
+
+    free(copy);
+
+    return current;
+}
+
+// Responds with the descriptor and it's canonical path: "READY <path>"
+static void HandleOpenResolved(int sock) {
+    char* base = ReadString();
+    char* filename = ReadString();
+    int mode = TranslateMode(ReadInt());
+    int resolve = ReadInt();
+
+    int dirFd = *base ? open(base, O_RDONLY | O_DIRECTORY) : AT_FDCWD;
+    int targetFd = -1;
+
+    // relative paths (and absolute ones with RESOLVE_IN_ROOT) depend on base, so only the opened file can be checked
+    int effectiveMode = mode;
+    int denied = PolicyPrepareOpen(filename[0] == '/' && !(resolve & RESOLVE_IN_ROOT) ? filename : NULL,
+                                   &effectiveMode);
+
+    if (denied) {
+        if (dirFd >= 0)
+            close(dirFd);
+
+        errno = EPOLICY;
+    } else if (dirFd >= 0 || dirFd == AT_FDCWD) {
+        struct OpenHow how;
+        memset(&how, 0, sizeof(how));
+        how.flags = (uint64_t) effectiveMode;
+        how.mode = (mode & O_CREAT) ? S_IRWXU|S_IRWXG : 0;
+        how.resolve = (uint64_t) resolve;
+
+        targetFd = (int) syscall(__NR_openat2, dirFd, filename, &how, sizeof(how));
+
+        if (targetFd < 0 && (errno == ENOSYS || errno == E2BIG) && !resolve) {
+            targetFd = openat(dirFd, filename, effectiveMode, S_IRWXU|S_IRWXG);
+        } else if (targetFd < 0 && (errno == ENOSYS || errno == E2BIG)) {
+            int walkFd = dirFd == AT_FDCWD ? open(".", O_RDONLY | O_DIRECTORY) : dirFd;
+
+            targetFd = walkFd >= 0 ? OpenByWalking(walkFd, filename, effectiveMode, resolve) : -1;
+
+            int saved = errno;
+            if (walkFd != dirFd && walkFd >= 0)
+                close(walkFd);
+            errno = saved;
+        }
+
+        int saved = errno;
+        if (dirFd >= 0)
+            close(dirFd);
+        errno = saved;
+
+        targetFd = PolicyFinishOpen(targetFd, mode);
+    }
+
+    if (targetFd >= 0) {
+        char procPath[32];
+        char message[PATH_MAX + 8];
+
+        snprintf(procPath, sizeof(procPath), "/proc/self/fd/%d", targetFd);
+
+        strcpy(message, "READY ");
+
+        ssize_t length = readlink(procPath, message + 6, PATH_MAX);
+        message[length > 0 ? 6 + length : 5] = '\0';
+
+        if (ancil_send_fd_with_message(sock, targetFd, message))
+            DieWithError("sending file descriptor failed");
+
+        close(targetFd);
+    } else {
+        SendError(sock, "failed to open a file - %s", ErrorString(errno));
+    }
+
+    free(base);
+    free(filename);
+}
+
+// Open several files at once, sending all successfully opened descriptors in a single message.
+// The response lists index of descriptor in the message or negated errno for each requested file.
+static void HandleOpenMany(int sock) {
+    int count = ReadInt();
+
+    if (count <= 0 || count > MAX_BATCH_OPEN) {
+        SkipRecords(count, "si");
+        SendError(sock, "invalid number of files to open - %d", count);
+        return;
+    }
+
+    int fds[MAX_BATCH_OPEN];
+    int opened = 0;
+
+    char results[MAX_BATCH_OPEN * 12 + 1];
+    int length = 0;
+
+    int i;
+    for (i = 0; i < count; i++) {
+        char* filename = ReadString();
+        int mode = TranslateMode(ReadInt());
+
+        int targetFd = PolicyOpen(filename, mode);
+
+        if (targetFd >= 0) {
+            length += sprintf(results + length, " %d", opened);
+            fds[opened++] = targetFd;
+        } else {
+            length += sprintf(results + length, " %d", -errno);
+        }
+
+        free(filename);
+    }
+
+    results[length] = '\0';
+
+    char message[sizeof(results) + 6];
+    sprintf(message, "%s%s", opened ? "READY" : "OK", results);
+
+    if (opened) {
+        if (ancil_send_fds_with_message(sock, fds, opened, message))
+            DieWithError("sending file descriptors failed");
+
+        for (i = 0; i < opened; i++)
+            close(fds[i]);
+    } else {
+        SendMessage(sock, message);
+    }
+}
+
+// Reply with first bytes of each file inline, so that sniffing the type of file takes neither a descriptor
+// nor a separate read by the client. Each file is reported as " <count>,<dev>,<inode>,<size>,<mtime>:<hex bytes>"
+// (mtime in nanoseconds) or " -<errno>:".
+static void HandleReadHeaders(int sock) {
+    int length = ReadInt();
+    int count = ReadInt();
+
+    if (length <= 0 || length > MAX_HEADER_SIZE || count <= 0 || count > MAX_BATCH_OPEN
+            || count * HEADER_RECORD_SIZE(length) + 8 > MAX_RESPONSE_SIZE) {
+        SkipStrings(count);
+        SendError(sock, "invalid header request - %d files of %d bytes", count, length);
+        return;
+    }
+
+    char* message = (char*) malloc(count * HEADER_RECORD_SIZE(length) + 8);
+    if (message == NULL)
+        DieWithError("malloc() failed");
+
+    unsigned char header[MAX_HEADER_SIZE];
+
+    int used = sprintf(message, "OK");
+
+    int i;
+    for (i = 0; i < count; i++) {
+        char* filename = ReadString();
+
+        // non-blocking, so that opening a FIFO does not stall the helper
+        int fd = PolicyOpen(filename, O_RDONLY | O_NONBLOCK | O_NOCTTY);
+
+        ssize_t got = -1;
+        struct stat st;
+
+        if (fd >= 0) {
+            if (fstat(fd, &st))
+                got = -1;
+            else if (!S_ISREG(st.st_mode))
+                errno = EINVAL;
+            else
+                got = ReadFully(fd, header, (size_t) length);
+
+            int saved = errno;
+            close(fd);
+            errno = saved;
+        }
+
+        if (got < 0) {
+            used += sprintf(message + used, " %d:", -errno);
+        } else {
+            used += sprintf(message + used, " %d,%lld,%lld,%lld,%lld:", (int) got, (long long) st.st_dev,
+                            (long long) st.st_ino, (long long) st.st_size,
+                            (long long) st.st_mtim.tv_sec * 1000000000ll + st.st_mtim.tv_nsec);
+
+            ssize_t j;
+            for (j = 0; j < got; j++)
+                used += sprintf(message + used, "%02x", header[j]);
+        }
+
+        free(filename);
+    }
+
+    SendMessage(sock, message);
+
+    free(message);
+}
+
+// Install path policy, that applies to all subsequent requests. The policy can not be changed afterwards.
+static void HandleSetPolicy(int sock) {
+    int count = ReadInt();
+
+    // the installed policy (if any) is left as is
+    if (count <= 0 || count > MAX_POLICY_RULES) {
+        SkipRecords(count, "iis");
+        SendError(sock, "invalid number of policy rules - %d", count);
+        return;
+    }
+
+    int installed = PolicyIsActive();
+    int err = installed ? EPERM : 0;
+
+    int i;
+    for (i = 0; i < count; i++) {
+        int allow = ReadInt();
+        int access = ReadInt();
+        char* pattern = ReadString();
+
+        if (!installed && !err && PolicyAddRule(allow, access, pattern))
+            err = errno;
+
+        free(pattern);
+    }
+
+    if (err) {
+        // if some rules were added, everything else is denied, which is the safest outcome
+        SendError(sock, "failed to install policy - %s", installed ? "policy is already installed" : strerror(err));
+    } else {
+        SendMessage(sock, "OK");
+    }
+}
+
+// Processes, started by spawn requests, that were not reaped yet. Only these can be signalled by kill requests.
+static pid_t spawned[MAX_SPAWNED];
+static int spawnedCount;
+static pthread_mutex_t spawnedLock = PTHREAD_MUTEX_INITIALIZER;
+
+static void Unregister(pid_t pid) {
+    pthread_mutex_lock(&spawnedLock);
+
+    int i;
+    for (i = 0; i < spawnedCount; i++) {
+        if (spawned[i] == pid) {
+            spawned[i] = spawned[--spawnedCount];
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&spawnedLock);
+}
+
+struct SpawnJob {
+    pid_t pid;
+    int status;
+};
+
+// Reap the child and write it's exit code (or 128 + signal number) to status pipe as network-order integer
+static void* SpawnJobMain(void* arg) {
+    struct SpawnJob* job = (struct SpawnJob*) arg;
+
+    // wait without reaping, so that the pid can't be reused, while kill requests may still target it
+    siginfo_t info;
+    int err;
+    do {
+        err = waitid(P_PID, (id_t) job->pid, &info, WEXITED | WNOWAIT);
+    } while (err && errno == EINTR);
+
+    Unregister(job->pid);
+
+    int status;
+    pid_t reaped;
+    do {
+        reaped = waitpid(job->pid, &status, 0);
+    } while (reaped < 0 && errno == EINTR);
+
+    if (reaped == job->pid) {
+        uint32_t code = htonl(WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+        WriteFully(job->status, &code, sizeof(code));
+    }
+
+    close(job->status);
+    free(job);
+
+    return NULL;
+}
+
+// Search PATH the same way as execvp, but before forking: the child may only use async-signal-safe functions
+static int ResolveExecutable(const char* name, const char* path, char* result, size_t size) {
+    if (strchr(name, '/')) {
+        snprintf(result, size, "%s", name);
+        return 0;
+    }
+
+    const char* dir = path ? path : "/system/bin:/system/xbin";
+    while (*dir) {
+        size_t length = strcspn(dir, ":");
+
+        if (length && length + strlen(name) + 2 <= size) {
+            snprintf(result, size, "%.*s/%s", (int) length, dir, name);
+            if (access(result, X_OK) == 0)
+                return 0;
+        }
+
+        dir += length + (dir[length] == ':');
+    }
+
+    errno = ENOENT;
+    return -1;
+}
+
+// Runs in forked child of possibly multithreaded helper. On failure errno is written to the error pipe.
+static void ExecChild(const char* file, char** argv, char** env, const char* cwd, const int* stdio,
+                      int errorPipe, int maxFd, pid_t parent) {
+    sigset_t none;
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, NULL);
+
+    // a daemon has no terminal to deliver SIGHUP, so the child asks for it on the helper's death itself
+    if (prctl(PR_SET_PDEATHSIG, SIGHUP) || getppid() != parent)
+        kill(getpid(), SIGHUP);
+
+    // ignored signals stay ignored after exec
+    signal(SIGPIPE, SIG_DFL);
+
+    int fd;
+    for (fd = 0; fd < 3; fd++)
+        if (dup2(stdio[fd], fd) < 0)
+            goto failed;
+
+    if (dup2(errorPipe, 3) < 0 || fcntl(3, F_SETFD, FD_CLOEXEC))
+        goto failed;
+
+    // the helper's own descriptors (such as socket to server) must not leak into the child
+    for (fd = 4; fd < maxFd; fd++)
+        close(fd);
+
+    if (*cwd && chdir(cwd))
+        goto failed;
+
+    execve(file, argv, env);
+
+failed:
+    fd = errno;
+    WriteFully(3, &fd, sizeof(fd));
+    _exit(127);
+}
+
+static void FreeStrings(char** strings, int count) {
+    int i;
+    for (i = 0; i < count; i++)
+        free(strings[i]);
+    free(strings);
+}
+
+static char** ReadStrings(int count) {
+    char** strings;
+    if ((strings = (char**) calloc(count + 1, sizeof(char*))) == NULL)
+        DieWithError("calloc() failed");
+
+    int i;
+    for (i = 0; i < count; i++)
+        strings[i] = ReadString();
+
+    return strings;
+}
+
+static void ClosePipes(int pipes[][2], int count) {
+    int i;
+    for (i = 0; i < count; i++) {
+        if (pipes[i][0] >= 0)
+            close(pipes[i][0]);
+        if (pipes[i][1] >= 0)
+            close(pipes[i][1]);
+    }
+}
+
+// Start a command as root. The response carries pipes, connected to it's stdin, stdout and stderr, a status pipe,
+// that receives the exit code, and pidfd of the child, if supported by kernel.
+static int Spawn(char** argv, char** env, const char* cwd, int* fds, pid_t* childPid) {
+    const char* path = getenv("PATH");
+    int i;
+
+    if (env) {
+        for (i = 0; env[i]; i++)
+            if (!strncmp(env[i], "PATH=", 5))
+                path = env[i] + 5;
+    }
+
+    char file[PATH_MAX];
+    if (ResolveExecutable(argv[0], path, file, sizeof(file)))
+        return -1;
+
+    // stdin, stdout, stderr, status, exec error
+    int pipes[5][2];
+    for (i = 0; i < 5; i++)
+        pipes[i][0] = pipes[i][1] = -1;
+
+    for (i = 0; i < 5; i++) {
+        if (pipe(pipes[i])) {
+            int err = errno;
+            ClosePipes(pipes, 5);
+            errno = err;
+            return -1;
+        }
+    }
+
+    pthread_mutex_lock(&spawnedLock);
+    int full = spawnedCount == MAX_SPAWNED;
+    pthread_mutex_unlock(&spawnedLock);
+
+    if (full) {
+        ClosePipes(pipes, 5);
+        errno = EAGAIN;
+        return -1;
+    }
+
+    int maxFd = (int) sysconf(_SC_OPEN_MAX);
+    pid_t parent = getpid();
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        int err = errno;
+        ClosePipes(pipes, 5);
+        errno = err;
+        return -1;
+    }
+
+    if (pid == 0) {
+        int stdio[3] = { pipes[0][0], pipes[1][1], pipes[2][1] };
+        extern char** environ;
+
+        ExecChild(file, argv, env ? env : environ, cwd, stdio, pipes[4][1], maxFd, parent);
+    }
+
+    // until the reaper is started, the child can't be reaped, so the pid still refers to it
+    int pidFd = (int) syscall(__NR_pidfd_open, pid, 0);
+
+    pthread_mutex_lock(&spawnedLock);
+    spawned[spawnedCount++] = pid;
+    pthread_mutex_unlock(&spawnedLock);
+
+    close(pipes[0][0]);
+    close(pipes[1][1]);
+    close(pipes[2][1]);
+    close(pipes[4][1]);
+
+    // the error pipe is closed on successful exec
+    int err = 0;
+    ssize_t got;
+    do {
+        got = read(pipes[4][0], &err, sizeof(err));
+    } while (got < 0 && errno == EINTR);
+
+    close(pipes[4][0]);
+
+    struct SpawnJob* job;
+    if ((job = (struct SpawnJob*) calloc(1, sizeof(struct SpawnJob))) == NULL)
+        DieWithError("calloc() failed");
+
+    job->pid = pid;
+    job->status = pipes[3][1];
+
+    int jobErr = StartJob(SpawnJobMain, job);
+
+    if (got == sizeof(err) || jobErr) {
+        if (jobErr) {
+            kill(pid, SIGKILL);
+            waitpid(pid, NULL, 0);
+            Unregister(pid);
+            close(job->status);
+            free(job);
+        }
+
+        close(pipes[0][1]);
+        close(pipes[1][0]);
+        close(pipes[2][0]);
+        close(pipes[3][0]);
+
+        if (pidFd >= 0)
+            close(pidFd);
+
+        errno = got == sizeof(err) ? err : jobErr;
+        return -1;
+    }
+
+    fds[0] = pipes[0][1];
+    fds[1] = pipes[1][0];
+    fds[2] = pipes[2][0];
+    fds[3] = pipes[3][0];
+    fds[4] = pidFd;
+
+    *childPid = pid;
+
+    return fds[4] >= 0 ? 5 : 4;
+}
+
+static void HandleSpawn(int sock) {
+    // the rest of rejected request (environment and working directory) is skipped as well
+    int argc = ReadInt();
+    if (argc <= 0 || argc > MAX_SPAWN_ARGS) {
+        SkipStrings(argc);
+        SkipStrings(ReadInt());
+        SkipStrings(1);
+        SendError(sock, "invalid number of arguments - %d", argc);
+        return;
+    }
+
+    char** argv = ReadStrings(argc);
+
+    // negative count of variables means inheriting the helper's environment
+    int envc = ReadInt();
+    if (envc > MAX_SPAWN_ARGS) {
+        FreeStrings(argv, argc);
+        SkipStrings(envc);
+        SkipStrings(1);
+        SendError(sock, "invalid number of environment variables - %d", envc);
+        return;
+    }
+
+    char** env = envc >= 0 ? ReadStrings(envc) : NULL;
+
+    char* cwd = ReadString();
+
+    int fds[5];
+    pid_t pid;
+    int count;
+
+    // commands can access any file, so they are never allowed by path policy
+    if (PolicyIsActive()) {
+        errno = EPOLICY;
+        count = -1;
+    } else {
+        count = Spawn(argv, env, cwd, fds, &pid);
+    }
+
+    if (count < 0) {
+        SendError(sock, "failed to spawn %s - %s", argv[0], ErrorString(errno));
+    } else {
+        char message[32];
+        sprintf(message, "READY %d", (int) pid);
+
+        if (ancil_send_fds_with_message(sock, fds, count, message))
+            DieWithError("sending file descriptors failed");
+
+        int i;
+        for (i = 0; i < count; i++)
+            close(fds[i]);
+    }
+
+    FreeStrings(argv, argc);
+    if (env)
+        FreeStrings(env, envc);
+    free(cwd);
+}
+
+// Signal a process, started by spawn request. The server can't do so itself, because the process runs as root.
+static void HandleKill(int sock) {
+    pid_t pid = (pid_t) ReadInt();
+    int signum = ReadInt();
+
+    int found = 0;
+
+    pthread_mutex_lock(&spawnedLock);
+
+    int i;
+    for (i = 0; i < spawnedCount; i++)
+        if (spawned[i] == pid)
+            found = 1;
+
+    // the pid can't be reused before the reaper unregisters it, see SpawnJobMain
+    int err = !found ? ESRCH : kill(pid, signum) ? errno : 0;
+
+    pthread_mutex_unlock(&spawnedLock);
+
+    if (err)
+        SendError(sock, "failed to signal process %d - %s", (int) pid, strerror(err));
+    else
+        SendMessage(sock, "OK");
+}
+
+// Process requests infinitely (we will be killed when done)
+static void ServeRequests(int sock) {
+    // the tty, if any, is only kept to deliver SIGHUP, requests are sent over the socket
+    RequestReaderInit(sock);
+
+    while(1) {
+        char op = ReadOp();
+
+        switch (op) {
+            case OP_OPEN:
+                HandleOpen(sock);
+                break;
+            case OP_HASH:
+                HandleHash(sock);
+                break;
+            case OP_ARCHIVE:
+                HandleArchive(sock);
+                break;
+            case OP_EXTRACT:
+                HandleExtract(sock);
+                break;
+            case OP_WATCH:
+                HandleWatch(sock);
+                break;
+            case OP_GET_HANDLE:
+                HandleGetHandle(sock);
+                break;
+            case OP_OPEN_HANDLE:
+                HandleOpenHandle(sock);
+                break;
+            case OP_OPEN_RESOLVED:
+                HandleOpenResolved(sock);
+                break;
+            case OP_OPEN_MANY:
+                HandleOpenMany(sock);
+                break;
+            case OP_SET_POLICY:
+                HandleSetPolicy(sock);
+                break;
+            case OP_SPAWN:
+                HandleSpawn(sock);
+                break;
+            case OP_KILL:
+                HandleKill(sock);
+                break;
+            case OP_READ_HEADERS:
+                HandleReadHeaders(sock);
+                break;
+            default:
+                DieWithError("unknown request");
+        }
+    }
+}
+
+static void ServeDaemonClient(int sock, const char *rejection) {
+    if (rejection) {
+        char message[128];
+        snprintf(message, sizeof(message), "Error: %s", rejection);
+
+        // runs in the daemon itself, which must outlive any client, so failures are ignored
+        ancil_send_fds_with_message(sock, NULL, 0, message);
+        return;
+    }
+
+    SendMessage(sock, "OK");
+
+    ServeRequests(sock);
+}
+
+int main(int argc, char *argv[]) {
+    // background jobs must not be killed by a reader closing it's end of pipe
+    signal(SIGPIPE, SIG_IGN);
+
+    // fdhelper --daemon <socket name> <policy file>
+    if (argc == 4 && !strcmp(argv[1], "--daemon"))
+        RunDaemon(argv[2], argv[3], ServeDaemonClient);
+
+    // connect to supplied address and send the greeting message to server
+    int sock = Bootstrap(argv[1]);
+
+    ServeRequests(sock);
+
+    return -1;
+}
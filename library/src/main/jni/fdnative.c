@@ -0,0 +1,354 @@
+/*
+ * Copyright © 2015 Alexander Rvachev
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <jni.h>
+
+// JNI part of net.sf.fdshare.internal.FdNative, loaded into application process.
+
+#ifndef MSG_CMSG_CLOEXEC
+#define MSG_CMSG_CLOEXEC 0x40000000
+#endif
+
+// same number on all architectures, supported since Linux 5.9
+#ifndef __NR_close_range
+#define __NR_close_range 436
+#endif
+
+// layout of FdInfo records, must match FdInfo#FIELD_* constants
+#define FIELD_MODE 0
+#define FIELD_DEV 1
+#define FIELD_INODE 2
+#define FIELD_SIZE 3
+#define FIELD_POSITION 4
+#define FIELD_FLAGS 5
+#define FIELD_MOUNT_ID 6
+#define FIELD_MTIME 7
+#define FIELD_COUNT 8
+
+#define MAX_RECEIVED_FDS 64
+#define RECEIVE_BUFFER_SIZE 16384
+
+static jclass fileDescriptorClass;
+static jmethodID fileDescriptorInit;
+static jfieldID descriptorField;
+
+JNIEXPORT jint JNICALL JNI_OnLoad(JavaVM* vm, void* reserved) {
+    JNIEnv* env;
+
+    if ((*vm)->GetEnv(vm, (void**) &env, JNI_VERSION_1_6) != JNI_OK)
+        return -1;
+
+    jclass clazz = (*env)->FindClass(env, "java/io/FileDescriptor");
+    if (clazz == NULL)
+        return -1;
+
+    fileDescriptorClass = (jclass) (*env)->NewGlobalRef(env, clazz);
+    fileDescriptorInit = (*env)->GetMethodID(env, clazz, "<init>", "()V");
+    descriptorField = (*env)->GetFieldID(env, clazz, "descriptor", "I");
+
+    if (fileDescriptorClass == NULL || fileDescriptorInit == NULL || descriptorField == NULL)
+        return -1;
+
+    return JNI_VERSION_1_6;
+}
+
+JNIEXPORT jint JNICALL Java_net_sf_fdshare_internal_FdNative_receive(JNIEnv* env, jclass type, jobject socket,
+                                                                      jbyteArray data, jint offset, jint length,
+                                                                      jintArray fds) {
+    int sock = (*env)->GetIntField(env, socket, descriptorField);
+
+    int maxFds = (*env)->GetArrayLength(env, fds);
+    if (maxFds > MAX_RECEIVED_FDS)
+        maxFds = MAX_RECEIVED_FDS;
+
+    // the data is copied to Java array later, because we can not hold onto it while blocked in recvmsg
+    char buffer[RECEIVE_BUFFER_SIZE];
+    if (length > RECEIVE_BUFFER_SIZE)
+        length = RECEIVE_BUFFER_SIZE;
+
+    struct iovec iovec;
+    iovec.iov_base = buffer;
+    iovec.iov_len = (size_t) length;
+
+    union {
+        struct cmsghdr  cmsghdr;
+        char        control[CMSG_SPACE(sizeof (int) * MAX_RECEIVED_FDS)];
+    } cmsgfds;
+
+    struct msghdr msghdr;
+    memset(&msghdr, 0, sizeof(msghdr));
+    msghdr.msg_iov = &iovec;
+    msghdr.msg_iovlen = 1;
+    msghdr.msg_control = cmsgfds.control;
+    msghdr.msg_controllen = CMSG_SPACE(sizeof (int) * maxFds);
+
+    ssize_t received;
+    do {
+        received = recvmsg(sock, &msghdr, MSG_CMSG_CLOEXEC);
+    } while (received < 0 && errno == EINTR);
+
+    if (received < 0)
+        return -errno;
+
+    jint result[MAX_RECEIVED_FDS];
+    int count = 0;
+
+    // there may be several control messages, if the kernel merged multiple writes
+    struct cmsghdr *cmsg;
+    for (cmsg = CMSG_FIRSTHDR(&msghdr); cmsg != NULL; cmsg = CMSG_NXTHDR(&msghdr, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+
+        const int* cmsgFds = (const int*) CMSG_DATA(cmsg);
+        size_t cmsgFdCount = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+        size_t i;
+        for (i = 0; i < cmsgFdCount; i++) {
+            if (count < maxFds)
+                result[count++] = cmsgFds[i];
+            else
+                close(cmsgFds[i]);
+        }
+    }
+
+    int i;
+    for (i = count; i < maxFds; i++)
+        result[i] = -1;
+
+    if (maxFds)
+        (*env)->SetIntArrayRegion(env, fds, 0, maxFds, result);
+
+    if (received)
+        (*env)->SetByteArrayRegion(env, data, offset, (jsize) received, (const jbyte*) buffer);
+
+    return (jint) received;
+}
+
+JNIEXPORT jobject JNICALL Java_net_sf_fdshare_internal_FdNative_wrap(JNIEnv* env, jclass type, jint fd) {
+    jobject result = (*env)->NewObject(env, fileDescriptorClass, fileDescriptorInit);
+
+    if (result != NULL)
+        (*env)->SetIntField(env, result, descriptorField, fd);
+
+    return result;
+}
+
+JNIEXPORT jint JNICALL Java_net_sf_fdshare_internal_FdNative_release(JNIEnv* env, jclass type, jobject fd) {
+    jint result = (*env)->GetIntField(env, fd, descriptorField);
+
+    (*env)->SetIntField(env, fd, descriptorField, -1);
+
+    return result;
+}
+
+static int CompareFds(const void* a, const void* b) {
+    jint x = *(const jint*) a;
+    jint y = *(const jint*) b;
+
+    return x < y ? -1 : x > y;
+}
+
+static int closeRangeMissing;
+
+JNIEXPORT void JNICALL Java_net_sf_fdshare_internal_FdNative_closeAll(JNIEnv* env, jclass type, jintArray fds,
+                                                                       jint count) {
+    if (count <= 0 || count > (*env)->GetArrayLength(env, fds))
+        return;
+
+    jint* values = (*env)->GetIntArrayElements(env, fds, NULL);
+    if (values == NULL)
+        return;
+
+    qsort(values, (size_t) count, sizeof(jint), CompareFds);
+
+    int i = 0;
+    while (i < count) {
+        if (values[i] < 0 || (i > 0 && values[i] == values[i - 1])) {
+            i++;
+            continue;
+        }
+
+        int last = i;
+        while (last + 1 < count && values[last + 1] == values[last] + 1)
+            last++;
+
+        // the range consists solely of descriptors, handed to us, so nothing else is closed by accident
+        if (last > i && !closeRangeMissing) {
+            if (syscall(__NR_close_range, (unsigned) values[i], (unsigned) values[last], 0) == 0) {
+                i = last + 1;
+                continue;
+            }
+
+            if (errno == ENOSYS)
+                closeRangeMissing = 1;
+        }
+
+        for (; i <= last; i++)
+            close(values[i]);
+    }
+
+    (*env)->ReleaseIntArrayElements(env, fds, values, 0);
+}
+
+// Parse "name:\tvalue" lines of /proc/self/fdinfo/N into the record
+static void ReadFdInfo(int fd, jlong* record) {
+    char path[32];
+    char buffer[1024];
+
+    snprintf(path, sizeof(path), "/proc/self/fdinfo/%d", fd);
+
+    int infoFd = open(path, O_RDONLY | O_CLOEXEC);
+    if (infoFd < 0)
+        return;
+
+    // the interesting fields come first, the rest (such as inotify watches or epoll items) may be cut off
+    ssize_t length;
+    do {
+        length = read(infoFd, buffer, sizeof(buffer) - 1);
+    } while (length < 0 && errno == EINTR);
+
+    close(infoFd);
+
+    if (length <= 0)
+        return;
+
+    buffer[length] = '\0';
+
+    char* line = buffer;
+    while (line != NULL && *line) {
+        char* next = strchr(line, '\n');
+        if (next != NULL)
+            *next++ = '\0';
+
+        if (!strncmp(line, "pos:", 4))
+            record[FIELD_POSITION] = strtoll(line + 4, NULL, 10);
+        else if (!strncmp(line, "flags:", 6))
+            record[FIELD_FLAGS] = strtoll(line + 6, NULL, 8);
+        else if (!strncmp(line, "mnt_id:", 7))
+            record[FIELD_MOUNT_ID] = strtoll(line + 7, NULL, 10);
+
+        line = next;
+    }
+}
+
+// Accepts 1-3 byte sequences only: supplementary characters are encoded differently in modified UTF-8
+static int IsModifiedUtf8(const char* str) {
+    const unsigned char* p = (const unsigned char*) str;
+
+    while (*p) {
+        int continuation;
+
+        if (*p < 0x80)
+            continuation = 0;
+        else if (*p >= 0xC2 && *p < 0xE0)
+            continuation = 1;
+        else if (*p >= 0xE0 && *p < 0xF0)
+            continuation = 2;
+        else
+            return 0;
+
+        p++;
+
+        while (continuation--) {
+            if ((*p & 0xC0) != 0x80)
+                return 0;
+
+            p++;
+        }
+    }
+
+    return 1;
+}
+
+JNIEXPORT void JNICALL Java_net_sf_fdshare_internal_FdNative_describe(JNIEnv* env, jclass type, jintArray fds,
+                                                                       jlongArray values, jobjectArray paths) {
+    jsize count = (*env)->GetArrayLength(env, fds);
+
+    if ((*env)->GetArrayLength(env, values) < count * FIELD_COUNT)
+        return;
+
+    jint* rawFds = (*env)->GetIntArrayElements(env, fds, NULL);
+    if (rawFds == NULL)
+        return;
+
+    jlong* records = (*env)->GetLongArrayElements(env, values, NULL);
+    if (records == NULL) {
+        (*env)->ReleaseIntArrayElements(env, fds, rawFds, JNI_ABORT);
+        return;
+    }
+
+    jsize i;
+    for (i = 0; i < count; i++) {
+        jlong* record = records + i * FIELD_COUNT;
+
+        int j;
+        for (j = 0; j < FIELD_COUNT; j++)
+            record[j] = -1;
+
+        struct stat st;
+        if (!fstat(rawFds[i], &st)) {
+            record[FIELD_MODE] = st.st_mode;
+            record[FIELD_DEV] = (jlong) st.st_dev;
+            record[FIELD_INODE] = (jlong) st.st_ino;
+            record[FIELD_SIZE] = st.st_size;
+            record[FIELD_MTIME] = (jlong) st.st_mtim.tv_sec * 1000000000ll + st.st_mtim.tv_nsec;
+        }
+
+        ReadFdInfo(rawFds[i], record);
+    }
+
+    (*env)->ReleaseLongArrayElements(env, values, records, 0);
+
+    if (paths != NULL) {
+        char procPath[32];
+        char path[PATH_MAX];
+
+        for (i = 0; i < count; i++) {
+            snprintf(procPath, sizeof(procPath), "/proc/self/fd/%d", rawFds[i]);
+
+            ssize_t length = readlink(procPath, path, sizeof(path) - 1);
+            if (length <= 0)
+                continue;
+
+            path[length] = '\0';
+
+            // names, that are not valid modified UTF-8, would make CheckJNI abort, skip them
+            if (!IsModifiedUtf8(path))
+                continue;
+
+            jstring str = (*env)->NewStringUTF(env, path);
+            if (str == NULL) {
+                (*env)->ExceptionClear(env);
+                continue;
+            }
+
+            (*env)->SetObjectArrayElement(env, paths, i, str);
+            (*env)->DeleteLocalRef(env, str);
+        }
+    }
+
+    (*env)->ReleaseIntArrayElements(env, fds, rawFds, JNI_ABORT);
+}
@@ -0,0 +1,62 @@
+/*
+ * Copyright © 2015 Alexander Rvachev
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <errno.h>
+#include <unistd.h>
+
+#include "io.h"
+
+int WriteFully(int fd, const void *buffer, size_t length) {
+    const char *data = (const char *) buffer;
+
+    while (length) {
+        ssize_t written = write(fd, data, length);
+
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+
+            return -1;
+        }
+
+        data += written;
+        length -= written;
+    }
+
+    return 0;
+}
+
+ssize_t ReadFully(int fd, void *buffer, size_t length) {
+    char *data = (char *) buffer;
+    size_t total = 0;
+
+    while (total < length) {
+        ssize_t got = read(fd, data + total, length - total);
+
+        if (got < 0) {
+            if (errno == EINTR)
+                continue;
+
+            return -1;
+        }
+
+        if (got == 0)
+            break;
+
+        total += got;
+    }
+
+    return (ssize_t) total;
+}
@@ -0,0 +1,28 @@
+/*
+ * Copyright © 2015 Alexander Rvachev
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef FDSHARE_IO_H
+#define FDSHARE_IO_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// Write entire buffer, retrying after partial writes and interruptions. Returns 0 on success, -1 on error.
+int WriteFully(int fd, const void *buffer, size_t length);
+
+// Read exactly length bytes. Returns number of bytes read (less than length only on EOF) or -1 on error.
+ssize_t ReadFully(int fd, void *buffer, size_t length);
+
+#endif
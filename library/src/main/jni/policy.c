@@ -0,0 +1,232 @@
+/*
+ * Copyright © 2015 Alexander Rvachev
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <errno.h>
+#include <fnmatch.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "policy.h"
+
+struct PolicyNode {
+    char *component;
+    int glob;
+    int recursive;
+
+    int hasRule;
+    int allow;
+    int access;
+
+    struct PolicyNode *children;
+    struct PolicyNode *next;
+};
+
+struct Match {
+    const struct PolicyNode *rule;
+    int depth;
+    int literal;
+};
+
+static struct PolicyNode root;
+
+static int active;
+
+int PolicyIsActive() {
+    return active;
+}
+
+static struct PolicyNode* FindOrAddChild(struct PolicyNode *parent, const char *component, size_t length) {
+    struct PolicyNode *child;
+    for (child = parent->children; child != NULL; child = child->next)
+        if (strlen(child->component) == length && !memcmp(child->component, component, length))
+            return child;
+
+    if ((child = (struct PolicyNode*) calloc(1, sizeof(struct PolicyNode))) == NULL)
+        return NULL;
+
+    if ((child->component = strndup(component, length)) == NULL) {
+        free(child);
+        return NULL;
+    }
+
+    child->recursive = !strcmp(child->component, "**");
+    child->glob = !child->recursive && strpbrk(child->component, "*?[") != NULL;
+
+    // literal children are kept first, so that the common case does not involve fnmatch
+    if (child->glob || child->recursive) {
+        struct PolicyNode **tail = &parent->children;
+        while (*tail)
+            tail = &(*tail)->next;
+        *tail = child;
+    } else {
+        child->next = parent->children;
+        parent->children = child;
+    }
+
+    return child;
+}
+
+int PolicyAddRule(int allow, int access, const char *pattern) {
+    if (pattern[0] != '/') {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct PolicyNode *node = &root;
+
+    const char *component = pattern;
+    while (*component) {
+        component += strspn(component, "/");
+
+        size_t length = strcspn(component, "/");
+        if (length == 0)
+            break;
+
+        if ((length == 1 && component[0] == '.') || (length == 2 && !memcmp(component, "..", 2))) {
+            errno = EINVAL;
+            return -1;
+        }
+
+        if ((node = FindOrAddChild(node, component, length)) == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+
+        component += length;
+    }
+
+    // the last rule for the same pattern wins
+    node->hasRule = 1;
+    node->allow = allow;
+    node->access = access;
+
+    active = 1;
+
+    return 0;
+}
+
+static void Consider(struct Match *best, const struct PolicyNode *node, int depth, int literal) {
+    if (best->rule != NULL) {
+        if (depth != best->depth) {
+            if (depth < best->depth)
+                return;
+        } else if (literal != best->literal) {
+            if (literal < best->literal)
+                return;
+        } else if (node->allow || !best->rule->allow) {
+            return;
+        }
+    }
+
+    best->rule = node;
+    best->depth = depth;
+    best->literal = literal;
+}
+
+// path points to the remaining components of path, node has matched depth components so far
+static void MatchNode(const struct PolicyNode *node, const char *path, int depth, int literal, struct Match *best) {
+    if (node->hasRule)
+        Consider(best, node, depth, literal);
+
+    path += strspn(path, "/");
+    if (*path == '\0' || node->children == NULL)
+        return;
+
+    size_t length = strcspn(path, "/");
+
+    char component[256];
+    int haveComponent = 0;
+
+    const struct PolicyNode *child;
+    for (child = node->children; child != NULL; child = child->next) {
+        if (child->recursive) {
+            // "**" consumes any number of components, including none
+            const char *rest = path;
+            int skipped = 0;
+
+            while (1) {
+                MatchNode(child, rest, depth + skipped, literal, best);
+
+                rest += strcspn(rest, "/");
+                rest += strspn(rest, "/");
+
+                if (*rest == '\0')
+                    break;
+
+                skipped++;
+            }
+        } else if (child->glob) {
+            if (length >= sizeof(component))
+                continue;
+
+            if (!haveComponent) {
+                memcpy(component, path, length);
+                component[length] = '\0';
+                haveComponent = 1;
+            }
+
+            if (!fnmatch(child->component, component, FNM_PERIOD))
+                MatchNode(child, path + length, depth + 1, literal, best);
+        } else if (strlen(child->component) == length && !memcmp(child->component, path, length)) {
+            MatchNode(child, path + length, depth + 1, literal + 1, best);
+        }
+    }
+}
+
+int PolicyCheck(const char *path, int access) {
+    struct Match best;
+    memset(&best, 0, sizeof(best));
+
+    MatchNode(&root, path, 0, 0, &best);
+
+    return best.rule != NULL && best.rule->allow && (access & ~best.rule->access) == 0;
+}
+
+int PolicyNormalize(const char *path, char *out, size_t size) {
+    if (path[0] != '/' || size < 2)
+        return -1;
+
+    size_t length = 0;
+
+    while (*path) {
+        path += strspn(path, "/");
+
+        size_t component = strcspn(path, "/");
+        if (component == 0)
+            break;
+
+        if (component == 1 && path[0] == '.') {
+            // skip
+        } else if (component == 2 && path[0] == '.' && path[1] == '.') {
+            while (length > 0 && out[--length] != '/');
+        } else {
+            if (length + 1 + component + 1 > size)
+                return -1;
+
+            out[length++] = '/';
+            memcpy(out + length, path, component);
+            length += component;
+        }
+
+        path += component;
+    }
+
+    if (length == 0)
+        out[length++] = '/';
+
+    out[length] = '\0';
+
+    return 0;
+}
@@ -0,0 +1,49 @@
+/*
+ * Copyright © 2015 Alexander Rvachev
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef FDSHARE_POLICY_H
+#define FDSHARE_POLICY_H
+
+#include <stddef.h>
+
+// access kinds, must match PathPolicy constants
+#define POLICY_READ 1
+#define POLICY_WRITE 2
+#define POLICY_CREATE 4
+
+// Not a real errno value, reported for requests, denied by path policy. Must match PathPolicy#DENIED
+#define EPOLICY 1000
+
+// Path policy, compiled into a trie of path components. Each rule is an absolute path pattern, applying
+// to the matching file and everything below it. Components may be literal, shell globs (matched by fnmatch)
+// or "**", matching any number of components. The most specific matching rule wins: the one, matching more
+// components, then the one with more literal components, then deny rule. Paths, matching no rules, are denied.
+//
+// Rules are added before serving requests, checks are thread-safe afterwards.
+
+// Returns 0 on success or -1 with errno set to EINVAL (malformed pattern) or ENOMEM.
+int PolicyAddRule(int allow, int access, const char *pattern);
+
+// Returns true once any rule was added.
+int PolicyIsActive();
+
+// Returns true if the requested access (combination of POLICY_* flags) to normalized absolute path is allowed.
+int PolicyCheck(const char *path, int access);
+
+// Lexically normalize absolute path, collapsing repeated slashes, "." and ".." components.
+// Returns 0 on success or -1 if the path is not absolute or does not fit.
+int PolicyNormalize(const char *path, char *out, size_t size);
+
+#endif
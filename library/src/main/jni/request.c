@@ -0,0 +1,142 @@
+/*
+ * Copyright © 2015 Alexander Rvachev
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "request.h"
+
+#ifndef MSG_CMSG_CLOEXEC
+#define MSG_CMSG_CLOEXEC 0x40000000
+#endif
+
+#define REQUEST_BUFFER_SIZE 4096
+#define MAX_PENDING_FDS 8
+
+static int requestSock = -1;
+
+static char buffer[REQUEST_BUFFER_SIZE];
+static size_t position;
+static size_t filled;
+
+static int pendingFds[MAX_PENDING_FDS];
+static int pendingCount;
+
+void RequestReaderInit(int sock) {
+    requestSock = sock;
+    position = filled = 0;
+    pendingCount = 0;
+}
+
+static int Fill() {
+    struct iovec iovec;
+    iovec.iov_base = buffer;
+    iovec.iov_len = sizeof(buffer);
+
+    union {
+        struct cmsghdr  cmsghdr;
+        char        control[CMSG_SPACE(sizeof (int) * MAX_PENDING_FDS)];
+    } cmsgfds;
+
+    struct msghdr msghdr;
+    memset(&msghdr, 0, sizeof(msghdr));
+    msghdr.msg_iov = &iovec;
+    msghdr.msg_iovlen = 1;
+    msghdr.msg_control = cmsgfds.control;
+    msghdr.msg_controllen = sizeof(cmsgfds.control);
+
+    ssize_t got;
+    do {
+        got = recvmsg(requestSock, &msghdr, MSG_CMSG_CLOEXEC);
+    } while (got < 0 && errno == EINTR);
+
+    if (got <= 0) {
+        if (got == 0)
+            errno = 0;
+
+        return -1;
+    }
+
+    struct cmsghdr *cmsg;
+    for (cmsg = CMSG_FIRSTHDR(&msghdr); cmsg != NULL; cmsg = CMSG_NXTHDR(&msghdr, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+
+        const int* fds = (const int*) CMSG_DATA(cmsg);
+        size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+        size_t i;
+        for (i = 0; i < count; i++) {
+            if (pendingCount < MAX_PENDING_FDS)
+                pendingFds[pendingCount++] = fds[i];
+            else
+                close(fds[i]);
+        }
+    }
+
+    position = 0;
+    filled = (size_t) got;
+
+    return 0;
+}
+
+int RequestPeek() {
+    if (position == filled && Fill())
+        return -1;
+
+    return (unsigned char) buffer[position];
+}
+
+int RequestGet() {
+    int c = RequestPeek();
+
+    if (c >= 0)
+        position++;
+
+    return c;
+}
+
+int RequestRead(char *buf, size_t length) {
+    while (length) {
+        if (position == filled && Fill())
+            return -1;
+
+        size_t chunk = filled - position < length ? filled - position : length;
+
+        memcpy(buf, buffer + position, chunk);
+
+        position += chunk;
+        buf += chunk;
+        length -= chunk;
+    }
+
+    return 0;
+}
+
+int RequestTakeFd() {
+    if (pendingCount == 0) {
+        errno = EBADF;
+        return -1;
+    }
+
+    int fd = pendingFds[0];
+
+    memmove(pendingFds, pendingFds + 1, sizeof(int) * --pendingCount);
+
+    return fd;
+}
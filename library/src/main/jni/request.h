@@ -0,0 +1,38 @@
+/*
+ * Copyright © 2015 Alexander Rvachev
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef FDSHARE_REQUEST_H
+#define FDSHARE_REQUEST_H
+
+#include <stddef.h>
+
+// Buffered reader of requests, arriving over the socket. Descriptors, attached to any part of request stream,
+// are queued until taken by RequestTakeFd(). Not thread-safe, requests are read by the main thread only.
+
+void RequestReaderInit(int sock);
+
+// Returns next byte of request stream without consuming it, or -1 on failure or end of stream (errno is 0 then).
+int RequestPeek();
+
+// Returns next byte of request stream, or -1 same as RequestPeek().
+int RequestGet();
+
+// Read exactly length bytes. Returns 0 on success or -1, same as RequestPeek().
+int RequestRead(char *buf, size_t length);
+
+// Returns the oldest received descriptor, that was not taken yet, or -1 with errno set to EBADF if there is none.
+int RequestTakeFd();
+
+#endif
@@ -0,0 +1,821 @@
+/*
+ * Copyright © 2015 Alexander Rvachev
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/time.h>
+
+#include "io.h"
+#include "policy.h"
+#include "tar.h"
+
+#define BLOCK 512
+#define COPY_BUFFER_SIZE (64 * 1024)
+#define LONG_NAME "././@LongLink"
+
+#ifndef major
+#include <sys/sysmacros.h>
+#endif
+
+struct Header {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char pad[12];
+};
+
+struct Writer {
+    int out;
+    int flags;
+    dev_t dev;
+    size_t rootLength;
+    char path[PATH_MAX];
+    char buffer[COPY_BUFFER_SIZE];
+};
+
+// Numbers, that do not fit into octal field, use GNU base-256 encoding.
+static void PutNumber(char *field, size_t size, uint64_t value) {
+    if (size < 12 ? value < (1ull << (3 * (size - 1))) : value < (1ull << 33)) {
+        snprintf(field, size, "%0*llo", (int) size - 1, (unsigned long long) value);
+    } else {
+        size_t i;
+        for (i = size - 1; i > 0; i--) {
+            field[i] = (char) (value & 0xff);
+            value >>= 8;
+        }
+        field[0] = (char) 0x80;
+    }
+}
+
+static uint64_t GetNumber(const char *field, size_t size) {
+    uint64_t value = 0;
+    size_t i;
+
+    if ((unsigned char) field[0] & 0x80) {
+        for (i = 1; i < size; i++)
+            value = (value << 8) | (unsigned char) field[i];
+
+        return value;
+    }
+
+    for (i = 0; i < size && field[i] == ' '; i++);
+
+    for (; i < size && field[i] >= '0' && field[i] <= '7'; i++)
+        value = (value << 3) | (field[i] - '0');
+
+    return value;
+}
+
+static unsigned Checksum(const struct Header *header) {
+    const unsigned char *bytes = (const unsigned char *) header;
+    unsigned sum = 0;
+    size_t i;
+
+    for (i = 0; i < BLOCK; i++)
+        sum += (i >= 148 && i < 156) ? ' ' : bytes[i];
+
+    return sum;
+}
+
+static int WritePadding(struct Writer *w, uint64_t size) {
+    static const char zeros[BLOCK];
+
+    size_t tail = (size_t) (size % BLOCK);
+
+    return tail && WriteFully(w->out, zeros, BLOCK - tail) ? errno : 0;
+}
+
+// GNU tar stores names, that do not fit into header, in a pseudo-entry, preceding the real one
+static int WriteLongName(struct Writer *w, char type, const char *name, size_t length) {
+    struct Header header;
+    memset(&header, 0, sizeof(header));
+
+    strcpy(header.name, LONG_NAME);
+    PutNumber(header.mode, sizeof(header.mode), 0);
+    PutNumber(header.uid, sizeof(header.uid), 0);
+    PutNumber(header.gid, sizeof(header.gid), 0);
+    PutNumber(header.size, sizeof(header.size), length + 1);
+    PutNumber(header.mtime, sizeof(header.mtime), 0);
+    header.typeflag = type;
+    memcpy(header.magic, "ustar", 6);
+    memcpy(header.version, "00", 2);
+    snprintf(header.chksum, sizeof(header.chksum), "%06o", Checksum(&header));
+    header.chksum[7] = ' ';
+
+    if (WriteFully(w->out, &header, sizeof(header)) || WriteFully(w->out, name, length + 1))
+        return errno;
+
+    return WritePadding(w, length + 1);
+}
+
+static int WriteHeader(struct Writer *w, const char *name, const struct stat *st, char type, uint64_t size,
+                       const char *linkname) {
+    struct Header header;
+    memset(&header, 0, sizeof(header));
+
+    int err;
+    size_t nameLength = strlen(name);
+
+    if (nameLength >= sizeof(header.name) && (err = WriteLongName(w, 'L', name, nameLength)))
+        return err;
+
+    if (linkname) {
+        size_t linkLength = strlen(linkname);
+
+        if (linkLength >= sizeof(header.linkname) && (err = WriteLongName(w, 'K', linkname, linkLength)))
+            return err;
+
+        strncpy(header.linkname, linkname, sizeof(header.linkname) - 1);
+    }
+
+    strncpy(header.name, name, sizeof(header.name) - 1);
+    PutNumber(header.mode, sizeof(header.mode), st->st_mode & 07777);
+    PutNumber(header.uid, sizeof(header.uid), st->st_uid);
+    PutNumber(header.gid, sizeof(header.gid), st->st_gid);
+    PutNumber(header.size, sizeof(header.size), size);
+    PutNumber(header.mtime, sizeof(header.mtime), st->st_mtime > 0 ? (uint64_t) st->st_mtime : 0);
+    header.typeflag = type;
+    memcpy(header.magic, "ustar", 6);
+    memcpy(header.version, "00", 2);
+
+    if (type == '3' || type == '4') {
+        PutNumber(header.devmajor, sizeof(header.devmajor), major(st->st_rdev));
+        PutNumber(header.devminor, sizeof(header.devminor), minor(st->st_rdev));
+    }
+
+    snprintf(header.chksum, sizeof(header.chksum), "%06o", Checksum(&header));
+    header.chksum[7] = ' ';
+
+    return WriteFully(w->out, &header, sizeof(header)) ? errno : 0;
+}
+
+// The contents go from page cache straight to the pipe, unless the kernel is too old to sendfile() into one.
+// If the file shrinks in meantime, the remainder is padded with zeros to keep the archive consistent.
+static int WriteContents(struct Writer *w, int fd, uint64_t size) {
+    uint64_t remaining = size;
+    int useSendfile = 1;
+
+    while (remaining) {
+        size_t chunk = remaining > (1u << 30) ? (1u << 30) : (size_t) remaining;
+        ssize_t sent;
+
+        if (useSendfile) {
+            sent = sendfile(w->out, fd, NULL, chunk);
+
+            if (sent < 0 && (errno == EINVAL || errno == ENOSYS) && remaining == size) {
+                useSendfile = 0;
+                continue;
+            }
+        } else {
+            sent = read(fd, w->buffer, chunk > sizeof(w->buffer) ? sizeof(w->buffer) : chunk);
+
+            if (sent > 0 && WriteFully(w->out, w->buffer, (size_t) sent))
+                return errno;
+        }
+
+        if (sent < 0) {
+            if (errno == EINTR)
+                continue;
+
+            // an output error is fatal, an input error is not
+            if (errno == EPIPE)
+                return errno;
+        }
+
+        if (sent <= 0)
+            break;
+
+        remaining -= sent;
+    }
+
+    if (remaining) {
+        memset(w->buffer, 0, sizeof(w->buffer));
+
+        while (remaining) {
+            size_t chunk = remaining > sizeof(w->buffer) ? sizeof(w->buffer) : (size_t) remaining;
+
+            if (WriteFully(w->out, w->buffer, chunk))
+                return errno;
+
+            remaining -= chunk;
+        }
+    }
+
+    return WritePadding(w, size);
+}
+
+static int WriteDirectory(struct Writer *w, size_t length);
+
+// While a policy is active, the walk starts from resolved root and never follows symlinks, so the path can be
+// checked as is. Denied directories are still descended into, because their children may be allowed.
+static int WriteEntry(struct Writer *w, size_t length) {
+    struct stat st;
+
+    if (lstat(w->path, &st))
+        return 0;
+
+    int denied = PolicyIsActive() && !PolicyCheck(w->path, POLICY_READ);
+
+    if (denied && !S_ISDIR(st.st_mode))
+        return 0;
+
+    const char *name = w->path + w->rootLength + 1;
+
+    int err = 0;
+
+    if (S_ISDIR(st.st_mode)) {
+        if (length + 1 >= sizeof(w->path))
+            return 0;
+
+        w->path[length] = '/';
+        w->path[length + 1] = '\0';
+
+        if (!denied)
+            err = WriteHeader(w, name, &st, '5', 0, NULL);
+
+        w->path[length] = '\0';
+
+        if (!err && (!(w->flags & TAR_ONE_FILE_SYSTEM) || st.st_dev == w->dev))
+            err = WriteDirectory(w, length);
+    } else if (S_ISREG(st.st_mode)) {
+        int fd = open(w->path, O_RDONLY | O_NOFOLLOW);
+        if (fd < 0)
+            return 0;
+
+        if (!(err = WriteHeader(w, name, &st, '0', (uint64_t) st.st_size, NULL)))
+            err = WriteContents(w, fd, (uint64_t) st.st_size);
+
+        close(fd);
+    } else if (S_ISLNK(st.st_mode)) {
+        char target[PATH_MAX];
+
+        ssize_t targetLength = readlink(w->path, target, sizeof(target) - 1);
+        if (targetLength < 0)
+            return 0;
+
+        target[targetLength] = '\0';
+
+        err = WriteHeader(w, name, &st, '2', 0, target);
+    } else if (S_ISCHR(st.st_mode)) {
+        err = WriteHeader(w, name, &st, '3', 0, NULL);
+    } else if (S_ISBLK(st.st_mode)) {
+        err = WriteHeader(w, name, &st, '4', 0, NULL);
+    } else if (S_ISFIFO(st.st_mode)) {
+        err = WriteHeader(w, name, &st, '6', 0, NULL);
+    }
+
+    // sockets can not be archived
+
+    return err;
+}
+
+static int WriteDirectory(struct Writer *w, size_t length) {
+    DIR *dir = opendir(w->path);
+    if (dir == NULL)
+        return 0;
+
+    int err = 0;
+
+    struct dirent *entry;
+    while (!err && (entry = readdir(dir)) != NULL) {
+        const char *name = entry->d_name;
+
+        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+            continue;
+
+        size_t nameLength = strlen(name);
+        if (length + 1 + nameLength >= sizeof(w->path))
+            continue;
+
+        w->path[length] = '/';
+        memcpy(w->path + length + 1, name, nameLength + 1);
+
+        err = WriteEntry(w, length + 1 + nameLength);
+
+        w->path[length] = '\0';
+    }
+
+    closedir(dir);
+
+    return err;
+}
+
+int TarWriteTree(const char *dir, int out, int flags) {
+    struct Writer *w = (struct Writer *) malloc(sizeof(struct Writer));
+    if (w == NULL)
+        return ENOMEM;
+
+    int err;
+
+    char *resolved = NULL;
+
+    if (PolicyIsActive()) {
+        if ((resolved = realpath(dir, NULL)) == NULL) {
+            err = errno;
+            free(w);
+            return err;
+        }
+
+        dir = resolved;
+    }
+
+    size_t length = strlen(dir);
+    while (length > 1 && dir[length - 1] == '/')
+        length--;
+
+    struct stat st;
+    if (length >= sizeof(w->path)) {
+        err = ENAMETOOLONG;
+    } else if (stat(dir, &st)) {
+        err = errno;
+    } else if (!S_ISDIR(st.st_mode)) {
+        err = ENOTDIR;
+    } else {
+        w->out = out;
+        w->flags = flags;
+        w->dev = st.st_dev;
+        w->rootLength = length;
+
+        memcpy(w->path, dir, length);
+        w->path[length] = '\0';
+
+        err = WriteDirectory(w, length);
+
+        // end-of-archive marker: two zero blocks
+        if (!err) {
+            memset(w->buffer, 0, BLOCK * 2);
+
+            if (WriteFully(out, w->buffer, BLOCK * 2))
+                err = errno;
+        }
+    }
+
+    free(resolved);
+    free(w);
+
+    return err;
+}
+
+struct Reader {
+    int in;
+    int root;
+    int flags;
+    int firstError;
+    int checkPolicy;
+    char rootPath[PATH_MAX];
+    char name[PATH_MAX];
+    char link[PATH_MAX];
+    int hasLongName;
+    int hasLongLink;
+    char buffer[COPY_BUFFER_SIZE];
+};
+
+static int Skip(struct Reader *r, uint64_t size) {
+    while (size) {
+        size_t chunk = size > sizeof(r->buffer) ? sizeof(r->buffer) : (size_t) size;
+
+        ssize_t got = ReadFully(r->in, r->buffer, chunk);
+        if (got < 0)
+            return errno;
+        if ((size_t) got < chunk)
+            return EPIPE;
+
+        size -= chunk;
+    }
+
+    return 0;
+}
+
+static uint64_t Padded(uint64_t size) {
+    return (size + BLOCK - 1) / BLOCK * BLOCK;
+}
+
+// An over-long name is replaced with empty one, so the entry is skipped (or fails, for a link target), and
+// the archive is reported as partly extracted.
+static int ReadLongName(struct Reader *r, char *target, uint64_t size) {
+    if (size >= PATH_MAX) {
+        target[0] = '\0';
+
+        if (!r->firstError)
+            r->firstError = ENAMETOOLONG;
+
+        return Skip(r, Padded(size));
+    }
+
+    ssize_t got = ReadFully(r->in, target, (size_t) size);
+    if (got < 0)
+        return errno;
+    if ((uint64_t) got < size)
+        return EPIPE;
+
+    target[size] = '\0';
+
+    return Skip(r, Padded(size) - size);
+}
+
+// Strips leading slashes and "./", rejects names with ".." components, which could escape the target.
+// The result is empty for the root of archive itself.
+static const char *Sanitize(char *name) {
+    while (*name == '/' || (name[0] == '.' && name[1] == '/'))
+        name += name[0] == '/' ? 1 : 2;
+
+    size_t length = strlen(name);
+    while (length && name[length - 1] == '/')
+        name[--length] = '\0';
+
+    const char *c = name;
+    while (*c) {
+        if (c[0] == '.' && c[1] == '.' && (c[2] == '/' || c[2] == '\0'))
+            return NULL;
+
+        c = strchr(c, '/');
+        if (c == NULL)
+            break;
+        c++;
+    }
+
+    return name;
+}
+
+// Opens the directory, containing given path, relative to root, while refusing to traverse symlinks.
+// Missing directories are created. On success *leaf points at the last component of path.
+static int OpenParent(int root, char *path, char **leaf) {
+    int dirFd = dup(root);
+    if (dirFd < 0)
+        return -1;
+
+    char *component = path;
+    char *slash;
+
+    while ((slash = strchr(component, '/')) != NULL) {
+        *slash = '\0';
+
+        int next = -1;
+        if (*component && strcmp(component, ".")) {
+            next = openat(dirFd, component, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+
+            if (next < 0 && errno == ENOENT && !mkdirat(dirFd, component, 0755))
+                next = openat(dirFd, component, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+        } else {
+            next = dup(dirFd);
+        }
+
+        *slash = '/';
+
+        int saved = errno;
+        close(dirFd);
+        errno = saved;
+
+        if (next < 0)
+            return -1;
+
+        dirFd = next;
+        component = slash + 1;
+    }
+
+    *leaf = component;
+
+    return dirFd;
+}
+
+// Checks sanitized name against the policy. Entries are created without following symlinks (see OpenParent)
+// under the resolved root, so the lexical path is where they end up.
+static int Allowed(struct Reader *r, const char *name, int access) {
+    if (!r->checkPolicy)
+        return 1;
+
+    char path[PATH_MAX];
+    char normalized[PATH_MAX];
+
+    if ((size_t) snprintf(path, sizeof(path), "%s/%s", r->rootPath, name) >= sizeof(path))
+        return 0;
+
+    return !PolicyNormalize(path, normalized, sizeof(normalized)) && PolicyCheck(normalized, access);
+}
+
+static void ApplyAttributes(struct Reader *r, int fd, int parent, const char *leaf, const struct Header *header,
+                            int isLink) {
+    uid_t uid = (uid_t) GetNumber(header->uid, sizeof(header->uid));
+    gid_t gid = (gid_t) GetNumber(header->gid, sizeof(header->gid));
+
+    if (r->flags & TAR_RESTORE_OWNERSHIP) {
+        if (fd >= 0)
+            fchown(fd, uid, gid);
+        else
+            fchownat(parent, leaf, uid, gid, AT_SYMLINK_NOFOLLOW);
+    }
+
+    if (isLink)
+        return;
+
+    mode_t mode = (mode_t) GetNumber(header->mode, sizeof(header->mode)) & 07777;
+
+    struct timespec times[2];
+    times[0].tv_sec = times[1].tv_sec = (time_t) GetNumber(header->mtime, sizeof(header->mtime));
+    times[0].tv_nsec = times[1].tv_nsec = 0;
+
+    if (fd >= 0) {
+        fchmod(fd, mode);
+        futimens(fd, times);
+    } else {
+        // the node may have been replaced by a symlink since it was made; where the libc can not change mode
+        // without following links, the call fails and the node keeps it's initial mode
+        fchmodat(parent, leaf, mode, AT_SYMLINK_NOFOLLOW);
+        utimensat(parent, leaf, times, AT_SYMLINK_NOFOLLOW);
+    }
+}
+
+static int ExtractContents(struct Reader *r, int fd, uint64_t size) {
+    uint64_t remaining = size;
+
+    while (remaining) {
+        size_t chunk = remaining > sizeof(r->buffer) ? sizeof(r->buffer) : (size_t) remaining;
+
+        ssize_t got = read(r->in, r->buffer, chunk);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got < 0)
+            return errno;
+        if (got == 0)
+            return EPIPE;
+
+        if (fd >= 0 && WriteFully(fd, r->buffer, (size_t) got)) {
+            if (!r->firstError)
+                r->firstError = errno;
+
+            // keep consuming the stream
+            fd = -1;
+        }
+
+        remaining -= got;
+    }
+
+    return Skip(r, Padded(size) - size);
+}
+
+// returns non-zero only if the archive stream itself became unusable
+static int ExtractEntry(struct Reader *r, const struct Header *header, char *name, uint64_t size) {
+    char type = header->typeflag;
+
+    int err = 0;
+
+    // device nodes and FIFOs could be used to reach anything, regardless of their location
+    if (!Allowed(r, name, POLICY_WRITE | POLICY_CREATE)
+            || (r->checkPolicy && (type == '3' || type == '4' || type == '6'))) {
+        err = EPOLICY;
+        goto skip;
+    }
+
+    char *leaf;
+    int parent = OpenParent(r->root, name, &leaf);
+    if (parent < 0) {
+        err = errno;
+        goto skip;
+    }
+
+    switch (type) {
+        case '5': {
+            if (mkdirat(parent, leaf, 0700) && errno != EEXIST) {
+                err = errno;
+                break;
+            }
+
+            int dirFd = openat(parent, leaf, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+            if (dirFd < 0) {
+                err = errno;
+                break;
+            }
+
+            ApplyAttributes(r, dirFd, parent, leaf, header, 0);
+            close(dirFd);
+            break;
+        }
+        case '2':
+            if (symlinkat(r->link, parent, leaf) && errno == EEXIST && !unlinkat(parent, leaf, 0))
+                symlinkat(r->link, parent, leaf);
+
+            if (faccessat(parent, leaf, F_OK, AT_SYMLINK_NOFOLLOW))
+                err = errno;
+            else
+                ApplyAttributes(r, -1, parent, leaf, header, 1);
+            break;
+        case '1': {
+            char *targetLeaf;
+            const char *target = Sanitize(r->link);
+
+            // the link gives the same access to the file, as it's new location does
+            if (target && *target && !Allowed(r, target, POLICY_READ | POLICY_WRITE)) {
+                err = EPOLICY;
+                break;
+            }
+
+            int targetParent = target && *target ? OpenParent(r->root, (char *) target, &targetLeaf) : -1;
+
+            if (targetParent < 0) {
+                err = target && *target ? errno : EINVAL;
+                break;
+            }
+
+            unlinkat(parent, leaf, 0);
+
+            if (linkat(targetParent, targetLeaf, parent, leaf, 0))
+                err = errno;
+
+            close(targetParent);
+            break;
+        }
+        case '3':
+        case '4':
+        case '6': {
+            mode_t kind = type == '3' ? S_IFCHR : type == '4' ? S_IFBLK : S_IFIFO;
+            dev_t dev = makedev(GetNumber(header->devmajor, sizeof(header->devmajor)),
+                                GetNumber(header->devminor, sizeof(header->devminor)));
+
+            unlinkat(parent, leaf, 0);
+
+            if (mknodat(parent, leaf, kind | 0600, dev))
+                err = errno;
+            else
+                ApplyAttributes(r, -1, parent, leaf, header, 0);
+            break;
+        }
+        case '0':
+        case '7':
+        case '\0': {
+            int fd = openat(parent, leaf, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, 0600);
+
+            if (fd < 0 && errno == ELOOP && !unlinkat(parent, leaf, 0))
+                fd = openat(parent, leaf, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, 0600);
+
+            if (fd < 0)
+                err = errno;
+
+            int streamErr = ExtractContents(r, fd, size);
+
+            if (fd >= 0) {
+                ApplyAttributes(r, fd, parent, leaf, header, 0);
+                close(fd);
+            }
+
+            close(parent);
+
+            if (err && !r->firstError)
+                r->firstError = err;
+
+            return streamErr;
+        }
+        default:
+            // unknown entry types are skipped
+            break;
+    }
+
+    close(parent);
+
+skip:
+    if (err && !r->firstError)
+        r->firstError = err;
+
+    return Skip(r, Padded(size));
+}
+
+int TarExtract(int in, const char *dir, int flags) {
+    struct Reader *r = (struct Reader *) calloc(1, sizeof(struct Reader));
+    if (r == NULL)
+        return ENOMEM;
+
+    int err = 0;
+
+    r->in = in;
+    r->flags = flags;
+    r->root = open(dir, O_RDONLY | O_DIRECTORY);
+
+    if (r->root < 0 || (PolicyIsActive() && realpath(dir, r->rootPath) == NULL)) {
+        err = errno;
+        if (r->root >= 0)
+            close(r->root);
+        free(r);
+        return err;
+    }
+
+    r->checkPolicy = PolicyIsActive();
+
+    struct Header header;
+
+    for (;;) {
+        ssize_t got = ReadFully(in, &header, sizeof(header));
+        if (got < 0) {
+            err = errno;
+            break;
+        }
+        if (got != sizeof(header)) {
+            err = EPIPE;
+            break;
+        }
+
+        if (header.name[0] == '\0' && header.chksum[0] == '\0')
+            break; // end-of-archive marker, the second zero block is left alone
+
+        if (GetNumber(header.chksum, sizeof(header.chksum)) != Checksum(&header)) {
+            err = EINVAL;
+            break;
+        }
+
+        uint64_t size = GetNumber(header.size, sizeof(header.size));
+
+        if (header.typeflag == 'L') {
+            if ((err = ReadLongName(r, r->name, size)))
+                break;
+            r->hasLongName = 1;
+            continue;
+        }
+
+        if (header.typeflag == 'K') {
+            if ((err = ReadLongName(r, r->link, size)))
+                break;
+            r->hasLongLink = 1;
+            continue;
+        }
+
+        if (header.typeflag == 'x' || header.typeflag == 'g') {
+            if ((err = Skip(r, Padded(size))))
+                break;
+            continue;
+        }
+
+        if (!r->hasLongName) {
+            if (header.prefix[0] && !memcmp(header.magic, "ustar", 5))
+                snprintf(r->name, sizeof(r->name), "%.*s/%.*s", (int) sizeof(header.prefix), header.prefix,
+                         (int) sizeof(header.name), header.name);
+            else
+                snprintf(r->name, sizeof(r->name), "%.*s", (int) sizeof(header.name), header.name);
+        }
+
+        if (!r->hasLongLink)
+            snprintf(r->link, sizeof(r->link), "%.*s", (int) sizeof(header.linkname), header.linkname);
+
+        r->hasLongName = r->hasLongLink = 0;
+
+        // directory entries have no contents, regardless of what the size field says
+        if (header.typeflag == '5' || header.typeflag == '2' || header.typeflag == '1')
+            size = 0;
+
+        char *name = (char *) Sanitize(r->name);
+
+        if (name == NULL || *name == '\0') {
+            if (name == NULL && !r->firstError)
+                r->firstError = EINVAL;
+
+            if ((err = Skip(r, Padded(size))))
+                break;
+
+            continue;
+        }
+
+        if ((err = ExtractEntry(r, &header, name, size)))
+            break;
+    }
+
+    close(r->root);
+
+    if (!err)
+        err = r->firstError;
+
+    free(r);
+
+    return err;
+}
@@ -0,0 +1,33 @@
+/*
+ * Copyright © 2015 Alexander Rvachev
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef FDSHARE_TAR_H
+#define FDSHARE_TAR_H
+
+// must match ArchiveOptions flags
+#define TAR_ONE_FILE_SYSTEM 1
+#define TAR_RESTORE_OWNERSHIP 2
+
+// Write contents of directory as ustar archive (with GNU long name extension) to out.
+// Returns 0 on success or errno value of the first error, that made it impossible to continue.
+// Files, that vanish or can not be opened during the walk, are skipped, and so are files denied by path policy.
+int TarWriteTree(const char *dir, int out, int flags);
+
+// Extract ustar archive from in to the directory, without ever following symlinks within it.
+// While a path policy is active, entries at denied locations, device nodes and FIFOs are skipped and reported
+// as EPOLICY. Returns 0 on success or errno value of the first error.
+int TarExtract(int in, const char *dir, int flags);
+
+#endif
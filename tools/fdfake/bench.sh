@@ -0,0 +1,48 @@
+#!/bin/sh
+# Measures throughput and latency percentiles of the helper protocol under injected faults, using fdfake
+# in daemon mode and fdreplay on a synthetic workload. Runs on any Linux host:
+#
+#   tools/fdfake/bench.sh [requests]
+#
+# Each scenario is reproducible: fdfake uses fixed seed, so the same faults hit the same requests.
+
+set -e
+
+REQUESTS=${1:-20000}
+TOOLS=$(cd "$(dirname "$0")/.." && pwd)
+WORK=$(mktemp -d)
+NAME=fdfake-bench-$$
+
+trap 'kill $FAKE 2>/dev/null; rm -rf "$WORK"' EXIT
+
+${CC:-cc} -O2 -o "$WORK/fdfake" "$TOOLS/fdfake/fdfake.c" -lm
+${CC:-cc} -O2 -o "$WORK/fdreplay" "$TOOLS/fdreplay/fdreplay.c"
+
+"$WORK/fdreplay" synth "$WORK/trace" 1000 "$REQUESTS" 10
+"$WORK/fdreplay" tree "$WORK/trace" "$WORK/root" 4096 > /dev/null
+
+scenario() {
+    title=$1
+    shift
+
+    echo
+    echo "== $title"
+
+    "$WORK/fdfake" "$@" --daemon "$NAME" &
+    FAKE=$!
+    sleep 0.2
+
+    "$WORK/fdreplay" run "$WORK/trace" "$WORK/root" "$NAME" 0
+
+    kill $FAKE
+    wait $FAKE 2>/dev/null || true
+}
+
+scenario "baseline"
+scenario "exponential latency, 200 us mean" -l '*:exp:200'
+scenario "heavy tail, pareto from 50 us" -l '*:pareto:50:1.5'
+scenario "slow batches" -l 'm:uniform:1000:5000'
+scenario "stall for 50 ms every 1000 requests" -s 1000:50
+scenario "1% of descriptors dropped" -d 0.01
+scenario "0.1% of responses out of order" -o 0.001
+scenario "crash every 5000 requests" -c 5000
@@ -0,0 +1,558 @@
+/*
+ * Copyright © 2015 Alexander Rvachev
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// fdfake: a stand-in for fdhelper, speaking the same protocol, that injects latency and faults on schedule.
+// Files are opened for real, with privileges of the user, that runs it. See README.md.
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// must match FileDescriptorFactory#MAX_BATCH_OPEN
+#define MAX_BATCH_OPEN 16
+
+#define MAX_ARGS (MAX_BATCH_OPEN * 2 + 4)
+#define MAX_STRING (PATH_MAX * 4)
+#define MAX_LATENCY_US 60000000.0
+
+enum Distribution { NONE, FIXED, UNIFORM, EXPONENTIAL, PARETO };
+
+struct Latency {
+    enum Distribution kind;
+    double a, b;
+};
+
+static struct Latency latencies[128];
+static unsigned long stallEvery, stallMs, crashAt;
+static double dropProbability, staleProbability;
+static uint64_t seed = 1;
+
+static unsigned long served;
+
+static void Die(const char *message) {
+    fprintf(stderr, "fdfake: %s: %s\n", message, strerror(errno));
+    exit(1);
+}
+
+// xorshift64*, so that the same seed reproduces the same schedule everywhere
+static double Random() {
+    seed ^= seed >> 12;
+    seed ^= seed << 25;
+    seed ^= seed >> 27;
+    return (double) ((seed * 0x2545F4914F6CDD1DULL) >> 11) / 9007199254740992.0;
+}
+
+static double SampleLatency(const struct Latency *l) {
+    double u = Random(), value;
+
+    switch (l->kind) {
+        case FIXED:
+            value = l->a;
+            break;
+        case UNIFORM:
+            value = l->a + (l->b - l->a) * u;
+            break;
+        case EXPONENTIAL:
+            value = -l->a * log(1 - u);
+            break;
+        case PARETO:
+            value = l->a / pow(1 - u, 1 / l->b);
+            break;
+        default:
+            return 0;
+    }
+
+    return value < MAX_LATENCY_US ? value : MAX_LATENCY_US;
+}
+
+static void SleepMicros(double micros) {
+    struct timespec ts = { (time_t) (micros / 1e6), (long) fmod(micros, 1e6) * 1000 };
+
+    while (micros > 0 && nanosleep(&ts, &ts) && errno == EINTR);
+}
+
+static int WriteFully(int fd, const char *data, size_t length) {
+    while (length) {
+        ssize_t sent = send(fd, data, length, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR)
+            continue;
+        if (sent <= 0)
+            return -1;
+        data += sent;
+        length -= (size_t) sent;
+    }
+
+    return 0;
+}
+
+// Same framing as fdhelper: 4-byte big-endian length, descriptors attached to the first byte
+static void SendFrame(int sock, const int *fds, int count, const char *message) {
+    size_t length = strlen(message);
+    unsigned char header[4] = {
+        (unsigned char) (length >> 24), (unsigned char) (length >> 16), (unsigned char) (length >> 8), (unsigned char) length
+    };
+
+    union {
+        struct cmsghdr header;
+        char space[CMSG_SPACE(sizeof(int) * MAX_BATCH_OPEN)];
+    } control;
+
+    struct iovec iov[2] = { { header, sizeof(header) }, { (void *) message, length } };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+
+    if (count) {
+        msg.msg_control = &control;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * count);
+    }
+
+    ssize_t sent;
+    do {
+        sent = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    } while (sent < 0 && errno == EINTR);
+
+    if (sent < 0)
+        exit(0);
+
+    if ((size_t) sent < sizeof(header) + length) {
+        size_t done = (size_t) sent;
+        if ((done < sizeof(header) && WriteFully(sock, (const char *) header + done, sizeof(header) - done))
+                || WriteFully(sock, message + (done > sizeof(header) ? done - sizeof(header) : 0),
+                              length - (done > sizeof(header) ? done - sizeof(header) : 0)))
+            exit(0);
+    }
+}
+
+// Reading requests, see FdReq#toBytes. Arguments are parsed without knowledge of opcodes: numbers are decimal,
+// strings are prefixed with their length and colon. Attached descriptors are not needed and closed at once.
+
+static char input[65536];
+static size_t inputPos, inputSize;
+
+static int NextByte(int sock, int consume) {
+    if (inputPos == inputSize) {
+        union {
+            struct cmsghdr header;
+            char space[CMSG_SPACE(sizeof(int) * 4)];
+        } control;
+
+        struct iovec iov = { input, sizeof(input) };
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = &control;
+        msg.msg_controllen = sizeof(control);
+
+        ssize_t got;
+        do {
+            got = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+        } while (got < 0 && errno == EINTR);
+
+        if (got <= 0)
+            exit(0);
+
+        struct cmsghdr *cmsg;
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+                int *fds = (int *) CMSG_DATA(cmsg);
+                size_t i, count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                for (i = 0; i < count; i++)
+                    close(fds[i]);
+            }
+        }
+
+        inputPos = 0;
+        inputSize = (size_t) got;
+    }
+
+    return consume ? (unsigned char) input[inputPos++] : (unsigned char) input[inputPos];
+}
+
+struct Request {
+    char op;
+    int argc;
+    char isString[MAX_ARGS];
+    long numbers[MAX_ARGS];
+    char *strings[MAX_ARGS];
+};
+
+static void ReadRequest(int sock, struct Request *r) {
+    int c;
+
+    while ((c = NextByte(sock, 1)) == ' ' || c == '\n');
+
+    r->op = (char) c;
+    r->argc = 0;
+
+    while ((c = NextByte(sock, 1)) != '\n') {
+        if (c == ' ')
+            continue;
+
+        int negative = c == '-';
+        long value = 0;
+
+        if (negative)
+            c = NextByte(sock, 1);
+
+        while (c >= '0' && c <= '9') {
+            value = value * 10 + (c - '0');
+            if (value > MAX_STRING * 2L)
+                exit(1);
+
+            int next = NextByte(sock, 0);
+            if ((next < '0' || next > '9') && next != ':')
+                break;
+
+            c = NextByte(sock, 1);
+        }
+
+        if (r->argc == MAX_ARGS)
+            exit(1);
+
+        int i = r->argc++;
+
+        if (c == ':') {
+            if (value > MAX_STRING)
+                exit(1);
+
+            r->isString[i] = 1;
+            r->strings[i] = malloc((size_t) value + 1);
+            if (r->strings[i] == NULL)
+                exit(1);
+
+            long j;
+            for (j = 0; j < value; j++)
+                r->strings[i][j] = (char) NextByte(sock, 1);
+            r->strings[i][value] = '\0';
+        } else {
+            r->isString[i] = 0;
+            r->numbers[i] = negative ? -value : value;
+        }
+    }
+}
+
+static void FreeRequest(struct Request *r) {
+    int i;
+    for (i = 0; i < r->argc; i++)
+        if (r->isString[i])
+            free(r->strings[i]);
+}
+
+static const char *StringArg(const struct Request *r, int i) {
+    return i < r->argc && r->isString[i] ? r->strings[i] : "";
+}
+
+static int IntArg(const struct Request *r, int i) {
+    return i < r->argc && !r->isString[i] ? (int) r->numbers[i] : 0;
+}
+
+// FileDescriptorFactory constants are those of x86, which fdhelper translates for MIPS only
+static int TranslateMode(int mode) {
+    return mode | O_CLOEXEC;
+}
+
+// Serving requests
+
+static char lastResponse[8192] = "OK";
+
+static void Respond(int sock, const int *fds, int count, const char *message) {
+    int i;
+
+    // a late response to some earlier request, as if the helper completed requests out of order
+    if (staleProbability > 0 && Random() < staleProbability)
+        SendFrame(sock, NULL, 0, lastResponse);
+
+    if (count && dropProbability > 0 && Random() < dropProbability)
+        count = 0;
+
+    SendFrame(sock, fds, count, message);
+
+    snprintf(lastResponse, sizeof(lastResponse), "%s", message);
+
+    for (i = 0; i < count; i++)
+        close(fds[i]);
+}
+
+static void RespondError(int sock, const char *action, int err) {
+    char message[PATH_MAX + 128];
+    snprintf(message, sizeof(message), "Error: failed to %s - %s", action, strerror(err));
+    Respond(sock, NULL, 0, message);
+}
+
+static void Serve(int sock, int tty) {
+    struct Request r;
+
+    for (;;) {
+        // the server closing it's end of tty is the same as SIGHUP to real helper
+        if (tty >= 0 && inputPos == inputSize) {
+            struct pollfd fds[2] = { { sock, POLLIN, 0 }, { tty, POLLIN, 0 } };
+            if (poll(fds, 2, -1) < 0 && errno != EINTR)
+                Die("poll() failed");
+            if (fds[1].revents)
+                exit(0);
+            if (!fds[0].revents)
+                continue;
+        }
+
+        ReadRequest(sock, &r);
+
+        served++;
+
+        if (crashAt && served == crashAt)
+            abort();
+
+        if (stallEvery && served % stallEvery == 0)
+            SleepMicros(stallMs * 1000.0);
+
+        SleepMicros(SampleLatency(&latencies[(unsigned char) r.op & 127]));
+
+        switch (r.op) {
+            case 'o': {
+                int fd = open(StringArg(&r, 0), TranslateMode(IntArg(&r, 1)), 0666);
+                if (fd < 0)
+                    RespondError(sock, "open a file", errno);
+                else
+                    Respond(sock, &fd, 1, "READY");
+                break;
+            }
+            case 'r': {
+                char path[PATH_MAX * 2], resolved[PATH_MAX], message[PATH_MAX * 2 + 8];
+                snprintf(path, sizeof(path), "%s/%s", StringArg(&r, 0), StringArg(&r, 1));
+
+                int fd = open(path, TranslateMode(IntArg(&r, 2)), 0666);
+                if (fd < 0) {
+                    RespondError(sock, "open a file", errno);
+                } else {
+                    snprintf(message, sizeof(message), "READY %s", realpath(path, resolved) ? resolved : path);
+                    Respond(sock, &fd, 1, message);
+                }
+                break;
+            }
+            case 'm': {
+                int fds[MAX_BATCH_OPEN], count = 0, i, files = IntArg(&r, 0);
+                char message[16 * (MAX_BATCH_OPEN + 1)];
+                size_t length = (size_t) snprintf(message, sizeof(message), "READY");
+
+                for (i = 0; i < files && i < MAX_BATCH_OPEN; i++) {
+                    int fd = open(StringArg(&r, i * 2 + 1), TranslateMode(IntArg(&r, i * 2 + 2)), 0666);
+                    if (fd >= 0)
+                        fds[count] = fd;
+                    length += (size_t) snprintf(message + length, sizeof(message) - length, " %d", fd >= 0 ? count++ : -errno);
+                }
+
+                Respond(sock, fds, count, count ? message : "OK");
+                break;
+            }
+            case 'p':
+                Respond(sock, NULL, 0, "OK");
+                break;
+            default:
+                Respond(sock, NULL, 0, "Error: not supported by fdfake");
+        }
+
+        FreeRequest(&r);
+    }
+}
+
+static int LocalSocket(const char *name, int listening) {
+    int sock = socket(PF_LOCAL, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0)
+        Die("socket() failed");
+
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_LOCAL;
+    strncpy(address.sun_path + 1, name, sizeof(address.sun_path) - 2);
+
+    socklen_t size = (socklen_t) (sizeof(address) - sizeof(address.sun_path) + strlen(address.sun_path + 1) + 1);
+
+    if (listening ? bind(sock, (struct sockaddr *) &address, size) || listen(sock, 16)
+                  : connect(sock, (struct sockaddr *) &address, size))
+        Die(listening ? "listening failed" : "connect() failed");
+
+    return sock;
+}
+
+// Same greeting as fdhelper Bootstrap, with a socket pair standing in for the controlling tty
+static void RunHelper(const char *address) {
+    int tty[2];
+
+    pid_t pid = fork();
+    if (pid < 0)
+        Die("fork() failed");
+
+    if (pid) {
+        printf("PID:%d", pid);
+        exit(0);
+    }
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, tty))
+        Die("socketpair() failed");
+
+    int sock = LocalSocket(address, 0);
+
+    SendFrame(sock, &tty[0], 1, "READY");
+    close(tty[0]);
+
+    char go[3];
+    if (read(tty[1], go, sizeof(go)) != sizeof(go) || memcmp(go, "GO\n", 3))
+        exit(1);
+
+    Serve(sock, tty[1]);
+}
+
+// Same as fdhelper --daemon, but accepting anyone: each client is served in it's own process
+static void RunDaemon(const char *name) {
+    int listener = LocalSocket(name, 1);
+    unsigned long clients = 0;
+
+    signal(SIGCHLD, SIG_IGN);
+
+    for (;;) {
+        int sock = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+        if (sock < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            Die("accept() failed");
+        }
+
+        // each client gets it's own, but reproducible, schedule
+        clients++;
+
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(listener);
+            seed += clients * 0x9E3779B97F4A7C15ULL;
+            SendFrame(sock, NULL, 0, "OK");
+            Serve(sock, -1);
+        }
+
+        close(sock);
+    }
+}
+
+static int ParseLatency(char *spec) {
+    char *colon = strchr(spec, ':');
+    if (colon == NULL || colon == spec)
+        return -1;
+    *colon = '\0';
+
+    struct Latency l = { NONE, 0, 0 };
+    char kind[16];
+
+    if (sscanf(colon + 1, "%15[a-z]:%lf:%lf", kind, &l.a, &l.b) < 2)
+        return -1;
+
+    if (!strcmp(kind, "fixed"))
+        l.kind = FIXED;
+    else if (!strcmp(kind, "uniform") && l.b >= l.a)
+        l.kind = UNIFORM;
+    else if (!strcmp(kind, "exp"))
+        l.kind = EXPONENTIAL;
+    else if (!strcmp(kind, "pareto") && l.b > 0)
+        l.kind = PARETO;
+    else
+        return -1;
+
+    if (!(l.a >= 0))
+        return -1;
+
+    int i;
+    for (i = 0; i < 128; i++)
+        if (!strcmp(spec, "*") || strchr(spec, i) != NULL)
+            latencies[i] = l;
+
+    return 0;
+}
+
+static void Usage() {
+    fprintf(stderr,
+        "Usage: fdfake [options] <address>          stand in for fdhelper, started by FileDescriptorFactory\n"
+        "       fdfake [options] --daemon <name>    accept connections like fdhelper --daemon\n"
+        "Options:\n"
+        "  -l <ops>:<latency>  delay responses to given opcodes (or '*' for all) by microseconds:\n"
+        "                      fixed:<us>, uniform:<min>:<max>, exp:<mean> or pareto:<min>:<alpha>\n"
+        "  -s <n>:<ms>         stall every n-th request for given milliseconds\n"
+        "  -d <probability>    drop descriptors from responses\n"
+        "  -o <probability>    send a stale copy of previous response before the actual one\n"
+        "  -c <n>              crash upon n-th request\n"
+        "  -S <seed>           seed of random schedule (default 1)\n");
+    exit(2);
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+
+    // getopt would take --daemon for unknown long option
+    while (optind < argc && strcmp(argv[optind], "--daemon") && (opt = getopt(argc, argv, "+l:s:d:o:c:S:")) != -1) {
+        switch (opt) {
+            case 'l':
+                if (ParseLatency(optarg))
+                    Usage();
+                break;
+            case 's':
+                if (sscanf(optarg, "%lu:%lu", &stallEvery, &stallMs) != 2)
+                    Usage();
+                break;
+            case 'd':
+                dropProbability = strtod(optarg, NULL);
+                break;
+            case 'o':
+                staleProbability = strtod(optarg, NULL);
+                break;
+            case 'c':
+                crashAt = strtoul(optarg, NULL, 10);
+                break;
+            case 'S':
+                seed = strtoull(optarg, NULL, 10) | 1;
+                break;
+            default:
+                Usage();
+        }
+    }
+
+    if (optind + 2 == argc && !strcmp(argv[optind], "--daemon"))
+        RunDaemon(argv[optind + 1]);
+    else if (optind + 1 == argc)
+        RunHelper(argv[optind]);
+
+    Usage();
+}
@@ -0,0 +1,658 @@
+/*
+ * Copyright © 2015 Alexander Rvachev
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// fdreplay: replays traces, recorded by FactoryOptions#recordTrace, against fdhelper, running in daemon mode,
+// and generates synthetic directory trees for them. Builds on Linux hosts and Android alike, see README.md.
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+// must match TraceRecorder constants
+#define TRACE_VERSION 1
+#define TRACE_FLAG_PATHS 1
+#define RESULT_OK 0
+#define RESULT_ERROR 1
+#define RESULT_BROKEN 2
+#define RESULT_DENIED 1000
+
+// must match FileDescriptorFactory#MAX_BATCH_OPEN
+#define MAX_BATCH_OPEN 16
+
+// must match MAX_RESPONSE_SIZE in fdhelper.c
+#define MAX_MESSAGE (64 * 1024)
+#define MAX_FDS 64
+
+struct Arg {
+    char type; // 'i', 'p' (absolute path) or 'q' (relative path or other string)
+    int32_t value;
+    char *str;
+};
+
+struct Record {
+    uint32_t delay; // microseconds since start of previous request
+    uint32_t latency;
+    char op;
+    int16_t result;
+    int argc;
+    struct Arg *args;
+};
+
+struct Trace {
+    int withPaths;
+    size_t count;
+    struct Record *records;
+};
+
+struct OpStats {
+    size_t count;
+    size_t errors;
+    size_t mismatched;
+    size_t broken;
+    uint32_t *latencies;
+    uint32_t *recorded;
+};
+
+static void Die(const char *format, ...) __attribute__((format(printf, 1, 2), noreturn));
+
+static void Die(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+    fputc('\n', stderr);
+    exit(1);
+}
+
+static void *Alloc(size_t size) {
+    void *result = calloc(1, size ? size : 1);
+    if (result == NULL)
+        Die("out of memory");
+    return result;
+}
+
+// Reading the trace
+
+struct Reader {
+    const unsigned char *data;
+    size_t size;
+    size_t pos;
+};
+
+static int Available(struct Reader *r, size_t count) {
+    return r->size - r->pos >= count;
+}
+
+static uint64_t ReadBE(struct Reader *r, int bytes) {
+    uint64_t value = 0;
+
+    if (!Available(r, (size_t) bytes))
+        Die("truncated trace at offset %zu", r->pos);
+
+    while (bytes--)
+        value = value << 8 | r->data[r->pos++];
+
+    return value;
+}
+
+static void LoadTrace(const char *path, struct Trace *trace) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+        Die("can not open %s: %s", path, strerror(errno));
+
+    size_t capacity = 1 << 20, size = 0, got;
+    unsigned char *data = malloc(capacity);
+    while (data && (got = fread(data + size, 1, capacity - size, file)) > 0) {
+        size += got;
+        if (size == capacity)
+            data = realloc(data, capacity *= 2);
+    }
+    if (data == NULL)
+        Die("out of memory");
+    fclose(file);
+
+    struct Reader r = { data, size, 0 };
+
+    if (!Available(&r, 6) || memcmp(data, "FDTR", 4) || data[4] != TRACE_VERSION)
+        Die("%s is not a trace or has unsupported version", path);
+
+    r.pos = 5;
+    trace->withPaths = (ReadBE(&r, 1) & TRACE_FLAG_PATHS) != 0;
+    ReadBE(&r, 8); // wall clock time of recording
+
+    size_t allocated = 1024;
+    trace->records = Alloc(allocated * sizeof(struct Record));
+    trace->count = 0;
+
+    while (r.pos < r.size) {
+        if (trace->count == allocated) {
+            trace->records = realloc(trace->records, (allocated *= 2) * sizeof(struct Record));
+            if (trace->records == NULL)
+                Die("out of memory");
+        }
+
+        struct Record *rec = &trace->records[trace->count++];
+        rec->delay = (uint32_t) ReadBE(&r, 4);
+        rec->latency = (uint32_t) ReadBE(&r, 4);
+        rec->op = (char) ReadBE(&r, 1);
+        rec->result = (int16_t) ReadBE(&r, 2);
+        rec->argc = (int) ReadBE(&r, 1);
+        rec->args = Alloc(rec->argc * sizeof(struct Arg));
+
+        int i;
+        for (i = 0; i < rec->argc; i++) {
+            struct Arg *arg = &rec->args[i];
+            arg->type = (char) ReadBE(&r, 1);
+
+            if (arg->type == 'i') {
+                arg->value = (int32_t) ReadBE(&r, 4);
+            } else if (arg->type == 'p' || arg->type == 'q') {
+                if (trace->withPaths) {
+                    size_t length = (size_t) ReadBE(&r, 2);
+                    if (!Available(&r, length))
+                        Die("truncated trace at offset %zu", r.pos);
+                    arg->str = Alloc(length + 1);
+                    memcpy(arg->str, data + r.pos, length);
+                    r.pos += length;
+                } else {
+                    arg->str = Alloc(17);
+                    snprintf(arg->str, 17, "%016" PRIx64, ReadBE(&r, 8));
+                }
+            } else {
+                Die("unknown argument type %d at offset %zu", arg->type, r.pos);
+            }
+        }
+    }
+
+    free(data);
+}
+
+// Absolute paths are placed under the root, hashed ones become files, named after the hash, in the root itself
+static char *MapPath(const char *root, const struct Arg *arg) {
+    if (arg->type != 'p')
+        return strdup(arg->str);
+
+    char *result;
+    if (asprintf(&result, "%s%s%s", root, arg->str[0] == '/' ? "" : "/", arg->str) < 0)
+        Die("out of memory");
+    return result;
+}
+
+// Generating the tree
+
+static int MakeDirs(char *path, int includingLast) {
+    char *slash = path;
+    int failed = 0;
+
+    while ((slash = strchr(slash + 1, '/')) != NULL) {
+        *slash = '\0';
+        if (mkdir(path, 0755) && errno != EEXIST)
+            failed = 1;
+        *slash = '/';
+    }
+
+    if (includingLast && mkdir(path, 0755) && errno != EEXIST)
+        failed = 1;
+
+    return failed ? -1 : 0;
+}
+
+static int MakeFile(char *path, off_t size) {
+    if (MakeDirs(path, 0))
+        return -1;
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return errno == EEXIST ? 0 : -1;
+
+    int result = ftruncate(fd, size);
+    close(fd);
+    return result;
+}
+
+static int CreateEntry(const char *root, const struct Record *rec, int i, off_t size) {
+    char *path = MapPath(root, &rec->args[i]);
+    int result;
+
+    switch (rec->op) {
+        case 'r': {
+            // base directory, followed by the path, relative to it
+            if (i != 0 || rec->argc < 2) {
+                result = 0;
+                break;
+            }
+
+            char *file;
+            if (asprintf(&file, "%s/%s", path, rec->args[1].str) < 0)
+                Die("out of memory");
+            result = MakeDirs(path, 1) | MakeFile(file, size);
+            free(file);
+            break;
+        }
+        case 'a':
+        case 'w':
+        case 'x':
+            result = MakeDirs(path, 1);
+            break;
+        default:
+            result = MakeFile(path, size);
+    }
+
+    free(path);
+    return result;
+}
+
+// Files, that were not opened successfully, are not created, so that replay reproduces the failures
+static int GenerateTree(const struct Trace *trace, const char *root, off_t size) {
+    size_t n, failures = 0, created = 0;
+
+    if (MakeDirs((char *) root, 1))
+        Die("can not create %s: %s", root, strerror(errno));
+
+    for (n = 0; n < trace->count; n++) {
+        const struct Record *rec = &trace->records[n];
+        int i;
+
+        if (rec->result != RESULT_OK || rec->op == 'b')
+            continue;
+
+        for (i = 0; i < rec->argc; i++) {
+            if (rec->args[i].type != 'p')
+                continue;
+
+            if (CreateEntry(root, rec, i, size))
+                failures++;
+            else
+                created++;
+        }
+    }
+
+    printf("%zu entries created under %s, %zu failed\n", created, root, failures);
+
+    return failures ? 1 : 0;
+}
+
+// Talking to the helper
+
+static int Connect(const char *name) {
+    int sock = socket(PF_LOCAL, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0)
+        Die("socket() failed: %s", strerror(errno));
+
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_LOCAL;
+    strncpy(address.sun_path + 1, name, sizeof(address.sun_path) - 2);
+
+    socklen_t size = (socklen_t) (sizeof(address) - sizeof(address.sun_path) + strlen(address.sun_path + 1) + 1);
+
+    if (connect(sock, (struct sockaddr *) &address, size))
+        Die("can not connect to %s: %s", name, strerror(errno));
+
+    return sock;
+}
+
+// Each frame is prefixed with it's length as 4-byte big-endian integer, descriptors arrive with it's first byte
+static int ReceiveFrame(int sock, char *message, int *fds, int *fdCount) {
+    unsigned char buffer[MAX_MESSAGE + 4];
+    size_t received = 0, expected = 4;
+
+    *fdCount = 0;
+
+    while (received < expected) {
+        union {
+            struct cmsghdr header;
+            char space[CMSG_SPACE(sizeof(int) * MAX_FDS)];
+        } control;
+
+        struct iovec iov = { buffer + received, expected - received };
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = &control;
+        msg.msg_controllen = sizeof(control);
+
+        ssize_t got = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            return -1;
+
+        struct cmsghdr *cmsg;
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+                int count = (int) ((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+                if (*fdCount + count > MAX_FDS)
+                    return -1;
+                memcpy(fds + *fdCount, CMSG_DATA(cmsg), count * sizeof(int));
+                *fdCount += count;
+            }
+        }
+
+        received += (size_t) got;
+
+        if (received == 4) {
+            uint32_t length = (uint32_t) buffer[0] << 24 | buffer[1] << 16 | buffer[2] << 8 | buffer[3];
+            if (length > MAX_MESSAGE)
+                return -1;
+            expected = 4 + length;
+        }
+    }
+
+    memcpy(message, buffer + 4, received - 4);
+    message[received - 4] = '\0';
+
+    return 0;
+}
+
+struct Buffer {
+    char *data;
+    size_t size;
+    size_t capacity;
+};
+
+static void Append(struct Buffer *b, const char *data, size_t length) {
+    if (b->size + length > b->capacity) {
+        b->capacity = (b->size + length) * 2;
+        b->data = realloc(b->data, b->capacity);
+        if (b->data == NULL)
+            Die("out of memory");
+    }
+
+    memcpy(b->data + b->size, data, length);
+    b->size += length;
+}
+
+// Same encoding as FdReq#toBytes
+static void BuildRequest(struct Buffer *b, const char *root, const struct Record *rec) {
+    char number[32];
+    int i;
+
+    b->size = 0;
+    Append(b, &rec->op, 1);
+
+    for (i = 0; i < rec->argc; i++) {
+        Append(b, " ", 1);
+
+        if (rec->args[i].type == 'i') {
+            Append(b, number, (size_t) snprintf(number, sizeof(number), "%d", rec->args[i].value));
+        } else {
+            char *str = MapPath(root, &rec->args[i]);
+            size_t length = strlen(str);
+            Append(b, number, (size_t) snprintf(number, sizeof(number), "%zu:", length));
+            Append(b, str, length);
+            free(str);
+        }
+    }
+
+    Append(b, "\n", 1);
+}
+
+static int Replayable(char op) {
+    // opening by handle needs the handle itself, extraction needs an archive, policy is installed once
+    return op && strchr("ormhgawf", op) != NULL;
+}
+
+static int Classify(const char *message, int fdCount) {
+    // same as FileDescriptorFactory, a descriptor is expected to accompany "READY"
+    if (!strncmp(message, "READY", 5))
+        return fdCount ? RESULT_OK : RESULT_ERROR;
+
+    if (strncmp(message, "Error:", 6))
+        return RESULT_OK;
+
+    size_t length = strlen(message);
+    const char *denial = " - denied by policy";
+    return length >= strlen(denial) && !strcmp(message + length - strlen(denial), denial) ? RESULT_DENIED : RESULT_ERROR;
+}
+
+static uint64_t Now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + (uint64_t) ts.tv_nsec / 1000;
+}
+
+static void SleepUntil(uint64_t deadline) {
+    struct timespec ts = { (time_t) (deadline / 1000000), (long) (deadline % 1000000) * 1000 };
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+static int CompareLatency(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+static uint32_t Percentile(uint32_t *values, size_t count, double percentile) {
+    if (count == 0)
+        return 0;
+
+    size_t index = (size_t) (percentile / 100 * count + 0.999999);
+    return values[index == 0 ? 0 : (index > count ? count : index) - 1];
+}
+
+static void Drain(int fd) {
+    char buffer[65536];
+    ssize_t got;
+
+    while ((got = read(fd, buffer, sizeof(buffer))) > 0 || (got < 0 && errno == EINTR));
+}
+
+static int OpenSession(const char *name) {
+    char message[MAX_MESSAGE + 1];
+    int fds[MAX_FDS], fdCount, i;
+
+    int sock = Connect(name);
+
+    if (ReceiveFrame(sock, message, fds, &fdCount) || strncmp(message, "OK", 2))
+        Die("rejected by daemon: %s", message);
+
+    for (i = 0; i < fdCount; i++)
+        close(fds[i]);
+
+    return sock;
+}
+
+static int Replay(const struct Trace *trace, const char *root, const char *name, double speed) {
+    struct OpStats stats[128];
+    struct Buffer request = { NULL, 0, 0 };
+    char message[MAX_MESSAGE + 1];
+    int fds[MAX_FDS], fdCount, i;
+    size_t n, skipped = 0, replayed = 0;
+
+    memset(stats, 0, sizeof(stats));
+    for (i = 0; i < 128; i++) {
+        stats[i].latencies = Alloc(trace->count * sizeof(uint32_t));
+        stats[i].recorded = Alloc(trace->count * sizeof(uint32_t));
+    }
+
+    int sock = OpenSession(name);
+
+    uint64_t started = Now(), offset = 0;
+
+    for (n = 0; n < trace->count; n++) {
+        const struct Record *rec = &trace->records[n];
+
+        offset += rec->delay;
+
+        if (!Replayable(rec->op)) {
+            skipped++;
+            continue;
+        }
+
+        if (speed > 0)
+            SleepUntil(started + (uint64_t) (offset / speed));
+
+        BuildRequest(&request, root, rec);
+
+        uint64_t start = Now();
+
+        struct OpStats *s = &stats[(unsigned char) rec->op];
+
+        replayed++;
+
+        // the daemon serves each connection by separate process, so the replay goes on after helper crashes
+        if (send(sock, request.data, request.size, MSG_NOSIGNAL) != (ssize_t) request.size
+                || ReceiveFrame(sock, message, fds, &fdCount)) {
+            s->broken++;
+            s->errors++;
+
+            close(sock);
+            sock = OpenSession(name);
+            continue;
+        }
+
+        // pipes with results of hashing and archiving are consumed, because that is part of the job
+        if (fdCount && (rec->op == 'h' || rec->op == 'a'))
+            Drain(fds[0]);
+
+        uint32_t latency = (uint32_t) (Now() - start);
+
+        int result = Classify(message, fdCount);
+
+        for (i = 0; i < fdCount; i++)
+            close(fds[i]);
+
+        s->latencies[s->count] = latency;
+        s->recorded[s->count] = rec->latency;
+        s->count++;
+
+        if (result != RESULT_OK)
+            s->errors++;
+
+        if (result != rec->result && rec->result != RESULT_BROKEN)
+            s->mismatched++;
+    }
+
+    uint64_t elapsed = Now() - started;
+
+    close(sock);
+
+    printf("%-3s %9s %7s %7s %10s %9s %9s %9s %12s %12s\n",
+           "op", "count", "errors", "broken", "mismatched", "p50 us", "p99 us", "max us", "rec p50 us", "rec p99 us");
+
+    for (i = 0; i < 128; i++) {
+        struct OpStats *s = &stats[i];
+        if (s->count == 0)
+            continue;
+
+        qsort(s->latencies, s->count, sizeof(uint32_t), CompareLatency);
+        qsort(s->recorded, s->count, sizeof(uint32_t), CompareLatency);
+
+        printf("%-3c %9zu %7zu %7zu %10zu %9" PRIu32 " %9" PRIu32 " %9" PRIu32 " %12" PRIu32 " %12" PRIu32 "\n",
+               i, s->count + s->broken, s->errors, s->broken, s->mismatched,
+               Percentile(s->latencies, s->count, 50), Percentile(s->latencies, s->count, 99),
+               Percentile(s->latencies, s->count, 100),
+               Percentile(s->recorded, s->count, 50), Percentile(s->recorded, s->count, 99));
+    }
+
+    printf("%zu requests skipped, replay took %.3f s (%.0f requests/s), recording took %.3f s\n",
+           skipped, elapsed / 1e6, elapsed ? replayed * 1e6 / elapsed : 0.0, offset / 1e6);
+
+    return 0;
+}
+
+// Synthetic workload: sequential opens of given number of files, at most MAX_BATCH_OPEN at once for each
+// batchEvery-th request, without delays. The files are named after their index in /synth directory.
+static void Synthesize(const char *path, unsigned files, unsigned requests, unsigned batchEvery) {
+    FILE *file = fopen(path, "wb");
+    if (file == NULL)
+        Die("can not create %s: %s", path, strerror(errno));
+
+    unsigned char header[14] = { 'F', 'D', 'T', 'R', TRACE_VERSION, TRACE_FLAG_PATHS };
+    fwrite(header, 1, sizeof(header), file);
+
+    unsigned n, next = 0;
+    for (n = 0; n < requests; n++) {
+        int batch = batchEvery && n % batchEvery == batchEvery - 1;
+        unsigned count = batch ? (files < MAX_BATCH_OPEN ? files : MAX_BATCH_OPEN) : 1, i;
+
+        // zero delay and latency, 'o' or 'm', result, argument count
+        unsigned char record[12] = { 0, 0, 0, 0, 0, 0, 0, 0, batch ? 'm' : 'o', 0, 0, 0 };
+        record[11] = (unsigned char) (batch ? count * 2 + 1 : 2);
+        fwrite(record, 1, sizeof(record), file);
+
+        if (batch) {
+            unsigned char arg[5] = { 'i', 0, 0, 0, (unsigned char) count };
+            fwrite(arg, 1, sizeof(arg), file);
+        }
+
+        for (i = 0; i < count; i++) {
+            char name[32];
+            unsigned char length = (unsigned char) snprintf(name, sizeof(name), "/synth/%08u", next++ % files);
+            unsigned char arg[3] = { 'p', 0, length };
+            unsigned char mode[5] = { 'i', 0, 0, 0, 0 }; // O_RDONLY
+
+            fwrite(arg, 1, sizeof(arg), file);
+            fwrite(name, 1, length, file);
+            fwrite(mode, 1, sizeof(mode), file);
+        }
+    }
+
+    if (fclose(file))
+        Die("can not write %s: %s", path, strerror(errno));
+}
+
+static void Usage() {
+    Die("Usage:\n"
+        "  fdreplay tree <trace> <root> [file size]\n"
+        "  fdreplay run <trace> <root> <daemon socket name> [speed]\n"
+        "  fdreplay synth <trace> <files> <requests> [batch every n-th request]\n"
+        "Speed is 1 for recorded timing (the default), 2 for twice as fast etc. or 0 for maximum speed");
+}
+
+int main(int argc, char *argv[]) {
+    struct Trace trace;
+
+    if (argc >= 4 && argc <= 5 && !strcmp(argv[1], "tree")) {
+        LoadTrace(argv[2], &trace);
+        return GenerateTree(&trace, argv[3], argc == 5 ? (off_t) strtoll(argv[4], NULL, 10) : 4096);
+    }
+
+    if (argc >= 5 && argc <= 6 && !strcmp(argv[1], "run")) {
+        double speed = argc == 6 ? strtod(argv[5], NULL) : 1;
+        if (!(speed >= 0))
+            Usage();
+
+        LoadTrace(argv[2], &trace);
+        return Replay(&trace, argv[3], argv[4], speed);
+    }
+
+    if (argc >= 5 && argc <= 6 && !strcmp(argv[1], "synth")) {
+        unsigned files = (unsigned) strtoul(argv[3], NULL, 10);
+        if (files == 0)
+            Usage();
+
+        Synthesize(argv[2], files, (unsigned) strtoul(argv[4], NULL, 10),
+                   argc == 6 ? (unsigned) strtoul(argv[5], NULL, 10) : 0);
+        return 0;
+    }
+
+    Usage();
+}